@@ -73,6 +73,8 @@ static void init_once(void *foo)
 {
     struct svfs_inode *si = (struct svfs_inode *)foo;
 
+    init_rwsem(&si->llfs_sem);
+    spin_lock_init(&si->llfs_lock);
     inode_init_once(&si->vfs_inode);
 }
 
@@ -137,8 +139,14 @@ static int __init init_svfs(void)
 
     if (!svfs_lib_proc_init()) {
         svfs_err(client, "svfs: init root proc entry failed\n");
+    } else if (svfs_datastore_proc_init()) {
+        svfs_err(client, "svfs: init placement proc entry failed\n");
     }
 
+    err = svfs_migrate_init();
+    if (err)
+        goto out2;
+
     /* init tracing flags now */
     SVFS_LIB_TRACING_ADD(svfs_client_tracing_flags);
     SVFS_LIB_TRACING_ADD(svfs_mdc_tracing_flags);
@@ -146,6 +154,10 @@ static int __init init_svfs(void)
     SVFS_LIB_TRACING_ADD(svfs_lib_tracing_flags);
 
     return 0;
+out2:
+    svfs_datastore_proc_exit();
+    svfs_lib_proc_exit();
+    unregister_filesystem(&svfs_fs_type);
 out1:
     destroy_inodecache();
 out:
@@ -156,6 +168,8 @@ out:
 static void __exit exit_svfs(void)
 {
     svfs_lib_tracing_exit();
+    svfs_migrate_exit();
+    svfs_datastore_proc_exit();
     svfs_lib_proc_exit();
     unregister_filesystem(&svfs_fs_type);
     destroy_inodecache();
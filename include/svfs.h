@@ -60,6 +60,15 @@
 #include <linux/dcache.h>
 #include <linux/splice.h>
 #include <linux/pagemap.h>
+#include <linux/hash.h>
+#include <linux/rbtree.h>
+#include <linux/parser.h>
+#include <linux/workqueue.h>
+#include <linux/crc32c.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/seqlock.h>
+#include <linux/rculist_nulls.h>
 
 /* svfs inode structures */
 #include "svfs_i.h"
@@ -148,6 +157,8 @@ extern struct kmem_cache *svfs_inode_cachep;
 extern int svfs_get_sb(struct file_system_type *, int, const char *,
                        void *, struct vfsmount *);
 extern void svfs_kill_super(struct super_block *);
+extern struct svfs_super_block *svfs_alloc_sb(void);
+extern void svfs_free_sb(struct svfs_super_block *);
 /* APIs for inode.c */
 extern int svfs_write_inode(struct inode *, int);
 extern void svfs_dirty_inode(struct inode*);
@@ -180,9 +191,30 @@ extern struct svfs_datastore *svfs_datastore_add_new(int, char *);
 extern void svfs_datastore_free(struct svfs_datastore *);
 extern void svfs_datastore_exit(void);
 extern struct svfs_datastore *svfs_datastore_get(int type, u32 fsid);
+extern struct svfs_datastore *svfs_datastore_get_tier(int tier);
+extern int svfs_datastore_tier_of(u32 flags);
+extern void svfs_datastore_classify(struct inode *, loff_t);
 extern int svfs_datastore_adding(char *);
 extern u32 svfs_datastore_fsid(char *pathname); /* ignore llfs type? */
 extern void svfs_datastore_statfs(struct kstatfs *);
+extern ktime_t svfs_datastore_io_begin(struct svfs_datastore *);
+extern void svfs_datastore_io_end(struct svfs_datastore *, ktime_t);
+extern int svfs_datastore_proc_init(void);
+extern void svfs_datastore_proc_exit(void);
+extern struct svfs_datastore *svfs_datastore_lookup(char *pathname);
+extern int svfs_datastore_drain(char *pathname, int on);
+/* APIs for migrate.c */
+struct svfs_ioc_migrate
+{
+    char target[NAME_MAX];      /* datastore pathname, "" by size class */
+};
+#define SVFS_IOC_MIGRATE _IOW('v', 1, struct svfs_ioc_migrate)
+extern int svfs_migrate_init(void);
+extern void svfs_migrate_exit(void);
+extern int svfs_migrate_queue(struct inode *, struct svfs_datastore *);
+extern void svfs_migrate_misplaced(struct inode *);
+extern void svfs_migrate_register(struct super_block *);
+extern void svfs_migrate_cancel(struct super_block *);
 /* APIs for symlink.c */
 extern const struct inode_operations svfs_fast_symlink_inode_operations;
 /* APIs for lib/config.c */
@@ -198,6 +230,9 @@ extern struct proc_dir_entry *svfs_lib_proc_init(void);
 extern void svfs_lib_proc_exit(void);
 extern int svfs_lib_proc_add_entry(struct proc_dir_entry *, char *, 
                                    const struct file_operations *);
+extern int svfs_lib_proc_add_entry_data(struct proc_dir_entry *, char *, 
+                                        const struct file_operations *,
+                                        void *);
 extern void svfs_lib_proc_remove_entry(struct proc_dir_entry *, char *);
 extern struct proc_dir_entry *svfs_lib_proc_add_dir(
     struct proc_dir_entry *, char *);
@@ -219,34 +254,298 @@ extern char *svfs_backing_store;
 extern char *svfs_targeting_store;
 /* #define SVFS_BACKING_STORE_SIZE (10 * 1024 * 1024) */
 #define SVFS_BACKING_STORE_SIZE (256 * 1024)
+/* the table grows by segments, after one page of header */
+#define SVFS_BS_HDR_SIZE PAGE_CACHE_SIZE
+#define SVFS_BS_SEG_SIZE SVFS_BACKING_STORE_SIZE
+#define SVFS_BS_SEG_ENTRIES (SVFS_BS_SEG_SIZE /                 \
+                             sizeof(struct backing_store_entry))
+/* free slots a segment needs to place a new directory */
+#define SVFS_BS_DIR_HEADROOM 64
+#define SVFS_BS_MAX_SEGS 64     /* default limit, see bs_max_size= */
+#define SVFS_BS_SEG_PAGES (SVFS_BS_SEG_SIZE >> PAGE_CACHE_SHIFT)
+/* the name heap, a name never crosses a chunk */
+#define SVFS_BS_HEAP_CHUNK (64 * 1024)
+#define SVFS_BS_HEAP_CHUNKS 4096
+/* an ino is the slot in its store and the shard id above it */
+#define SVFS_SHARD_SHIFT 24
+#define SVFS_SHARD_SLOTS (1UL << SVFS_SHARD_SHIFT)
+
+/* the store holding @*ino, which becomes the slot in it */
+static inline
+struct svfs_super_block *svfs_bs_of(struct svfs_super_block *ssb,
+                                    unsigned long *ino)
+{
+    unsigned long id = *ino >> SVFS_SHARD_SHIFT;
+
+    if (likely(!id))
+        return ssb;
+    *ino &= SVFS_SHARD_SLOTS - 1;
+    return id <= ssb->bs_nshards ? ssb->bs_shards[id - 1] : NULL;
+}
+
+extern void svfs_shard_resolve(struct svfs_super_block *, unsigned long);
+
+/* the store holding the children of the directory @*dir */
+static inline
+struct svfs_super_block *svfs_bs_dir(struct svfs_super_block *ssb,
+                                     unsigned long *dir)
+{
+    struct svfs_super_block *bs = svfs_bs_of(ssb, dir);
+    int i;
+
+    if (bs != ssb)
+        return bs;
+    /* the root table is still loading, @*dir may be a stub not found */
+    if (unlikely(ACCESS_ONCE(ssb->bs_stubs_pending)) &&
+        *dir != SVFS_ROOT_INODE)
+        svfs_shard_resolve(ssb, *dir);
+    for (i = 0; i < ssb->bs_nshards; i++) {
+        if (ACCESS_ONCE(ssb->bs_shard_stub[i]) == *dir) {
+            *dir = SVFS_ROOT_INODE;
+            return ssb->bs_shards[i];
+        }
+    }
+    return ssb;
+}
+
+/* the ino of slot @ino of the store @bs */
+static inline
+unsigned long svfs_bs_ino(struct svfs_super_block *bs, unsigned long ino)
+{
+    return ino | ((unsigned long)bs->bs_shard_id << SVFS_SHARD_SHIFT);
+}
+
+static inline
+struct backing_store_entry *svfs_bse(struct svfs_super_block *ssb,
+                                     unsigned long ino)
+{
+    return ssb->bs_segs[ino / SVFS_BS_SEG_ENTRIES].bse + 
+        ino % SVFS_BS_SEG_ENTRIES;
+}
+
+static inline
+struct backing_store_node *svfs_bsn(struct svfs_super_block *ssb,
+                                    unsigned long ino)
+{
+    return ssb->bs_segs[ino / SVFS_BS_SEG_ENTRIES].bsn + 
+        ino % SVFS_BS_SEG_ENTRIES;
+}
+
+extern int svfs_backing_store_map(struct svfs_super_block *, int);
+
+/* may sleep, the segment of @ino is mapped on first touch */
+static inline
+struct backing_store_entry *svfs_bse_get(struct svfs_super_block *ssb,
+                                         unsigned long ino)
+{
+    int seg = ino / SVFS_BS_SEG_ENTRIES, err;
+
+    if (unlikely(!ACCESS_ONCE(ssb->bs_segs[seg].bse))) {
+        err = svfs_backing_store_map(ssb, seg);
+        if (err)
+            return ERR_PTR(err);
+    }
+    smp_rmb();
+    return svfs_bse(ssb, ino);
+}
+
+/* serialize against the other writers of the entry, see svfs_i.h */
+extern void svfs_snapshot_cow(struct svfs_super_block *, unsigned long);
+
+/* preserve the frozen page(s) of the entry, under the entry lock */
+static inline
+void svfs_bse_cow(struct svfs_super_block *ssb, unsigned long ino)
+{
+    if (unlikely(ACCESS_ONCE(ssb->bs_snap) != NULL))
+        svfs_snapshot_cow(ssb, ino);
+}
+
+static inline
+void svfs_bse_write_begin(struct svfs_super_block *ssb, unsigned long ino)
+{
+    struct backing_store_node *bsn = svfs_bsn(ssb, ino);
+
+    spin_lock(&bsn->lock);
+    svfs_bse_cow(ssb, ino);
+    write_seqcount_begin(&bsn->seq);
+}
+
+/* the csum is the last field, it covers all the others */
+static inline
+u32 svfs_bse_csum(struct backing_store_entry *bse)
+{
+    return crc32c(~0, bse, offsetof(struct backing_store_entry, csum));
+}
+
+static inline
+void svfs_bse_seal(struct backing_store_entry *bse)
+{
+    bse->csum = svfs_bse_csum(bse);
+}
+
+/* every writer of the entry reseals it */
+static inline
+void svfs_bse_write_end(struct svfs_super_block *ssb, unsigned long ino)
+{
+    struct backing_store_node *bsn = svfs_bsn(ssb, ino);
+
+    svfs_bse_seal(svfs_bse(ssb, ino));
+    write_seqcount_end(&bsn->seq);
+    spin_unlock(&bsn->lock);
+}
+
+/* copy out a consistent image of the entry without locking */
+static inline
+void svfs_bse_read(struct svfs_super_block *ssb, unsigned long ino,
+                   struct backing_store_entry *dst)
+{
+    struct backing_store_node *bsn = svfs_bsn(ssb, ino);
+    unsigned seq;
+
+    do {
+        seq = read_seqcount_begin(&bsn->seq);
+        *dst = *svfs_bse(ssb, ino);
+    } while (read_seqcount_retry(&bsn->seq, seq));
+}
+
+/* offset of the entry in the backing store file */
+static inline loff_t svfs_bse_offset(unsigned long ino)
+{
+    return SVFS_BS_HDR_SIZE + 
+        (loff_t)(ino / SVFS_BS_SEG_ENTRIES) * SVFS_BS_SEG_SIZE +
+        (ino % SVFS_BS_SEG_ENTRIES) * sizeof(struct backing_store_entry);
+}
+
+static inline
+char *__svfs_heap(struct svfs_super_block *ssb, u32 off)
+{
+    return ssb->bs_heap[off / SVFS_BS_HEAP_CHUNK].data + 
+        off % SVFS_BS_HEAP_CHUNK;
+}
+
+/*
+ * The names in the heap are NUL terminated. The compaction moves them,
+ * so the bytes are only good under the entry lock or in the RCU read
+ * section the entry was read in, see heap.c.
+ */
+static inline
+const char *svfs_bse_name(struct svfs_super_block *ssb,
+                          struct backing_store_entry *bse)
+{
+    return bse->name_len ? __svfs_heap(ssb, bse->name_off) : "";
+}
+
+static inline
+const char *svfs_bse_link(struct svfs_super_block *ssb,
+                          struct backing_store_entry *bse)
+{
+    return bse->link_len ? __svfs_heap(ssb, bse->link_off) : "";
+}
+
+extern ssize_t __svfs_backing_store_uread(struct file *, void *, size_t,
+                                          loff_t *);
+extern ssize_t __svfs_backing_store_uwrite(struct file *, const void *, 
+                                           size_t, loff_t *);
+extern int svfs_backing_store_init(struct svfs_super_block *);
+extern void svfs_backing_store_exit(struct svfs_super_block *);
+extern int svfs_backing_store_grow(struct svfs_super_block *, int);
+extern void svfs_backing_store_mark_dirty(struct svfs_super_block *,
+                                          unsigned long);
+extern int svfs_backing_store_extend(struct svfs_super_block *, int);
+extern void svfs_backing_store_wait_loaded(struct svfs_super_block *);
+/* heap.c */
+extern int svfs_heap_open(struct svfs_super_block *);
+extern void svfs_heap_close(struct svfs_super_block *);
+extern int svfs_heap_append(struct svfs_super_block *, const char *, int,
+                            u32 *);
+extern int svfs_heap_flush(struct svfs_super_block *);
+extern int svfs_heap_load(struct svfs_super_block *, u32);
+extern int svfs_heap_check(struct svfs_super_block *, u32, int);
+extern void svfs_heap_publish(struct svfs_super_block *, u32);
+extern int svfs_heap_compact(struct svfs_super_block *);
+extern void svfs_heap_retire(struct svfs_super_block *, int);
+extern void svfs_backing_store_dirty_entry(struct svfs_super_block *,
+                                           unsigned long);
+extern void svfs_backing_store_reclaim(struct svfs_super_block *);
+/* flusher.c */
+extern int svfs_flusher_start(struct svfs_super_block *);
+extern void svfs_flusher_stop(struct svfs_super_block *);
+extern void svfs_flusher_kick(struct svfs_super_block *);
+/* proc.c */
+extern int svfs_backing_store_proc_init(struct svfs_super_block *);
+extern void svfs_backing_store_proc_exit(struct svfs_super_block *);
+/* snapshot.c */
+extern int svfs_backing_store_snapshot(struct svfs_super_block *,
+                                       const char *);
+/* shard.c */
+extern int svfs_shards_init(struct svfs_super_block *);
+extern void svfs_shards_stop(struct svfs_super_block *);
+extern void svfs_shards_exit(struct svfs_super_block *);
+extern void svfs_shards_kick(struct svfs_super_block *);
+extern int svfs_shards_commit(struct svfs_super_block *, int);
+extern void svfs_shard_link(struct svfs_super_block *, const char *, int,
+                            unsigned long);
+extern void svfs_shard_unlink(struct svfs_super_block *, unsigned long);
+extern int svfs_shard_is_stub(struct svfs_super_block *, unsigned long);
+extern unsigned long svfs_shard_stub(struct svfs_super_block *,
+                                     struct svfs_super_block *);
+/* fsck.c */
+extern int svfs_backing_store_fsck(struct svfs_super_block *,
+                                   struct svfs_fsck_result *);
+/* path.c */
+extern int svfs_path_cache_init(struct svfs_super_block *);
+extern void svfs_path_cache_exit(struct svfs_super_block *);
+extern char *svfs_path_cache_prepend(struct svfs_super_block *,
+                                     unsigned long,
+                                     struct backing_store_entry *,
+                                     char *, char *);
+extern void svfs_path_cache_insert(struct svfs_super_block *, unsigned long,
+                                   struct backing_store_entry *, u32,
+                                   const char *, int);
+extern void svfs_path_cache_invalidate(struct svfs_super_block *);
+/* journal.c */
+extern int svfs_journal_open(struct svfs_super_block *);
+extern void svfs_journal_close(struct svfs_super_block *);
+extern void svfs_journal_log(struct svfs_super_block *, int, unsigned long);
+extern int svfs_journal_commit(struct svfs_super_block *, int);
+extern int svfs_journal_checkpoint(struct svfs_super_block *);
 extern ssize_t svfs_backing_store_write(struct svfs_super_block *);
-extern ssize_t svfs_backing_store_read(struct svfs_super_block *);
 extern void svfs_backing_store_commit_bse(struct inode *);
 extern int svfs_backing_store_update_bse(struct svfs_super_block *,
                                          struct dentry *, struct inode *);
 extern unsigned long svfs_backing_store_find_mark_ino(
-    struct svfs_super_block *);
+    struct svfs_super_block *, unsigned long, int);
 extern unsigned long svfs_backing_store_lookup(struct svfs_super_block *,
                                                unsigned long, 
                                                const char *);
+extern unsigned long svfs_backing_store_lookup_nowait(
+    struct svfs_super_block *, unsigned long, const char *);
 extern void svfs_backing_store_set_root(struct svfs_super_block *);
 extern int svfs_backing_store_get_path(struct svfs_super_block *,
-                                       struct backing_store_entry *,
-                                       char *, size_t);
+                                       unsigned long, char *, size_t);
 extern int svfs_backing_store_get_path2(struct svfs_super_block *,
-                                        struct backing_store_entry *,
-                                        char *, size_t);
+                                        unsigned long, char *, size_t);
+extern int svfs_backing_store_set_name(struct svfs_super_block *,
+                                       struct backing_store_entry *,
+                                       const char *, int);
+extern int svfs_backing_store_set_link(struct svfs_super_block *,
+                                       unsigned long, const char *, int);
 extern void svfs_backing_store_write_dirty(struct svfs_super_block *);
 extern unsigned long svfs_backing_store_find_child(
     struct svfs_super_block *,
     unsigned long, unsigned long);
+extern u32 svfs_backing_store_nr_children(struct svfs_super_block *,
+                                          unsigned long);
 extern int svfs_backing_store_delete(struct svfs_super_block *,
                                      unsigned long, unsigned long,
                                      const char *);
 extern int svfs_backing_store_is_ood(struct inode *);
-extern int svfs_backing_store_scan(struct svfs_super_block *);
 extern unsigned long svfs_backing_store_lookup_parent(struct svfs_super_block *, 
                                                       unsigned long);
+extern int svfs_backing_store_build_index(struct svfs_super_block *);
+extern void svfs_backing_store_free_index(struct svfs_super_block *);
+extern int svfs_backing_store_build_bitmap(struct svfs_super_block *);
+extern void svfs_backing_store_free_bitmap(struct svfs_super_block *);
 #endif
 
 /* relay operations */
@@ -28,6 +28,24 @@
 #define SVFS_ROOT_INODE 0x00
 
 #ifdef SVFS_LOCAL_TEST
+/*
+ * The backing store file starts with one page of header, followed by
+ * nsegs segments of dense entries. The names live in a separate heap
+ * file, referenced by (offset, length).
+ */
+struct backing_store_header
+{
+#define SVFS_BS_MAGIC   0x53564253 /* SVBS */
+#define SVFS_BS_VERSION 2       /* version 1 is the headerless format */
+    u32 magic;
+    u32 version;
+    u32 entry_size;
+    u32 seg_size;
+    u32 nsegs;
+#define SVFS_BS_FEAT_CSUM 0x00000001 /* every entry has its crc32c */
+    u32 features;
+};
+
 struct backing_store_entry
 {
     u32 parent_offset;
@@ -40,6 +58,31 @@ struct backing_store_entry
 #define SVFS_BS_DIR   0x80000000
 #define SVFS_BS_FILE  0x40000000
 #define SVFS_BS_LINK  0x20000000
+    u32 state;
+    u32 disk_flags;
+    loff_t disksize;
+    u32 nlink;
+    umode_t mode;
+    u16 pad;
+    uid_t uid;
+    gid_t gid;
+    struct timespec atime, ctime, mtime;
+    u32 generation;
+    u32 llfs_type;
+    u32 llfs_fsid;
+    /* the names, see svfs_bse_name() and svfs_bse_link() */
+    u32 name_off;
+    u32 link_off;               /* the symlink target */
+    u16 name_len;
+    u16 link_len;
+    u32 csum;                   /* crc32c of the fields above */
+};
+
+/* version 1 entry, only used to convert the old backing store files */
+struct backing_store_entry_v1
+{
+    u32 parent_offset;
+    u32 depth;
     u32 state;
     u32 disk_flags;
     loff_t disksize;
@@ -54,8 +97,196 @@ struct backing_store_entry
     char relative_path[NAME_MAX];
     char ref_path[NAME_MAX];
 };
+
+/* a chunk of the name heap, see heap.c */
+struct svfs_heap_chunk
+{
+    char *data;                 /* read in on first use */
+    u32 fill;                   /* the bytes appended */
+    u32 flushed;                /* the bytes written to the heap file */
+    u32 live;                   /* of the names, counted by the compaction */
+    atomic_t pending;           /* appended names not in an entry yet */
+    int state;
+#define SVFS_HEAP_USED 0
+#define SVFS_HEAP_FREE 1
+    int mark;                   /* private to the compaction */
+#define SVFS_HEAP_CAND 1        /* counted */
+#define SVFS_HEAP_MOVE 2        /* its names are moved out */
+#define SVFS_HEAP_DEAD 3        /* freed after the checkpoint */
+};
+
+/* a frozen image of the table being streamed out, see snapshot.c */
+struct svfs_bs_snapshot
+{
+    spinlock_t lock;            /* the copy-on-write against the stream */
+    int nsegs, npages;
+    u32 features;
+    u32 heap_len;
+    unsigned long *done;        /* the pages copied or streamed */
+    void **copy;                /* the frozen copies of the pages */
+    unsigned long copied;
+    int broken;                 /* a copy failed */
+};
+
+/* the counters of one svfs_backing_store_fsck() run */
+struct svfs_fsck_result
+{
+    atomic_t segments, checked;
+    atomic_t csum;              /* bad checksums */
+    atomic_t orphans;           /* no valid parent chain to the root */
+    atomic_t depth;             /* depth != parent depth + 1 */
+    atomic_t nlink;             /* bad link counts */
+    int workers;
+    unsigned int ms;
+};
+
+/* in-memory only, one node per backing_store_entry */
+/*
+ * The writers of an entry hold bsn->lock and bump bsn->seq, the readers
+ * take a snapshot under the seqcount and never block. The lock also
+ * protects the children tree; it nests inside the lock of a child.
+ */
+struct backing_store_node
+{
+    u32 ino;
+    u32 hval;
+    struct hlist_nulls_node hlist; /* (parent_offset, name) hash chain */
+    spinlock_t lock;
+    seqcount_t seq;
+    struct rb_node child;       /* linked in the parent's children */
+    struct rb_root children;    /* sorted by ino, for directories */
+    u32 nr_children;
+#define SVFS_BSN_BAD 0x00000001 /* failed the checksum */
+    u32 flags;
+    struct list_head dirty;     /* on bs_dirty_list */
+    struct list_head reclaim;   /* on bs_reclaim_list */
+};
+
+/* the readers walk the chains under RCU, the nulls is the bucket index */
+struct backing_store_bucket
+{
+    struct hlist_nulls_head head;
+    spinlock_t lock;
+};
+
+/*
+ * The entry table is a directory of fixed-size segments. A segment is
+ * a vmap of the pinned page cache pages of the backing file, mapped on
+ * first touch; bse is NULL until then. The loader indexes an empty
+ * segment without mapping it, its first allocation does.
+ */
+struct backing_store_segment
+{
+#define SVFS_SEG_UNMAPPED 0
+#define SVFS_SEG_MAPPED   1     /* entries readable, not indexed yet */
+#define SVFS_SEG_INDEXED  2     /* in the name index and the bitmap */
+    int state;
+    int nr_free;                /* free slots, under bs_alloc_lock */
+    struct backing_store_entry *bse;
+    struct backing_store_node *bsn;
+    struct page **pages;
+};
+
+/*
+ * Redo journal next to the backing store. Every record carries the
+ * after-image of one entry, so replaying a record twice is harmless.
+ */
+struct svfs_jnl_header
+{
+#define SVFS_JNL_MAGIC    0x53564a4c /* SVJL */
+#define SVFS_JNL_VERSION  2
+    u32 magic;
+    u32 version;
+    u32 epoch;                  /* bumped at each checkpoint */
+    u32 pad;
+};
+
+struct svfs_jnl_record
+{
+#define SVFS_JNL_REC_MAGIC 0x5352     /* SR */
+#define SVFS_JNL_ATTR     1         /* entry head only */
+#define SVFS_JNL_LINK     2         /* entry head and both names */
+#define SVFS_JNL_FREE     3         /* entry is free again */
+    u16 magic;
+    u16 type;
+    u32 ino;
+    u32 epoch;
+    u32 len;                    /* payload length */
+    u64 seq;
+    u32 crc;                    /* crc32c of the record, crc = 0 */
+    u32 pad;
+};
+
+struct svfs_journal
+{
+    struct file *filp;
+    char *name;
+    spinlock_t lock;            /* protect buf, len and seq */
+#define SVFS_JNL_BUF_SIZE (64 * 1024)
+    char *buf[2];               /* appending and committing buffers */
+    int cur, len;
+    u64 seq;                    /* last appended record */
+    u64 committed;              /* last durable record */
+    u32 epoch;
+    loff_t tail;                /* append offset in the journal file */
+    int err;                    /* records lost, until a checkpoint */
+    unsigned long last_ckpt;    /* jiffies */
+    struct mutex commit_mutex;  /* serialize commits and checkpoints */
+    struct delayed_work work;   /* group commit timer */
+};
+
+/*
+ * Memoized paths of the hot entries. A cached path is valid while the
+ * entry keeps its parent and name (a rename appends a new name, so
+ * name_off changes) and no directory has moved since, see gen.
+ */
+struct svfs_path_ent
+{
+    struct hlist_node hlist;
+    struct list_head lru;
+    u32 ino, parent, name_off, gen;
+    int len;
+    char path[0];
+};
+
+struct svfs_path_cache
+{
+#define SVFS_PATH_CACHE_BITS 10
+#define SVFS_PATH_CACHE_MAX  4096 /* entries */
+    spinlock_t lock;
+    struct hlist_head *hash;
+    struct list_head lru;
+    int nr;
+    atomic_t gen;               /* bumped when a directory moves */
+};
 #endif
 
+#ifdef SVFS_LOCAL_TEST
+/* the reserved bse slots of one segment */
+struct svfs_slot_cache
+{
+#define SVFS_POOL_SLOTS 32
+    int seg;                    /* the segment of the slots, or -1 */
+    unsigned long dir;          /* the directory of a headroom, 0: none */
+    int pos, nr;
+    u32 used;                   /* pool tick of the last allocation */
+    u32 slot[SVFS_POOL_SLOTS];
+};
+#endif
+
+/* per-CPU reservations refilled from the global allocators in batches */
+struct svfs_cpu_pool
+{
+#define SVFS_POOL_GENS  1024
+    u32 next_gen, end_gen;      /* reserved i_generation range */
+#ifdef SVFS_LOCAL_TEST
+#define SVFS_POOL_SEGS  4
+    spinlock_t lock;            /* only contended when stealing */
+    u32 tick;
+    struct svfs_slot_cache cache[SVFS_POOL_SEGS];
+#endif
+};
+
 struct svfs_super_block
 {
 #define SVFS_SB_FREE       0x00000000
@@ -69,14 +300,94 @@ struct svfs_super_block
     struct timespec mtime;
     spinlock_t next_gen_lock;
     u32 next_generation;
+    struct svfs_cpu_pool *cpu_pools;
 #ifdef SVFS_LOCAL_TEST
     char *backing_store;
     struct file *bs_filp;
-    struct backing_store_entry *bse;
-    int bs_size;
+    struct backing_store_segment *bs_segs;
+    int bs_nsegs, bs_max_segs;
+    struct mutex bs_grow_mutex;
+    u32 bs_opt_size, bs_opt_max_size; /* mount options, in entries */
+    /*
+     * The subtree shards, see shard.c. A shard is a store of its own,
+     * the root table keeps the directory it is mounted on (the stub).
+     */
+#define SVFS_MAX_SHARDS 8
+    char *bs_opt_shards;        /* mount option, "name:name:..." */
+    int bs_nshards;
+    int bs_shard_id;            /* 0 for the root table */
+    struct svfs_super_block *bs_shards[SVFS_MAX_SHARDS];
+    unsigned long bs_shard_stub[SVFS_MAX_SHARDS]; /* -1UL if none */
+    int bs_stubs_pending;       /* some stub may not be indexed yet */
+    char *bs_shard_name;        /* of a shard, the name of its stub */
+    int bs_size;                /* bs_nsegs * SVFS_BS_SEG_ENTRIES */
     atomic_t bs_inuse;
+    unsigned long bs_flags;
+#define SVFS_BSF_HDR_DIRTY 0    /* the header needs a rewrite */
+    u32 bs_features;            /* SVFS_BS_FEAT_* of the header */
+    atomic_t bs_csum_errs;
+    struct mutex bs_flush_mutex;
+    struct mutex bs_map_mutex;  /* serialize the segment mapping */
+    /* the segments are indexed in the background after mount */
+    struct task_struct *bs_loader;
+    wait_queue_head_t bs_load_wait;
+    int bs_loaded;
+#define SVFS_BS_MAX_SCANNERS 8
+    atomic_t bs_scan_next;      /* the next segment to index */
+    atomic_t bs_scanners;       /* the running scanners */
+    struct completion bs_scan_done;
+    int bs_scan_stop, bs_scan_err, bs_nr_scanners;
+    unsigned int bs_mount_ms, bs_index_ms; /* the mount phase timing */
+    /* the name heap, in fixed chunks reused once their names are dead */
+    struct file *bs_heap_filp;
+    struct svfs_heap_chunk *bs_heap;
+    int bs_heap_cur;            /* the chunk appended to */
+    int bs_heap_used;           /* the chunks not free */
+    int bs_heap_walk_at;        /* bs_heap_used of the next compaction */
+    u32 bs_heap_len;            /* length of the heap file */
+    u32 bs_heap_disk_len;       /* length of the heap file at mount */
+    struct mutex bs_heap_mutex;
+    u64 bs_heap_moved, bs_heap_freed; /* by the compaction */
+    struct svfs_journal bs_jnl;
+    struct svfs_path_cache bs_pcache;
+    /* the entries flagged SVFS_BS_DIRTY, for write_dirty */
+    struct list_head bs_dirty_list;
+    spinlock_t bs_dirty_lock;
+    int bs_nr_dirty;
+    struct proc_dir_entry *bs_proc;
+    struct svfs_bs_snapshot *bs_snap; /* frozen image, if any */
+    struct mutex bs_snap_mutex;
+    unsigned long bs_snap_copied;
+    unsigned int bs_snap_ms;
+    int bs_snap_err;
+    /* the flusher, see /proc/fs/svfs/<backing store>/ for the knobs */
+#define SVFS_BS_FLUSH_INTERVAL 5000 /* ms */
+#define SVFS_BS_DIRTY_THRESH   1024 /* entries */
+    struct task_struct *bs_flusher;
+    wait_queue_head_t bs_flush_wait;
+    unsigned int bs_flush_interval;
+    unsigned int bs_dirty_thresh;
+    /* the SVFS_BS_DELETING entries, finalized by the reclaimer */
+#define SVFS_BS_RECLAIM_DELAY HZ
+#define SVFS_BS_RECLAIM_BATCH 64
+    struct list_head bs_reclaim_list;
+    spinlock_t bs_reclaim_lock;
+    struct delayed_work bs_reclaim_work;
+    unsigned long bs_reclaim_last; /* jiffies of the last pass */
+    u64 bs_reclaimed;
+    unsigned int bs_reclaim_rate; /* entries per second */
+    /* name index and child trees over bse, built by the loader */
+    struct backing_store_bucket *bs_htable;
+    u32 bs_hbits;
+    /* free slot bitmap, one summary bit per full bitmap word */
+    unsigned long *bs_bitmap;
+    unsigned long *bs_summary;
+    unsigned long *bs_reserved; /* the headroom words of directories */
+    unsigned long bs_cursor;    /* next-fit word cursor */
+    spinlock_t bs_alloc_lock;
 #endif
 
+    struct list_head mnt_list;  /* the mounts scanned by a drain */
     struct super_block *sb;
 };
 
@@ -103,6 +414,7 @@ struct svfs_referal
     u32 llfs_type;             /* llfs filesystem type */
     u32 llfs_fsid;
     struct file *llfs_filp;
+    struct svfs_datastore *llfs_sd; /* valid with SVFS_STATE_CONN */
     struct dentry *llfs_dentry;
     struct vfsmount *llfs_mnt;
 
@@ -150,6 +462,7 @@ struct svfs_inode
 #define SVFS_IF_SMALL     0x80000000 /* small file */
 #define SVFS_IF_LARGE     0x40000000 /* large file */
 #define SVFS_IF_NORMAL    0x10000000 /* normal file */
+#define SVFS_IF_CLASS     (SVFS_IF_SMALL | SVFS_IF_LARGE | SVFS_IF_NORMAL)
 #define SVFS_IF_COMPR     0x00800000 /* compress */
 #define SVFS_IF_DA        0x00400000 /* delay allocation? */
 #define SVFS_IF_NOATIME   0x00008000 /* no atime */
@@ -174,6 +487,10 @@ struct svfs_inode
 
     /* llfs related */
     struct svfs_referal llfs_md; /* metadata referal for llfs */
+    struct rw_semaphore llfs_sem; /* the llfs I/O vs. the migration */
+    atomic_t llfs_gen;          /* bumped by each change of the llfs data */
+    spinlock_t llfs_lock;       /* pins llfs_filp for mmap */
+    atomic_t llfs_mmaps;        /* mmaps since read in, never migrated */
 
     /* VFS inode */
     struct inode vfs_inode;
@@ -191,9 +508,26 @@ struct svfs_datastore
 #define SVFS_DSTORE_VALID 0x01
     int type, state;
     char pathname[NAME_MAX];
+    u32 fsid;                   /* svfs_datastore_fsid(pathname) */
+#define SVFS_TIER_FAST     0    /* the small files */
+#define SVFS_TIER_CAPACITY 1    /* the large files */
+#define SVFS_TIER_MAX      2
+    int tier;
     struct list_head list;
+    struct hlist_node hlist;    /* (type, fsid) hash chain */
     struct path root_path;
     struct super_block *sb;
+    /* the placement inputs, see svfs_datastore_place() */
+#define SVFS_DSTORE_REFRESHING 0
+#define SVFS_DSTORE_DRAINING   1 /* no new files, see migrate.c */
+    unsigned long flags;
+    u64 avail, free, total;     /* bytes, from the cached statfs */
+    unsigned long statfs_time;  /* jiffies of the cached statfs */
+    struct work_struct refresh_work; /* the background statfs */
+    atomic_t inflight;          /* llfs reads and writes in progress */
+    u32 lat_us;                 /* moving average of the I/O latency */
+    u32 score;                  /* of the last statfs refresh */
+    atomic_t placed;            /* new files placed here */
 };
 
 #endif
@@ -25,6 +25,7 @@
  * $ cat > /etc/svfs_config
  * <block datastore>
  * fstype = ext4, mountpoint = /mnt/ext4, loading = (static or dynamic)
+ * fstype = ext4, mountpoint = /mnt/ssd, tier = (fast or capacity)
  * fstype = nfs, mountpoint = /mnt/nfs, loading = (static or dynamic)
  * fstype = ext3, mountpoint = /mnt/ext3, loading = (staic or dynamic)
  * fstype = DCFS3, mountpoint = /mnt/dcfs3, loading = (static or dynamic)
@@ -40,18 +40,20 @@ void svfs_lib_proc_exit(void)
         remove_proc_entry("fs/svfs", NULL);
 }
 
-#define	PROC_HANDLER(pde, name, fops)                               \
+#define	PROC_HANDLER(pde, name, fops, data)                         \
     do {                                                            \
         proc = proc_create_data(name, mode, pde,                    \
-                                fops, NULL);                        \
+                                fops, data);                        \
         if (proc == NULL) {                                         \
             svfs_err(lib, "svfs: can't to create %s\n", name);      \
             goto err_out;                                           \
         }                                                           \
     } while (0)
 
-int svfs_lib_proc_add_entry(struct proc_dir_entry *dir, char *name, 
-                            const struct file_operations *fops)
+/* @data is handed to the fops in PDE(inode)->data */
+int svfs_lib_proc_add_entry_data(struct proc_dir_entry *dir, char *name, 
+                                 const struct file_operations *fops,
+                                 void *data)
 {
     struct proc_dir_entry *proc;
     mode_t mode = S_IFREG | S_IRUGO | S_IWUSR;
@@ -60,7 +62,7 @@ int svfs_lib_proc_add_entry(struct proc_dir_entry *dir, char *name,
     if (!dir)
         dir = svfs_root;
 
-    PROC_HANDLER(dir, name, fops);
+    PROC_HANDLER(dir, name, fops, data);
     return 0;
 err_out:
     svfs_err(lib, "svfs: Unable to create %s\n", name);
@@ -68,6 +70,12 @@ err_out:
     return -ENOMEM;
 }
 
+int svfs_lib_proc_add_entry(struct proc_dir_entry *dir, char *name, 
+                            const struct file_operations *fops)
+{
+    return svfs_lib_proc_add_entry_data(dir, name, fops, NULL);
+}
+
 void svfs_lib_proc_remove_entry(struct proc_dir_entry *dir, char *name)
 {
     if (!dir)
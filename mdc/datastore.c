@@ -26,15 +26,100 @@
 struct list_head svfs_datastore_list;
 static int svfs_datastore_count = 0;
 
+/*
+ * The inodes find their datastore by (type, fsid) on every lookup and
+ * open. The readers walk the chains under RCU, the datastores are only
+ * added at load time and freed at unload, after a grace period.
+ */
+#define SVFS_DSTORE_HASH_BITS 6
+static struct hlist_head svfs_datastore_htable[1 << SVFS_DSTORE_HASH_BITS];
+static DEFINE_SPINLOCK(svfs_datastore_hlock);
+
+static inline
+struct hlist_head *svfs_datastore_bucket(int type, u32 fsid)
+{
+    return &svfs_datastore_htable[hash_long(fsid ^ ((u32)type << 24),
+                                            SVFS_DSTORE_HASH_BITS)];
+}
+
+/*
+ * Placement of the new files (svfs_datastore_get(LLFS_TYPE_ANY)). Each
+ * datastore is scored by its cached free space over its load, i.e. the
+ * in-flight I/Os and the recent latency. The score is computed with each
+ * statfs refresh, a create only reads it and at most queues a refresh.
+ * The policy is switched at run time through /proc/fs/svfs/placement.
+ */
+#define SVFS_PLACE_WEIGHTED 0   /* random, in proportion to the score */
+#define SVFS_PLACE_LEAST    1   /* the best score */
+#define SVFS_PLACE_RR       2   /* in turn, skipping the full ones */
+static char *svfs_place_names[] = {"weighted", "least", "rr"};
+static int svfs_place_policy = SVFS_PLACE_WEIGHTED;
+static atomic_t svfs_place_next = ATOMIC_INIT(0);
+
+/*
+ * The size classes of the regular files: SMALL up to small_max, LARGE
+ * from large_min, NORMAL in between. The small and normal files are
+ * placed on the fast tier, the large ones on the capacity tier. A tier
+ * without a usable datastore falls back to all of them.
+ */
+static char *svfs_tier_names[] = {"fast", "capacity"};
+static unsigned long svfs_tier_small_max = 256 << 10;
+static unsigned long svfs_tier_large_min = 64 << 20;
+module_param(svfs_tier_small_max, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(svfs_tier_small_max,
+                 "SVFS Tiering: largest size of a small file in bytes");
+module_param(svfs_tier_large_min, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(svfs_tier_large_min,
+                 "SVFS Tiering: smallest size of a large file in bytes");
+
+/*
+ * The statfs of each datastore is cached for svfs_statfs_ttl ms, it
+ * feeds both svfs_statfs() and the placement. With svfs_statfs_stale
+ * the expired values are returned at once and refreshed on
+ * svfs_statfs_wq, so a slow llfs (NFS) never stalls the callers.
+ */
+static unsigned int svfs_statfs_ttl = 1000;
+static int svfs_statfs_stale = 1;
+module_param(svfs_statfs_ttl, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(svfs_statfs_ttl,
+                 "SVFS Statfs: ms a datastore statfs is cached");
+module_param(svfs_statfs_stale, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(svfs_statfs_stale,
+                 "SVFS Statfs: 1 to return the expired values and refresh "
+                 "them in the background");
+static struct workqueue_struct *svfs_statfs_wq;
+
+#define SVFS_DSTORE_LAT_UNIT    1000 /* us of latency worth one I/O */
+#define SVFS_DSTORE_RESERVE     (64ULL << 20) /* bytes, full below it */
+
 void svfs_datastore_init()
 {
+    int i;
+
     INIT_LIST_HEAD(&svfs_datastore_list);
+    for (i = 0; i < ARRAY_SIZE(svfs_datastore_htable); i++)
+        INIT_HLIST_HEAD(&svfs_datastore_htable[i]);
+    /* without it the refresh is done inline */
+    svfs_statfs_wq = create_singlethread_workqueue("svfs_statfs");
+    if (!svfs_statfs_wq)
+        svfs_err(dstore, "create the statfs workqueue failed\n");
+}
+
+static int svfs_tier_revert(char *tier)
+{
+    int i;
+
+    for (i = 0; i < SVFS_TIER_MAX; i++) {
+        if (!strcmp(tier, svfs_tier_names[i]))
+            return i;
+    }
+    return -EINVAL;
 }
 
 int svfs_datastore_adding(char *conf_filename)
 {
     char line[256];
-    char type[12], pathname[128];
+    char type[12], pathname[128], tier[12];
     struct svfs_datastore *sd;
     int ret, flag = 1, rc = -EINVAL;
 
@@ -69,6 +154,19 @@ int svfs_datastore_adding(char *conf_filename)
         if (IS_ERR(sd))
             goto out;
         rc = 0;
+
+        /* optional, the untagged datastores are capacity */
+        ret = svfs_lib_k2v(line, "tier", tier);
+        if (ret > 0) {
+            ret = svfs_tier_revert(tier);
+            if (ret < 0)
+                svfs_err(dstore, "invalid tier '%s' of %s\n", tier,
+                         pathname);
+            else
+                sd->tier = ret;
+        }
+        svfs_info(dstore, "datastore %s on the %s tier\n", sd->pathname,
+                  svfs_tier_names[sd->tier]);
     }
     out:
     svfs_lib_config_close();
@@ -95,6 +193,305 @@ u32 svfs_datastore_fsid(char *name)
 	return h;
 }
 
+static u32 svfs_datastore_score(struct svfs_datastore *sd);
+
+/* the refresher owns SVFS_DSTORE_REFRESHING, it is the only writer */
+static void __svfs_datastore_statfs(struct svfs_datastore *sd)
+{
+    struct kstatfs st;
+    int err;
+
+    err = vfs_statfs(sd->root_path.dentry, &st);
+    if (!err) {
+        sd->total = st.f_blocks * st.f_bsize;
+        sd->free = st.f_bfree * st.f_bsize;
+        sd->avail = st.f_bavail * st.f_bsize;
+    } else
+        svfs_warning(dstore, "statfs %s failed %d, keep the old values\n",
+                     sd->pathname, err);
+    sd->score = svfs_datastore_score(sd);
+    sd->statfs_time = jiffies ?: 1;
+    clear_bit(SVFS_DSTORE_REFRESHING, &sd->flags);
+    smp_mb__after_clear_bit();
+    wake_up_bit(&sd->flags, SVFS_DSTORE_REFRESHING);
+}
+
+static int svfs_datastore_refresh_wait(void *word)
+{
+    schedule();
+    return 0;
+}
+
+static void svfs_datastore_refresh_work(struct work_struct *work)
+{
+    __svfs_datastore_statfs(container_of(work, struct svfs_datastore,
+                                         refresh_work));
+}
+
+/* the first sample is always taken inline, there is nothing to return */
+static void svfs_datastore_refresh(struct svfs_datastore *sd)
+{
+    unsigned long ttl = msecs_to_jiffies(ACCESS_ONCE(svfs_statfs_ttl));
+
+    if (sd->statfs_time && time_before(jiffies, sd->statfs_time + ttl))
+        return;
+    /* one refresher, the others go on with the old values or wait */
+    if (test_and_set_bit(SVFS_DSTORE_REFRESHING, &sd->flags)) {
+        if (!sd->statfs_time || !ACCESS_ONCE(svfs_statfs_stale))
+            wait_on_bit(&sd->flags, SVFS_DSTORE_REFRESHING,
+                        svfs_datastore_refresh_wait, TASK_UNINTERRUPTIBLE);
+        return;
+    }
+    if (sd->statfs_time && svfs_statfs_wq && ACCESS_ONCE(svfs_statfs_stale))
+        queue_work(svfs_statfs_wq, &sd->refresh_work);
+    else
+        __svfs_datastore_statfs(sd);
+}
+
+/* queue the refresh of expired values, the caller never waits on it */
+static void svfs_datastore_kick(struct svfs_datastore *sd)
+{
+    unsigned long ttl = msecs_to_jiffies(ACCESS_ONCE(svfs_statfs_ttl));
+
+    if (!svfs_statfs_wq ||
+        time_before(jiffies, ACCESS_ONCE(sd->statfs_time) + ttl))
+        return;
+    if (!test_and_set_bit(SVFS_DSTORE_REFRESHING, &sd->flags))
+        queue_work(svfs_statfs_wq, &sd->refresh_work);
+}
+
+/*
+ * The free fraction (0..1024) over the load, 0 for a full datastore. An
+ * idle datastore has cost 1, each in-flight I/O and each LAT_UNIT of
+ * average latency adds one.
+ */
+static u32 svfs_datastore_score(struct svfs_datastore *sd)
+{
+    u64 avail = sd->avail, total = sd->total;
+    u32 free, cost;
+
+    if (!total || avail < SVFS_DSTORE_RESERVE ||
+        test_bit(SVFS_DSTORE_DRAINING, &sd->flags))
+        return 0;
+    free = div64_u64(avail << 10, total);
+    cost = 1 + atomic_read(&sd->inflight) +
+        ACCESS_ONCE(sd->lat_us) / SVFS_DSTORE_LAT_UNIT;
+    return max_t(u32, free * 64 / cost, 1);
+}
+
+/* a drain takes effect at once, not with the next refresh */
+static inline u32 svfs_datastore_cached_score(struct svfs_datastore *sd)
+{
+    if (test_bit(SVFS_DSTORE_DRAINING, &sd->flags))
+        return 0;
+    return ACCESS_ONCE(sd->score);
+}
+
+#define svfs_tier_match(sd, tier) ((tier) < 0 || (sd)->tier == (tier))
+
+static struct svfs_datastore *svfs_datastore_place(int tier)
+{
+    struct svfs_datastore *pos, *best = NULL;
+    int policy = ACCESS_ONCE(svfs_place_policy), n, count = 0;
+    u32 sum = 0, tsum = 0, pick, score, best_score = 0;
+
+    list_for_each_entry(pos, &svfs_datastore_list, list) {
+        svfs_datastore_kick(pos);
+        score = svfs_datastore_cached_score(pos);
+        sum += score;
+        if (svfs_tier_match(pos, tier))
+            tsum += score;
+    }
+    /* nothing usable on this tier, any other one will do */
+    if (!tsum)
+        tier = -1;
+    else
+        sum = tsum;
+    list_for_each_entry(pos, &svfs_datastore_list, list) {
+        if (!svfs_tier_match(pos, tier))
+            continue;
+        count++;
+        score = svfs_datastore_cached_score(pos);
+        if (!best || score > best_score) {
+            best = pos;
+            best_score = score;
+        }
+    }
+    /* all of them are full: spread the failures evenly */
+    if (!sum)
+        policy = SVFS_PLACE_RR;
+
+    switch (policy) {
+    case SVFS_PLACE_WEIGHTED:
+        pick = random32() % sum;
+        list_for_each_entry(pos, &svfs_datastore_list, list) {
+            if (!svfs_tier_match(pos, tier))
+                continue;
+            /* the scores may change under us, best is the fallback */
+            score = svfs_datastore_cached_score(pos);
+            if (pick < score) {
+                best = pos;
+                break;
+            }
+            pick -= score;
+        }
+        break;
+    case SVFS_PLACE_RR:
+        n = atomic_inc_return(&svfs_place_next);
+        /* walk on from the n-th to the first usable one */
+        n = (unsigned int)n % count;
+        list_for_each_entry(pos, &svfs_datastore_list, list) {
+            if (!svfs_tier_match(pos, tier))
+                continue;
+            if (n-- <= 0 && (svfs_datastore_cached_score(pos) || !sum)) {
+                best = pos;
+                break;
+            }
+        }
+        break;
+    }
+    atomic_inc(&best->placed);
+    svfs_debug(dstore, "place on %s, policy %s, tier %s, score %u\n",
+               best->pathname, svfs_place_names[policy],
+               tier < 0 ? "any" : svfs_tier_names[tier],
+               svfs_datastore_cached_score(best));
+    return best;
+}
+
+int svfs_datastore_tier_of(u32 flags)
+{
+    return (flags & SVFS_IF_LARGE) ? SVFS_TIER_CAPACITY : SVFS_TIER_FAST;
+}
+
+/*
+ * Set the size class of a regular file grown or truncated to @size. A
+ * file left on the wrong tier is handed to the migration, if it moves
+ * them on its own.
+ */
+void svfs_datastore_classify(struct inode *inode, loff_t size)
+{
+    struct svfs_inode *si = SVFS_I(inode);
+    u32 class;
+
+    if (!S_ISREG(inode->i_mode))
+        return;
+    if (size >= ACCESS_ONCE(svfs_tier_large_min))
+        class = SVFS_IF_LARGE;
+    else if (size > ACCESS_ONCE(svfs_tier_small_max))
+        class = SVFS_IF_NORMAL;
+    else
+        class = SVFS_IF_SMALL;
+    if ((si->flags & SVFS_IF_CLASS) == class)
+        return;
+    si->flags = (si->flags & ~SVFS_IF_CLASS) | class;
+    mark_inode_dirty(inode);
+    if ((si->state & SVFS_STATE_CONN) &&
+        si->llfs_md.llfs_sd->tier != svfs_datastore_tier_of(class)) {
+        svfs_debug(dstore, "inode %lu of class 0x%x is on the %s tier\n",
+                   inode->i_ino, class,
+                   svfs_tier_names[si->llfs_md.llfs_sd->tier]);
+        svfs_migrate_misplaced(inode);
+    }
+}
+
+/* account a read or a write on the datastore of a connected inode */
+ktime_t svfs_datastore_io_begin(struct svfs_datastore *sd)
+{
+    atomic_inc(&sd->inflight);
+    return ktime_get();
+}
+
+void svfs_datastore_io_end(struct svfs_datastore *sd, ktime_t start)
+{
+    u32 us = min_t(s64, ktime_us_delta(ktime_get(), start), UINT_MAX);
+
+    atomic_dec(&sd->inflight);
+    /* 1/8 of the new sample, racy updates only lose samples */
+    sd->lat_us = sd->lat_us - (sd->lat_us >> 3) + (us >> 3);
+}
+
+static int svfs_placement_show(struct seq_file *m, void *v)
+{
+    struct svfs_datastore *pos;
+    int i;
+
+    seq_printf(m, "policy:");
+    for (i = 0; i < ARRAY_SIZE(svfs_place_names); i++)
+        seq_printf(m, i == svfs_place_policy ? " [%s]" : " %s",
+                   svfs_place_names[i]);
+    seq_printf(m, "\ntiers: small <= %lu, large >= %lu bytes\n",
+               svfs_tier_small_max, svfs_tier_large_min);
+    seq_printf(m, "statfs: ttl %u ms, %s\n", svfs_statfs_ttl,
+               svfs_statfs_stale ? "stale, async" : "sync");
+    seq_printf(m, "%-24s %-5s %-8s %-5s %10s %10s %8s %8s %8s %8s %8s\n",
+               "datastore", "type", "tier", "state", "avail_mb", "total_mb",
+               "age_ms", "inflight", "lat_us", "score", "placed");
+    list_for_each_entry(pos, &svfs_datastore_list, list) {
+        seq_printf(m, "%-24s %-5s %-8s %-5s %10llu %10llu %8u %8d %8u %8u "
+                   "%8d\n",
+                   pos->pathname, svfs_type_convert(pos->type),
+                   svfs_tier_names[pos->tier],
+                   test_bit(SVFS_DSTORE_DRAINING, &pos->flags) ?
+                   "drain" : "ok",
+                   (unsigned long long)(pos->avail >> 20),
+                   (unsigned long long)(pos->total >> 20),
+                   jiffies_to_msecs(jiffies - pos->statfs_time),
+                   atomic_read(&pos->inflight), pos->lat_us,
+                   svfs_datastore_cached_score(pos),
+                   atomic_read(&pos->placed));
+    }
+    return 0;
+}
+
+static int svfs_placement_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, svfs_placement_show, NULL);
+}
+
+/* accept the name of a policy */
+static ssize_t svfs_placement_write(struct file *file,
+                                    const char __user *buffer,
+                                    size_t count, loff_t *ppos)
+{
+    char buf[16];
+    int i;
+
+    if (!count || count >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, buffer, count))
+        return -EFAULT;
+    buf[count] = '\0';
+    if (buf[count - 1] == '\n')
+        buf[count - 1] = '\0';
+    for (i = 0; i < ARRAY_SIZE(svfs_place_names); i++) {
+        if (!strcmp(buf, svfs_place_names[i])) {
+            svfs_place_policy = i;
+            svfs_info(dstore, "placement policy %s\n", buf);
+            return count;
+        }
+    }
+    return -EINVAL;
+}
+
+static const struct file_operations svfs_placement_fops = {
+    .owner = THIS_MODULE,
+    .open = svfs_placement_open,
+    .read = seq_read,
+    .write = svfs_placement_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int svfs_datastore_proc_init(void)
+{
+    return svfs_lib_proc_add_entry(NULL, "placement", &svfs_placement_fops);
+}
+
+void svfs_datastore_proc_exit(void)
+{
+    svfs_lib_proc_remove_entry(NULL, "placement");
+}
+
 struct svfs_datastore *svfs_datastore_add_new(int type, char *pathname)
 {
     struct file_system_type *fstype;
@@ -136,21 +533,31 @@ struct svfs_datastore *svfs_datastore_add_new(int type, char *pathname)
     /* Step 2: alloc and init the datastore */
 
     err = -ENOMEM;
-    sd = kmalloc(sizeof(struct svfs_datastore), GFP_KERNEL);
+    sd = kzalloc(sizeof(struct svfs_datastore), GFP_KERNEL);
     if (!sd)
         goto fail_drop;
 
-    list_add_tail(&sd->list, &svfs_datastore_list);
     sd->type = type;
     strncpy(sd->pathname, pathname, NAME_MAX - 1);
+    sd->fsid = svfs_datastore_fsid(sd->pathname);
+    sd->tier = SVFS_TIER_CAPACITY;
+    INIT_WORK(&sd->refresh_work, svfs_datastore_refresh_work);
     sd->state = SVFS_DSTORE_VALID;
     sd->root_path = nd.path;
     sd->sb = sb;
+    atomic_set(&sd->inflight, 0);
+    atomic_set(&sd->placed, 0);
+    svfs_datastore_refresh(sd);
+    list_add_tail(&sd->list, &svfs_datastore_list);
+    spin_lock(&svfs_datastore_hlock);
+    hlist_add_head_rcu(&sd->hlist, svfs_datastore_bucket(sd->type, 
+                                                         sd->fsid));
+    spin_unlock(&svfs_datastore_hlock);
 
     svfs_info(dstore, "init the dstore: type %s, pathname %s, sb %p\n",
               svfs_type_convert(type), sd->pathname, sd->sb);
     svfs_datastore_count++;
-    return 0;
+    return sd;
 
 fail_drop:
     module_put(fstype->owner);
@@ -163,46 +570,87 @@ fail_lookup:
 struct svfs_datastore *svfs_datastore_get(int type, u32 fsid)
 {
     struct svfs_datastore *pos;
-    int select = 0, cur = 0;
+    struct hlist_node *n;
 
     if (!svfs_datastore_count)
         return NULL;
 
     if (type & LLFS_TYPE_ANY)
-        select = random32() % svfs_datastore_count;
+        return svfs_datastore_place(SVFS_TIER_FAST);
     
+    /* the datastore outlives the read side, it is only freed at unload */
+    rcu_read_lock();
+    hlist_for_each_entry_rcu(pos, n, svfs_datastore_bucket(type, fsid), 
+                             hlist) {
+        if (type == pos->type && fsid == pos->fsid) {
+            rcu_read_unlock();
+            return pos;
+        }
+    }
+    rcu_read_unlock();
+    return NULL;
+}
+
+/* place a new file on @tier, or anywhere if @tier has no room */
+struct svfs_datastore *svfs_datastore_get_tier(int tier)
+{
+    if (!svfs_datastore_count)
+        return NULL;
+    return svfs_datastore_place(tier);
+}
+
+struct svfs_datastore *svfs_datastore_lookup(char *pathname)
+{
+    struct svfs_datastore *pos;
+
     list_for_each_entry(pos, &svfs_datastore_list, list) {
-        if ((type == pos->type && 
-             fsid == svfs_datastore_fsid(pos->pathname))|| 
-            ((type & LLFS_TYPE_ANY) && select == cur))
+        if (!strcmp(pos->pathname, pathname))
             return pos;
-        cur++;
     }
     return NULL;
 }
 
+/* a draining datastore takes no new files, the migration moves the rest */
+int svfs_datastore_drain(char *pathname, int on)
+{
+    struct svfs_datastore *sd = svfs_datastore_lookup(pathname);
+
+    if (!sd)
+        return -ENOENT;
+    if (on)
+        set_bit(SVFS_DSTORE_DRAINING, &sd->flags);
+    else
+        clear_bit(SVFS_DSTORE_DRAINING, &sd->flags);
+    svfs_info(dstore, "datastore %s %s\n", sd->pathname,
+              on ? "draining" : "back in use");
+    return 0;
+}
+
+/* sum the cached values, in the blocks of @buf */
 void svfs_datastore_statfs(struct kstatfs *buf)
 {
-    struct kstatfs st;
     struct svfs_datastore *pos;
-    int ret = 0;
-
-    /* init it first */
-    buf->f_blocks = buf->f_bfree = buf->f_bavail = 0;
+    u64 total = 0, free = 0, avail = 0;
 
     list_for_each_entry(pos, &svfs_datastore_list, list) {
-        ret = vfs_statfs(pos->root_path.dentry, &st);
-        if (!ret) {
-            buf->f_blocks += st.f_blocks;
-            buf->f_bfree += st.f_bfree;
-            buf->f_bavail += st.f_bavail;
-        }
+        svfs_datastore_refresh(pos);
+        total += pos->total;
+        free += pos->free;
+        avail += pos->avail;
     }
+    buf->f_blocks = div64_u64(total, buf->f_bsize);
+    buf->f_bfree = div64_u64(free, buf->f_bsize);
+    buf->f_bavail = div64_u64(avail, buf->f_bsize);
 }
 
 void svfs_datastore_free(struct svfs_datastore *sd)
 {
     list_del(&sd->list);
+    spin_lock(&svfs_datastore_hlock);
+    hlist_del_rcu(&sd->hlist);
+    spin_unlock(&svfs_datastore_hlock);
+    synchronize_rcu();
+    cancel_work_sync(&sd->refresh_work);
     /* FIXME: free it */
     if (sd->state & SVFS_DSTORE_VALID)
         path_put(&sd->root_path);
@@ -224,6 +672,10 @@ void svfs_datastore_exit()
                   sd->pathname);
         svfs_datastore_free(sd);
     }
+    if (svfs_statfs_wq) {
+        destroy_workqueue(svfs_statfs_wq);
+        svfs_statfs_wq = NULL;
+    }
 }
 
         
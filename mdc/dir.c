@@ -26,27 +26,38 @@ static int svfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 {
     struct inode *inode = filp->f_path.dentry->d_inode;
     struct super_block *sb;
-    struct backing_store_entry *bse;
-    unsigned long offset;
+    struct svfs_super_block *bs;
+    struct backing_store_entry snap, *bse = &snap;
+    unsigned long offset, dir = inode->i_ino;
     int ret = 0, stored = 0;
     unsigned char dtype;
+    char *name;
 
     sb = inode->i_sb;
     offset = filp->f_pos;
+    /* the children of a shard stub live in the shard */
+    bs = svfs_bs_dir(SVFS_SB(sb), &dir);
 
     svfs_entry(mdc, "find from offset %ld\n", offset);
+    /* filldir may sleep, the name is copied out of the heap first */
+    name = __getname();
+    if (!name)
+        return -ENOMEM;
 
-    while (offset < SVFS_SB(sb)->bs_size) {
+    while ((offset & (SVFS_SHARD_SLOTS - 1)) < bs->bs_size) {
 #ifdef SVFS_LOCAL_TEST
         offset = svfs_backing_store_find_child(SVFS_SB(sb), 
                                                inode->i_ino, offset);
         if (offset == -1UL) {
             goto out;
         }
-        bse = SVFS_SB(sb)->bse + offset;
-        ASSERT(bse->parent_offset == inode->i_ino);
-        svfs_debug(mdc, "get dentry %ld: %s 0x%x\n", 
-                   offset, bse->relative_path, bse->state);
+        rcu_read_lock();
+        svfs_bse_read(bs, offset & (SVFS_SHARD_SLOTS - 1), &snap);
+        memcpy(name, svfs_bse_name(bs, bse), bse->name_len);
+        rcu_read_unlock();
+        ASSERT(bse->parent_offset == dir);
+        svfs_debug(mdc, "get dentry %ld: %.*s 0x%x\n", 
+                   offset, bse->name_len, name, bse->state);
         if (S_ISDIR(bse->mode))
             dtype = DT_DIR;
         else if (S_ISREG(bse->mode))
@@ -55,8 +66,7 @@ static int svfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
             dtype = DT_LNK;
         else
             dtype = DT_UNKNOWN;
-        ret = filldir(dirent, bse->relative_path, 
-                      strlen(bse->relative_path),
+        ret = filldir(dirent, name, bse->name_len,
                       filp->f_pos, offset, dtype);
         if (ret)
             break;
@@ -66,6 +76,7 @@ static int svfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
     }
 
 out:
+    __putname(name);
     ret = stored;
     return ret;
 }
@@ -73,6 +73,7 @@ int llfs_lookup(struct inode *inode)
                  PTR_ERR(llfs_dentry));
         goto out_put_filp;
     }
+    SVFS_I(inode)->llfs_md.llfs_sd = sd;
     SVFS_I(inode)->state |= SVFS_STATE_CONN;
     err = 0;
 out:
@@ -105,20 +106,18 @@ int llfs_create(struct dentry *dentry)
     char *ref_path;
     int ret;
 
-    sd = svfs_datastore_get(LLFS_TYPE_ANY, 0);
+    sd = svfs_datastore_get_tier(svfs_datastore_tier_of(si->flags));
     if (!sd) {
         ret = PTR_ERR(sd);
         goto out;
     }
     si->llfs_md.llfs_type = sd->type;
-    si->llfs_md.llfs_fsid = svfs_datastore_fsid(sd->pathname);
+    si->llfs_md.llfs_fsid = sd->fsid;
     ret = -ENOMEM;
     ref_path = __getname();
     if (!ref_path)
         goto out;
-    ret = svfs_backing_store_get_path2(SVFS_SB(inode->i_sb),
-                                       SVFS_SB(inode->i_sb)->bse + 
-                                       inode->i_ino,
+    ret = svfs_backing_store_get_path2(SVFS_SB(inode->i_sb), inode->i_ino,
                                        si->llfs_md.llfs_pathname,
                                        NAME_MAX - 1);
     if (ret)
@@ -132,6 +131,7 @@ int llfs_create(struct dentry *dentry)
     if (IS_ERR(llfs_file))
         goto out_putname;
     si->llfs_md.llfs_filp = llfs_file;
+    si->llfs_md.llfs_sd = sd;
     si->state |= SVFS_STATE_CONN;
     si->state &= ~SVFS_STATE_DA;
     ret = 0;
@@ -155,6 +155,7 @@ svfs_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
     char __user *buf = iov->iov_base;
     size_t count = iov->iov_len;
     ssize_t ret = 0, br;
+    ktime_t start;
     int seg;
 
     if (si->state & SVFS_STATE_DA) {
@@ -172,14 +173,20 @@ svfs_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
             goto out;
     }
 
+    /* the migration switches llfs_filp with the I/O held off */
+    down_read(&si->llfs_sem);
     llfs_filp = si->llfs_md.llfs_filp;
     llfs_filp->f_pos = pos;
+    ret = -EBADF;
     if (!(llfs_filp->f_mode & FMODE_READ))
-        return -EBADF;
+        goto out_up;
+    ret = -EINVAL;
     if (!llfs_filp->f_op || 
         (!llfs_filp->f_op->read && !llfs_filp->f_op->aio_read))
-        return -EINVAL;
+        goto out_up;
+    ret = 0;
 
+    start = svfs_datastore_io_begin(si->llfs_md.llfs_sd);
     for (seg = 0; seg < nr_segs; seg++) {
         buf = iov[seg].iov_base;
         count = iov[seg].iov_len;
@@ -191,9 +198,12 @@ svfs_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
         ret += br;
         svfs_debug(mdc, "buf %p, len %ld: \n", buf, count);
     }
+    svfs_datastore_io_end(si->llfs_md.llfs_sd, start);
     if (ret > 0)
         fsnotify_access(llfs_filp->f_dentry);
     iocb->ki_pos += ret;
+out_up:
+    up_read(&si->llfs_sem);
 out:
     return ret;
 }
@@ -209,6 +219,7 @@ svfs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
     const char __user *buf;
     size_t count;
     ssize_t ret = 0, bw;
+    ktime_t start;
     int seg;
 
     svfs_entry(mdc, "f_mode 0x%x, pos %lu, check 0x%x\n",
@@ -216,8 +227,9 @@ svfs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
                (unsigned long)pos,
                (si->state & SVFS_STATE_CONN));
     if (si->state & SVFS_STATE_DA) {
-        /* create it now */
+        /* create it now, on the tier of the size it is going to have */
         ASSERT(!(si->state & SVFS_STATE_CONN));
+        svfs_datastore_classify(inode, pos + iov_length(iov, nr_segs));
         ret = llfs_create(filp->f_dentry);
         if (ret)
             goto out;
@@ -238,14 +250,19 @@ svfs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
     if (filp->f_flags & O_APPEND)
         pos = i_size_read(inode);
     
+    down_read(&si->llfs_sem);
     llfs_filp = si->llfs_md.llfs_filp;
     llfs_filp->f_pos = pos;
+    ret = -EBADF;
     if (!(llfs_filp->f_mode & FMODE_WRITE))
-        return -EBADF;
+        goto out_up;
+    ret = -EINVAL;
     if (!llfs_filp->f_op ||
         (!llfs_filp->f_op->write && !llfs_filp->f_op->aio_write))
-        return -EINVAL;
+        goto out_up;
+    ret = 0;
 
+    start = svfs_datastore_io_begin(si->llfs_md.llfs_sd);
     for (seg = 0; seg < nr_segs; seg++) {
         buf = iov[seg].iov_base;
         count = iov[seg].iov_len;
@@ -257,10 +274,15 @@ svfs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
             bw = do_sync_write(llfs_filp, buf, count, &llfs_filp->f_pos);
         if (bw < 0) {
             ret = bw;
-            goto out;
+            break;
         }
         ret += bw;
     }
+    svfs_datastore_io_end(si->llfs_md.llfs_sd, start);
+    /* a migration in progress has to copy it again */
+    atomic_inc(&si->llfs_gen);
+    if (ret < 0)
+        goto out_up;
     
     if (ret > 0)
         fsnotify_modify(llfs_filp->f_dentry);
@@ -275,6 +297,7 @@ svfs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
     }
     iocb->ki_pos += ret;
     ASSERT(llfs_filp->f_pos == iocb->ki_ops);
+    up_read(&si->llfs_sem);
     /* should update the file info */
     file_update_time(filp);
     if (pos + ret > inode->i_size) {
@@ -283,10 +306,14 @@ svfs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
                    (unsigned long)pos, ret, 
                    (unsigned long)inode->i_size);
         i_size_write(inode, pos + ret);
+        svfs_datastore_classify(inode, pos + ret);
         mark_inode_dirty(inode);
     }
 out:
     return ret;
+out_up:
+    up_read(&si->llfs_sem);
+    goto out;
 }
 
 static
@@ -317,7 +344,16 @@ int svfs_file_mmap(struct file *file, struct vm_area_struct *vma)
         if (ret)
             goto out;
     }
+    /*
+     * No llfs_sem here, mmap_sem is held and the faults of read/write
+     * take it under llfs_sem. The count keeps the migration off, the
+     * lock keeps llfs_filp alive until the vma holds it.
+     */
+    atomic_inc(&SVFS_I(inode)->llfs_mmaps);
+    spin_lock(&SVFS_I(inode)->llfs_lock);
     llfs_filp = SVFS_I(inode)->llfs_md.llfs_filp;
+    get_file(llfs_filp);
+    spin_unlock(&SVFS_I(inode)->llfs_lock);
     llfs_mapping = llfs_filp->f_mapping;
     
     file_accessed(file);
@@ -328,10 +364,11 @@ int svfs_file_mmap(struct file *file, struct vm_area_struct *vma)
         ret = llfs_filp->f_op->mmap(llfs_filp, vma);
     else
         ret = -ENOEXEC;
-    if (!ret) {
+    /* on success the vma keeps our reference of llfs_filp */
+    if (!ret)
         fput(file);
-        get_file(llfs_filp);
-    }
+    else
+        fput(llfs_filp);
 out:
 	return ret;
 }
@@ -364,9 +401,11 @@ ssize_t svfs_file_splice_read(struct file *in, loff_t *ppos,
             goto out;
     }
     
+    down_read(&si->llfs_sem);
     llfs_file = si->llfs_md.llfs_filp;
     ASSERT(llfs_filp);
     ret = generic_file_splice_read(llfs_file, ppos, pipe, len, flags);
+    up_read(&si->llfs_sem);
     
 out:
     return ret;
@@ -391,6 +430,7 @@ ssize_t svfs_file_splice_write(struct pipe_inode_info *pipe,
     if (si->state & SVFS_STATE_DA) {
         /* create it now */
         ASSERT(!(si->state & SVFS_STATE_CONN));
+        svfs_datastore_classify(out->f_dentry->d_inode, *ppos + len);
         ret = llfs_create(out->f_dentry);
         if (ret)
             goto out;
@@ -401,6 +441,7 @@ ssize_t svfs_file_splice_write(struct pipe_inode_info *pipe,
         if (ret)
             goto out;
     }
+    down_read(&si->llfs_sem);
     llfs_filp = si->llfs_md.llfs_filp;
     ASSERT(llfs_filp);
     mapping = llfs_filp->f_mapping;
@@ -454,11 +495,45 @@ ssize_t svfs_file_splice_write(struct pipe_inode_info *pipe,
         }
         balance_dirty_pages_ratelimited_nr(mapping, nr_pages);
     }
-
+    atomic_inc(&si->llfs_gen);
+    up_read(&si->llfs_sem);
+
+    /* as in the write path, the size and its class follow the llfs */
+    if (ret > 0 && *ppos > i_size_read(out->f_dentry->d_inode)) {
+        i_size_write(out->f_dentry->d_inode, *ppos);
+        svfs_datastore_classify(out->f_dentry->d_inode, *ppos);
+        mark_inode_dirty(out->f_dentry->d_inode);
+    }
 out:
     return ret;
 }
 
+static long svfs_file_ioctl(struct file *filp, unsigned int cmd,
+                            unsigned long arg)
+{
+    struct inode *inode = filp->f_dentry->d_inode;
+    struct svfs_ioc_migrate im;
+    struct svfs_datastore *sd = NULL;
+
+    switch (cmd) {
+    case SVFS_IOC_MIGRATE:
+        if (!is_owner_or_cap(inode))
+            return -EACCES;
+        if (copy_from_user(&im, (void __user *)arg, sizeof(im)))
+            return -EFAULT;
+        im.target[NAME_MAX - 1] = '\0';
+        if (im.target[0]) {
+            sd = svfs_datastore_lookup(im.target);
+            if (!sd)
+                return -ENOENT;
+        }
+        /* queued, see /proc/fs/svfs/migrate for the progress */
+        return svfs_migrate_queue(inode, sd);
+    default:
+        return -ENOTTY;
+    }
+}
+
 const struct file_operations svfs_file_operations = {
     .llseek = svfs_file_llseek,
     .open = generic_file_open,
@@ -468,6 +543,7 @@ const struct file_operations svfs_file_operations = {
     .fsync = svfs_sync_file,
     .splice_read = svfs_file_splice_read,
     .splice_write = svfs_file_splice_write,
+    .unlocked_ioctl = svfs_file_ioctl,
 };
 
 const struct inode_operations svfs_file_inode_operations = {
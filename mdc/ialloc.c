@@ -47,6 +47,28 @@ void svfs_free_inode(struct inode *inode)
     return;
 }
 
+/*
+ * Hand out i_generation from the per-CPU range, only taking the
+ * next_gen_lock to reserve a new range of SVFS_POOL_GENS numbers.
+ */
+static u32 svfs_next_generation(struct svfs_super_block *ssb)
+{
+    struct svfs_cpu_pool *pool;
+    u32 gen;
+
+    pool = per_cpu_ptr(ssb->cpu_pools, get_cpu());
+    if (pool->next_gen == pool->end_gen) {
+        spin_lock(&ssb->next_gen_lock);
+        pool->next_gen = ssb->next_generation;
+        ssb->next_generation += SVFS_POOL_GENS;
+        spin_unlock(&ssb->next_gen_lock);
+        pool->end_gen = pool->next_gen + SVFS_POOL_GENS;
+    }
+    gen = pool->next_gen++;
+    put_cpu();
+    return gen;
+}
+
 struct inode *svfs_new_inode(struct inode *dir, int mode)
 {
     struct super_block* sb;
@@ -70,7 +92,8 @@ struct inode *svfs_new_inode(struct inode *dir, int mode)
     /* TODO: get the new inode from the MDS? */
 #ifdef SVFS_LOCAL_TEST
     {
-        ino = svfs_backing_store_find_mark_ino(ssb);
+        ino = svfs_backing_store_find_mark_ino(ssb, dir->i_ino,
+                                               S_ISDIR(mode));
         if (unlikely(ino == -1UL)) {
             /* get an invalid ino */
             svfs_warning(mdc, "Invalid ino %ld\n", ino);
@@ -97,14 +120,15 @@ struct inode *svfs_new_inode(struct inode *dir, int mode)
         CURRENT_TIME;
 
     si->disksize = 0;
-    si->flags = SVFS_I(dir)->flags; /* inherit from the dir */
+    si->flags = SVFS_I(dir)->flags & ~SVFS_IF_CLASS; /* inherit from the dir */
+    /* a new file starts small, see svfs_datastore_classify() */
+    if (S_ISREG(mode))
+        si->flags |= SVFS_IF_SMALL;
     si->dtime = 0;
 
     svfs_set_inode_flags(inode);
     insert_inode_hash(inode);
-    spin_lock(&ssb->next_gen_lock);
-    inode->i_generation = ssb->next_generation++;
-    spin_unlock(&ssb->next_gen_lock);
+    inode->i_generation = svfs_next_generation(ssb);
 
     si->state = SVFS_STATE_NEW;
     
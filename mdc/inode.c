@@ -26,7 +26,11 @@
 
 int svfs_force_commit(struct super_block *sb)
 {
-    /* TODO: force commit the superblock and the related dirty inodes */
+#ifdef SVFS_LOCAL_TEST
+    /* the flusher commits the dirty entries and the journal */
+    svfs_flusher_kick(SVFS_SB(sb));
+    svfs_shards_kick(SVFS_SB(sb));
+#endif
     return 0;
 }
 
@@ -61,15 +65,20 @@ int svfs_mark_inode_dirty(struct inode *inode)
 #ifdef SVFS_LOCAL_TEST
     /* FIXME: setting the internal flags? */
     {
-        struct svfs_super_block *ssb = SVFS_SB(inode->i_sb);
-        struct backing_store_entry *bse = (ssb->bse + inode->i_ino);
+        unsigned long ino = inode->i_ino;
+        struct svfs_super_block *ssb = svfs_bs_of(SVFS_SB(inode->i_sb), &ino);
+        struct backing_store_entry *bse = svfs_bse(ssb, ino);
 
+        svfs_bse_write_begin(ssb, ino);
         if (si->state & SVFS_STATE_NEW) {
 /*             memset(bse, 0, sizeof(struct backing_store_entry)); */
             bse->state = 0;
             bse->state |= SVFS_BS_NEW;
         }
         bse->state |= SVFS_BS_DIRTY;
+        svfs_bse_write_end(ssb, ino);
+        svfs_backing_store_dirty_entry(ssb, ino);
+        svfs_backing_store_mark_dirty(ssb, ino);
         si->state &= ~SVFS_STATE_NEW;
     }
 #endif
@@ -97,20 +106,25 @@ void svfs_truncate(struct inode *inode)
 
     /* checking the llfs_md */
     if (si->state & SVFS_STATE_DA)
-        return;
+        goto out;
     if (!(si->state & SVFS_STATE_CONN)) {
         ret = llfs_lookup(inode);
         if (ret)
-            return;
+            goto out;
     }
     /* shall we relay the request to LLFS? */
+    down_read(&si->llfs_sem);
     ret = vmtruncate(si->llfs_md.llfs_filp->f_dentry->d_inode, 
                      inode->i_size);
+    atomic_inc(&si->llfs_gen);
+    up_read(&si->llfs_sem);
 
     svfs_debug(mdc, "relay the truncate to LLFS, ino %ld, size %lu, "
                "ret %d\n",
                inode->i_ino, (unsigned long)inode->i_size, ret);
-    return;
+out:
+    /* the new size may be of another class, up or down */
+    svfs_datastore_classify(inode, inode->i_size);
 }
 
 void svfs_delete_inode(struct inode *inode)
@@ -353,10 +367,27 @@ struct inode *svfs_iget(struct super_block *sb, unsigned long ino)
     inode->i_ino = ino;
 #ifdef SVFS_LOCAL_TEST
     {
-        struct svfs_super_block *ssb = SVFS_SB(sb);
-        struct backing_store_entry *bse = ssb->bse + ino;
+        struct svfs_super_block *ssb = SVFS_SB(sb), *bs;
+        struct backing_store_entry snap, *bse;
+        unsigned long slot = ino;
         int err;
 
+        bs = svfs_bs_of(ssb, &slot);
+        if (!bs || slot >= bs->bs_size) {
+            iget_failed(inode);
+            return ERR_PTR(-ESTALE);
+        }
+        bse = svfs_bse_get(bs, slot);
+        if (IS_ERR(bse)) {
+            iget_failed(inode);
+            return ERR_PTR(PTR_ERR(bse));
+        }
+        if (svfs_bsn(bs, slot)->flags & SVFS_BSN_BAD) {
+            iget_failed(inode);
+            return ERR_PTR(-EIO);
+        }
+        svfs_bse_read(bs, slot, &snap);
+        bse = &snap;
         ASSERT(bse->state & SVFS_BS_VALID);
         inode->i_nlink = bse->nlink;
         inode->i_size = bse->disksize;
@@ -372,7 +403,7 @@ struct inode *svfs_iget(struct super_block *sb, unsigned long ino)
         SVFS_I(inode)->llfs_md.llfs_type = bse->llfs_type;
         SVFS_I(inode)->llfs_md.llfs_fsid = bse->llfs_fsid;
         err = svfs_backing_store_get_path2(
-            ssb, bse, 
+            ssb, ino, 
             SVFS_I(inode)->llfs_md.llfs_pathname, NAME_MAX - 1);
         if (err) {
             iget_failed(inode);
@@ -0,0 +1,616 @@
+/**
+ * Copyright (c) 2009 Ma Can <ml.macana@gmail.com>
+ *                           <macan@ncic.ac.cn>
+ *
+ * Time-stamp: <2009-09-08 10:12:45 macan>
+ *
+ * migrate.c: move the llfs files between the datastores
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "svfs.h"
+
+/*
+ * The files are queued by SVFS_IOC_MIGRATE, or by the reclassification
+ * when auto is on, and moved one at a time by svfs_migrate. The copy
+ * runs through the page cache with the I/O going on, the writers bump
+ * llfs_gen and a file changed under the copy is copied again. One still
+ * changing after SVFS_MIGRATE_RETRIES copies goes back to the end of the
+ * queue, llfs_sem is only held to check llfs_gen and switch the referal.
+ * The entry is then committed, and only then the source is unlinked. A
+ * file mmapped since it was read in stays put.
+ *
+ * A drain scans the tables of the mounts for the files of a datastore
+ * and queues a batch of them whenever the queue runs empty.
+ */
+struct svfs_migrate_req
+{
+    struct list_head list;
+    struct inode *inode;        /* igrab'ed */
+    struct svfs_datastore *dst; /* NULL: placed by the size class */
+    struct svfs_datastore *src; /* only if still there, NULL: any */
+    int requeued;
+};
+
+#define SVFS_MIGRATE_CHUNK      (64 << 10)
+#define SVFS_MIGRATE_RETRIES    3
+#define SVFS_MIGRATE_REQUEUES   8
+#define SVFS_MIGRATE_DRAIN_BATCH 64
+
+static LIST_HEAD(svfs_migrate_list);
+static DEFINE_SPINLOCK(svfs_migrate_lock);
+static DECLARE_WAIT_QUEUE_HEAD(svfs_migrate_wait);
+static DEFINE_MUTEX(svfs_migrate_mutex); /* held over one file */
+static struct task_struct *svfs_migrate_task;
+static LIST_HEAD(svfs_migrate_sbs); /* the mounts, under svfs_migrate_mutex */
+
+static unsigned int svfs_migrate_rate = 32 << 10; /* KB/s, 0 unlimited */
+static int svfs_migrate_auto = 0;
+
+static struct
+{
+    unsigned long pending, done, skipped, failed, retried, requeued;
+    u64 bytes;
+    unsigned long cur_ino;      /* 0 when idle */
+    loff_t cur_copied, cur_size;
+} svfs_migrate_stat;
+
+/* the drain in progress, under svfs_migrate_mutex */
+static struct
+{
+    struct svfs_datastore *sd;  /* NULL when none */
+    struct svfs_super_block *ssb; /* the mount being scanned */
+    int store;                  /* 0 the root table, then the shards */
+    unsigned long slot;
+    unsigned long queued;
+} svfs_migrate_drain;
+
+/* sleep off the bytes above the rate since the start of the copy */
+static void svfs_migrate_throttle(u64 copied, unsigned long start)
+{
+    unsigned int rate = ACCESS_ONCE(svfs_migrate_rate);
+    unsigned long due;
+
+    if (!rate)
+        return;
+    due = start + (unsigned long)div64_u64(copied * HZ, (u64)rate << 10);
+    if (time_before(jiffies, due))
+        schedule_timeout_interruptible(due - jiffies);
+}
+
+/* each copy is throttled on its own, a retry is not a catch up */
+static int __svfs_migrate_copy(struct file *src, struct file *dst,
+                               loff_t size, char *buf)
+{
+    unsigned long start = jiffies;
+    mm_segment_t oldfs = get_fs();
+    loff_t pos = 0, rpos, wpos;
+    ssize_t br, bw;
+    int err = 0;
+
+    set_fs(KERNEL_DS);
+    while (pos < size) {
+        rpos = wpos = pos;
+        br = vfs_read(src, (char __user *)buf,
+                      min_t(loff_t, size - pos, SVFS_MIGRATE_CHUNK), &rpos);
+        /* a truncate bumps llfs_gen, it is caught after the copy */
+        if (br <= 0) {
+            err = br;
+            break;
+        }
+        bw = vfs_write(dst, (char __user *)buf, br, &wpos);
+        if (bw != br) {
+            err = bw < 0 ? bw : -EIO;
+            break;
+        }
+        pos += br;
+        svfs_migrate_stat.cur_copied = pos;
+        svfs_migrate_stat.bytes += br;
+        if (kthread_should_stop()) {
+            err = -EINTR;
+            break;
+        }
+        svfs_migrate_throttle(pos, start);
+    }
+    set_fs(oldfs);
+    return err;
+}
+
+static void __svfs_migrate_unlink(struct file *filp)
+{
+    struct dentry *dentry = filp->f_dentry;
+    struct dentry *parent = dget_parent(dentry);
+    int err;
+
+    err = mnt_want_write(filp->f_vfsmnt);
+    if (err)
+        goto out;
+    mutex_lock_nested(&parent->d_inode->i_mutex, I_MUTEX_PARENT);
+    /* it may be gone meanwhile */
+    if (dentry->d_parent == parent && dentry->d_inode)
+        err = vfs_unlink(parent->d_inode, dentry);
+    mutex_unlock(&parent->d_inode->i_mutex);
+    mnt_drop_write(filp->f_vfsmnt);
+out:
+    if (err)
+        svfs_warning(mdc, "unlink the llfs file %s failed %d\n",
+                     dentry->d_name.name, err);
+    dput(parent);
+}
+
+/* the entry must point to the copy before the source goes */
+static int __svfs_migrate_commit(struct inode *inode)
+{
+    int err = 0;
+#ifdef SVFS_LOCAL_TEST
+    struct svfs_super_block *bs;
+    unsigned long slot = inode->i_ino;
+
+    svfs_mark_inode_dirty(inode);
+    if (svfs_backing_store_is_ood(inode))
+        svfs_backing_store_commit_bse(inode);
+    bs = svfs_bs_of(SVFS_SB(inode->i_sb), &slot);
+    err = svfs_journal_commit(bs, 1);
+#endif
+    return err;
+}
+
+static int svfs_migrate_one(struct inode *inode, struct svfs_datastore *dst,
+                            struct svfs_datastore *src)
+{
+    struct svfs_inode *si = SVFS_I(inode);
+    struct file *old, *new;
+    unsigned long start = jiffies;
+    loff_t size;
+    char *path, *buf;
+    int gen, try, err;
+
+    if (!S_ISREG(inode->i_mode) || (si->state & SVFS_STATE_DA))
+        return -EALREADY;
+    if (!(si->state & SVFS_STATE_CONN)) {
+        err = llfs_lookup(inode);
+        if (err)
+            return err;
+    }
+    if (!dst)
+        dst = svfs_datastore_get_tier(svfs_datastore_tier_of(si->flags));
+    if (!dst || dst == si->llfs_md.llfs_sd ||
+        (src && src != si->llfs_md.llfs_sd))
+        return -EALREADY;
+    if (atomic_read(&si->llfs_mmaps))
+        return -EBUSY;
+
+    err = -ENOMEM;
+    path = __getname();
+    if (!path)
+        goto out;
+    buf = kmalloc(SVFS_MIGRATE_CHUNK, GFP_KERNEL);
+    if (!buf)
+        goto out_putname;
+    snprintf(path, PATH_MAX, "%s%s", dst->pathname,
+             si->llfs_md.llfs_pathname);
+    svfs_migrate_stat.cur_ino = inode->i_ino;
+
+    for (try = 0; ; try++) {
+        gen = atomic_read(&si->llfs_gen);
+        smp_rmb();
+        /* only we switch llfs_filp, it is stable here */
+        old = si->llfs_md.llfs_filp;
+        new = filp_open(path, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE,
+                        S_IRUGO | S_IWUSR);
+        if (IS_ERR(new)) {
+            err = PTR_ERR(new);
+            goto out_free;
+        }
+        size = i_size_read(old->f_dentry->d_inode);
+        svfs_migrate_stat.cur_size = size;
+        svfs_migrate_stat.cur_copied = 0;
+        err = __svfs_migrate_copy(old, new, size, buf);
+        if (!err)
+            err = vfs_fsync(new, new->f_dentry, 1);
+        if (err)
+            goto out_drop;
+        down_write(&si->llfs_sem);
+        if (atomic_read(&si->llfs_gen) == gen)
+            break;
+        up_write(&si->llfs_sem);
+        if (try + 1 == SVFS_MIGRATE_RETRIES) {
+            /* the I/O is never held off over a copy, try it later */
+            err = -EAGAIN;
+            goto out_drop;
+        }
+        fput(new);
+        svfs_migrate_stat.retried++;
+    }
+
+    /* a mapping of the source would go on writing there */
+    spin_lock(&si->llfs_lock);
+    if (atomic_read(&si->llfs_mmaps)) {
+        spin_unlock(&si->llfs_lock);
+        up_write(&si->llfs_sem);
+        err = -EBUSY;
+        goto out_drop;
+    }
+    si->llfs_md.llfs_filp = new;
+    spin_unlock(&si->llfs_lock);
+    si->llfs_md.llfs_sd = dst;
+    si->llfs_md.llfs_type = dst->type;
+    si->llfs_md.llfs_fsid = dst->fsid;
+    up_write(&si->llfs_sem);
+
+    err = __svfs_migrate_commit(inode);
+    if (err)
+        /* keep the source, the entry may still point to it */
+        svfs_err(mdc, "commit the migration of inode %lu failed %d, "
+                 "left the source behind\n", inode->i_ino, err);
+    else
+        __svfs_migrate_unlink(old);
+    fput(old);
+    svfs_debug(mdc, "migrated inode %lu to %s, %lld bytes in %u ms\n",
+               inode->i_ino, dst->pathname, size,
+               jiffies_to_msecs(jiffies - start));
+    goto out_free;
+
+out_drop:
+    __svfs_migrate_unlink(new);
+    fput(new);
+out_free:
+    svfs_migrate_stat.cur_ino = 0;
+    kfree(buf);
+out_putname:
+    __putname(path);
+out:
+    return err;
+}
+
+static int __svfs_migrate_queue(struct inode *inode,
+                                struct svfs_datastore *dst,
+                                struct svfs_datastore *src);
+
+/* the next mount after @ssb, NULL at the end */
+static struct svfs_super_block *
+__svfs_migrate_next_sb(struct svfs_super_block *ssb)
+{
+    if (ssb->mnt_list.next == &svfs_migrate_sbs)
+        return NULL;
+    return list_entry(ssb->mnt_list.next, struct svfs_super_block,
+                      mnt_list);
+}
+
+/* queue the next batch of the files on the draining datastore */
+static void svfs_migrate_drain_scan(void)
+{
+    struct svfs_datastore *sd = svfs_migrate_drain.sd;
+    struct svfs_super_block *ssb, *bs;
+    struct backing_store_entry snap;
+    struct inode *inode;
+    unsigned long slot;
+    int found = 0;
+
+    while ((ssb = svfs_migrate_drain.ssb) &&
+           found < SVFS_MIGRATE_DRAIN_BATCH) {
+#ifdef SVFS_LOCAL_TEST
+        if (svfs_migrate_drain.store > ssb->bs_nshards) {
+            svfs_migrate_drain.ssb = __svfs_migrate_next_sb(ssb);
+            svfs_migrate_drain.store = 0;
+            svfs_migrate_drain.slot = 0;
+            continue;
+        }
+        bs = svfs_migrate_drain.store ?
+            ssb->bs_shards[svfs_migrate_drain.store - 1] : ssb;
+        if (!svfs_migrate_drain.slot)
+            svfs_backing_store_wait_loaded(bs);
+        if (svfs_migrate_drain.slot >= bs->bs_size) {
+            svfs_migrate_drain.store++;
+            svfs_migrate_drain.slot = 0;
+            continue;
+        }
+        slot = svfs_migrate_drain.slot++;
+        /* an empty segment is left unmapped by the loader */
+        if (!ACCESS_ONCE(bs->bs_segs[slot / SVFS_BS_SEG_ENTRIES].bse)) {
+            svfs_migrate_drain.slot = roundup(slot + 1, SVFS_BS_SEG_ENTRIES);
+            continue;
+        }
+        smp_rmb();
+        svfs_bse_read(bs, slot, &snap);
+        if (!(snap.state & SVFS_BS_VALID) || !(snap.state & SVFS_BS_FILE) ||
+            (snap.state & SVFS_BS_DELETING) ||
+            snap.llfs_type != sd->type || snap.llfs_fsid != sd->fsid)
+            continue;
+        inode = svfs_iget(ssb->sb, svfs_bs_ino(bs, slot));
+        if (IS_ERR(inode))
+            continue;
+        if (!__svfs_migrate_queue(inode, NULL, sd)) {
+            found++;
+            svfs_migrate_drain.queued++;
+        }
+        iput(inode);
+        cond_resched();
+#else
+        /* no table to scan, the drain only stops the placement */
+        svfs_migrate_drain.ssb = NULL;
+#endif
+    }
+    if (!svfs_migrate_drain.ssb) {
+        svfs_info(mdc, "drain of %s: %lu files queued\n", sd->pathname,
+                  svfs_migrate_drain.queued);
+        svfs_migrate_drain.sd = NULL;
+    }
+}
+
+/*
+ * Put a file busy with writes back to the end of the queue. Called
+ * under svfs_migrate_mutex: a mount being cancelled is off the list of
+ * the mounts, or its cancel has yet to drop the queue.
+ */
+static int svfs_migrate_requeue(struct svfs_migrate_req *req)
+{
+    if (++req->requeued > SVFS_MIGRATE_REQUEUES ||
+        list_empty(&SVFS_SB(req->inode->i_sb)->mnt_list))
+        return 0;
+    spin_lock(&svfs_migrate_lock);
+    list_add_tail(&req->list, &svfs_migrate_list);
+    svfs_migrate_stat.pending++;
+    svfs_migrate_stat.requeued++;
+    spin_unlock(&svfs_migrate_lock);
+    return 1;
+}
+
+static int svfs_migrate(void *data)
+{
+    struct svfs_migrate_req *req;
+    int err;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(svfs_migrate_wait,
+                                 kthread_should_stop() ||
+                                 !list_empty(&svfs_migrate_list) ||
+                                 ACCESS_ONCE(svfs_migrate_drain.sd));
+        mutex_lock(&svfs_migrate_mutex);
+        req = NULL;
+        spin_lock(&svfs_migrate_lock);
+        if (!list_empty(&svfs_migrate_list)) {
+            req = list_entry(svfs_migrate_list.next,
+                             struct svfs_migrate_req, list);
+            list_del(&req->list);
+            svfs_migrate_stat.pending--;
+        }
+        spin_unlock(&svfs_migrate_lock);
+        if (!req && svfs_migrate_drain.sd)
+            svfs_migrate_drain_scan();
+        if (req) {
+            err = svfs_migrate_one(req->inode, req->dst, req->src);
+            if (!err)
+                svfs_migrate_stat.done++;
+            else if (err == -EALREADY)
+                svfs_migrate_stat.skipped++;
+            else if (err == -EAGAIN && svfs_migrate_requeue(req))
+                req = NULL;
+            else {
+                svfs_migrate_stat.failed++;
+                svfs_warning(mdc, "migrate inode %lu failed %d\n",
+                             req->inode->i_ino, err);
+            }
+            if (req) {
+                iput(req->inode);
+                kfree(req);
+            }
+        }
+        mutex_unlock(&svfs_migrate_mutex);
+    }
+    return 0;
+}
+
+static int __svfs_migrate_queue(struct inode *inode,
+                                struct svfs_datastore *dst,
+                                struct svfs_datastore *src)
+{
+    struct svfs_migrate_req *req;
+
+    req = kmalloc(sizeof(*req), GFP_NOFS);
+    if (!req)
+        return -ENOMEM;
+    req->inode = igrab(inode);
+    if (!req->inode) {
+        kfree(req);
+        return -ENOENT;
+    }
+    req->dst = dst;
+    req->src = src;
+    req->requeued = 0;
+    spin_lock(&svfs_migrate_lock);
+    list_add_tail(&req->list, &svfs_migrate_list);
+    svfs_migrate_stat.pending++;
+    spin_unlock(&svfs_migrate_lock);
+    wake_up(&svfs_migrate_wait);
+    return 0;
+}
+
+/* @dst NULL moves the file to the tier of its size class */
+int svfs_migrate_queue(struct inode *inode, struct svfs_datastore *dst)
+{
+    return __svfs_migrate_queue(inode, dst, NULL);
+}
+
+/* move every file off @sd, it takes no new ones meanwhile */
+static void svfs_migrate_drain_start(struct svfs_datastore *sd)
+{
+    mutex_lock(&svfs_migrate_mutex);
+    if (svfs_migrate_drain.sd)
+        svfs_warning(mdc, "drain of %s replaces the one of %s\n",
+                     sd->pathname, svfs_migrate_drain.sd->pathname);
+    svfs_migrate_drain.sd = sd;
+    svfs_migrate_drain.ssb = list_empty(&svfs_migrate_sbs) ? NULL :
+        list_entry(svfs_migrate_sbs.next, struct svfs_super_block,
+                   mnt_list);
+    svfs_migrate_drain.store = 0;
+    svfs_migrate_drain.slot = 0;
+    svfs_migrate_drain.queued = 0;
+    mutex_unlock(&svfs_migrate_mutex);
+    wake_up(&svfs_migrate_wait);
+}
+
+static void svfs_migrate_drain_stop(struct svfs_datastore *sd)
+{
+    mutex_lock(&svfs_migrate_mutex);
+    if (svfs_migrate_drain.sd == sd)
+        svfs_migrate_drain.sd = NULL;
+    mutex_unlock(&svfs_migrate_mutex);
+}
+
+void svfs_migrate_register(struct super_block *sb)
+{
+    mutex_lock(&svfs_migrate_mutex);
+    list_add_tail(&SVFS_SB(sb)->mnt_list, &svfs_migrate_sbs);
+    mutex_unlock(&svfs_migrate_mutex);
+}
+
+/* a file crossed into another size class */
+void svfs_migrate_misplaced(struct inode *inode)
+{
+    if (ACCESS_ONCE(svfs_migrate_auto))
+        svfs_migrate_queue(inode, NULL);
+}
+
+/* drop the requests on @sb and wait for the one in progress */
+void svfs_migrate_cancel(struct super_block *sb)
+{
+    struct svfs_super_block *ssb = SVFS_SB(sb);
+    struct svfs_migrate_req *req, *n;
+    LIST_HEAD(dropped);
+
+    mutex_lock(&svfs_migrate_mutex);
+    if (svfs_migrate_drain.ssb == ssb) {
+        svfs_migrate_drain.ssb = __svfs_migrate_next_sb(ssb);
+        svfs_migrate_drain.store = 0;
+        svfs_migrate_drain.slot = 0;
+    }
+    list_del_init(&ssb->mnt_list);
+    mutex_unlock(&svfs_migrate_mutex);
+
+    spin_lock(&svfs_migrate_lock);
+    list_for_each_entry_safe(req, n, &svfs_migrate_list, list) {
+        if (req->inode->i_sb == sb) {
+            list_move(&req->list, &dropped);
+            svfs_migrate_stat.pending--;
+        }
+    }
+    spin_unlock(&svfs_migrate_lock);
+    list_for_each_entry_safe(req, n, &dropped, list) {
+        iput(req->inode);
+        kfree(req);
+    }
+    mutex_lock(&svfs_migrate_mutex);
+    mutex_unlock(&svfs_migrate_mutex);
+}
+
+static int svfs_migrate_show(struct seq_file *m, void *v)
+{
+    struct svfs_datastore *sd;
+
+    seq_printf(m, "rate_kbs: %u\nauto: %d\n", svfs_migrate_rate,
+               svfs_migrate_auto);
+    seq_printf(m, "pending: %lu\ndone: %lu\nskipped: %lu\nfailed: %lu\n"
+               "retried: %lu\nrequeued: %lu\nbytes: %llu\n",
+               svfs_migrate_stat.pending, svfs_migrate_stat.done,
+               svfs_migrate_stat.skipped, svfs_migrate_stat.failed,
+               svfs_migrate_stat.retried, svfs_migrate_stat.requeued,
+               (unsigned long long)svfs_migrate_stat.bytes);
+    if (svfs_migrate_stat.cur_ino)
+        seq_printf(m, "current: ino %lu, %lld/%lld bytes\n",
+                   svfs_migrate_stat.cur_ino,
+                   svfs_migrate_stat.cur_copied, svfs_migrate_stat.cur_size);
+    else
+        seq_printf(m, "current: none\n");
+    /* unlocked, the mutex is held over a whole file */
+    sd = ACCESS_ONCE(svfs_migrate_drain.sd);
+    if (sd)
+        seq_printf(m, "drain: %s, store %d, slot %lu, %lu files queued\n",
+                   sd->pathname, svfs_migrate_drain.store,
+                   svfs_migrate_drain.slot, svfs_migrate_drain.queued);
+    else
+        seq_printf(m, "drain: none\n");
+    return 0;
+}
+
+static int svfs_migrate_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, svfs_migrate_show, NULL);
+}
+
+/* rate <KB/s> | auto <0|1> | drain <datastore> | undrain <datastore> */
+static ssize_t svfs_migrate_write(struct file *file,
+                                  const char __user *buffer,
+                                  size_t count, loff_t *ppos)
+{
+    char buf[NAME_MAX + 16], name[NAME_MAX];
+    unsigned int v;
+    int err = -EINVAL;
+
+    if (!count || count >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, buffer, count))
+        return -EFAULT;
+    buf[count] = '\0';
+    if (sscanf(buf, "rate %u", &v) == 1) {
+        svfs_migrate_rate = v;
+        err = 0;
+    } else if (sscanf(buf, "auto %u", &v) == 1) {
+        svfs_migrate_auto = !!v;
+        err = 0;
+    } else if (sscanf(buf, "drain %254s", name) == 1) {
+        err = svfs_datastore_drain(name, 1);
+        if (!err)
+            svfs_migrate_drain_start(svfs_datastore_lookup(name));
+    } else if (sscanf(buf, "undrain %254s", name) == 1) {
+        err = svfs_datastore_drain(name, 0);
+        if (!err)
+            svfs_migrate_drain_stop(svfs_datastore_lookup(name));
+    }
+    return err ? err : count;
+}
+
+static const struct file_operations svfs_migrate_fops = {
+    .owner = THIS_MODULE,
+    .open = svfs_migrate_open,
+    .read = seq_read,
+    .write = svfs_migrate_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int svfs_migrate_init(void)
+{
+    struct task_struct *task;
+
+    task = kthread_run(svfs_migrate, NULL, "svfs_migrate");
+    if (IS_ERR(task))
+        return PTR_ERR(task);
+    svfs_migrate_task = task;
+    if (svfs_lib_proc_add_entry(NULL, "migrate", &svfs_migrate_fops))
+        svfs_err(mdc, "init migrate proc entry failed\n");
+    return 0;
+}
+
+void svfs_migrate_exit(void)
+{
+    svfs_lib_proc_remove_entry(NULL, "migrate");
+    if (svfs_migrate_task) {
+        kthread_stop(svfs_migrate_task);
+        svfs_migrate_task = NULL;
+    }
+}
@@ -54,19 +54,18 @@ static int svfs_add_entry(struct dentry *dentry, struct inode *inode)
         goto out;
     }
     
-    sd = svfs_datastore_get(LLFS_TYPE_ANY, 0);
+    sd = svfs_datastore_get_tier(svfs_datastore_tier_of(si->flags));
     if (!sd) {
         retval = PTR_ERR(sd);
         goto out_dsget;
     }
     si->llfs_md.llfs_type = sd->type;
-    si->llfs_md.llfs_fsid = svfs_datastore_fsid(sd->pathname);
+    si->llfs_md.llfs_fsid = sd->fsid;
     retval = -ENOMEM;
     ref_path = __getname();
     if (!ref_path)
         goto out_dsget;
-    retval = svfs_backing_store_get_path2(SVFS_SB(sb), 
-                                          SVFS_SB(sb)->bse + inode->i_ino,
+    retval = svfs_backing_store_get_path2(SVFS_SB(sb), inode->i_ino,
                                           si->llfs_md.llfs_pathname,
                                           NAME_MAX - 1);
     if (retval)
@@ -80,6 +79,7 @@ static int svfs_add_entry(struct dentry *dentry, struct inode *inode)
     if (IS_ERR(llfs_file))
         goto out_putname;
     si->llfs_md.llfs_filp = llfs_file;
+    si->llfs_md.llfs_sd = sd;
     si->state |= SVFS_STATE_CONN;
     retval = 0;
 
@@ -241,6 +241,7 @@ static struct dentry *svfs_lookup(struct inode *dir, struct dentry *dentry,
                  PTR_ERR(llfs_dentry));
         goto out_put_filp;
     }
+    SVFS_I(inode)->llfs_md.llfs_sd = sd;
     SVFS_I(inode)->state |= SVFS_STATE_CONN;
     retval = NULL;
 
@@ -379,17 +380,14 @@ static int svfs_symlink(struct inode *dir, struct dentry *dentry,
 #ifdef SVFS_LOCAL_TEST
     {
         struct super_block *sb = dir->i_sb;
-        struct backing_store_entry *bse = SVFS_SB(sb)->bse + inode->i_ino;
-        
-        if (l > sizeof(bse->ref_path)) {
-            /* could no filling in the metadata store */
-            err = -ENAMETOOLONG;
+
+        /* the target goes to the name heap */
+        err = svfs_backing_store_set_link(SVFS_SB(sb), inode->i_ino,
+                                          symname, l - 1);
+        if (err)
             goto out_stop;
-        } else {
-            inode->i_op = &svfs_fast_symlink_inode_operations;
-            memcpy((char *)&(bse->ref_path), symname, l);
-            inode->i_size = l - 1;
-        }
+        inode->i_op = &svfs_fast_symlink_inode_operations;
+        inode->i_size = l - 1;
     }
 #endif
     SVFS_I(inode)->disksize = inode->i_size;
@@ -436,13 +434,8 @@ static int empty_dir(struct inode *inode)
     
     /* find if there are any dentrys in this inode */
 #ifdef SVFS_LOCAL_TEST
-    unsigned long ino;
-    ino = svfs_backing_store_find_child(SVFS_SB(inode->i_sb), inode->i_ino,
-                                        0);
-    if (ino == -1ULL)
-        ret = 1;
-    else 
-        ret = 0;
+    ret = !svfs_backing_store_nr_children(SVFS_SB(inode->i_sb), 
+                                          inode->i_ino);
 #endif
     return ret;
 }
@@ -37,19 +37,91 @@ static int svfs_compare_super(struct super_block *sb, void *data)
     return 1;
 }
 
-static struct svfs_super_block *svfs_alloc_sb(void)
+struct svfs_super_block *svfs_alloc_sb(void)
 {
     struct svfs_super_block *ssb;
+    int cpu, i;
 
     ssb = kzalloc(sizeof(struct svfs_super_block), GFP_KERNEL);
     if (!ssb)
         return ERR_PTR(-ENOMEM);
+    ssb->cpu_pools = alloc_percpu(struct svfs_cpu_pool);
+    if (!ssb->cpu_pools) {
+        kfree(ssb);
+        return ERR_PTR(-ENOMEM);
+    }
+#ifdef SVFS_LOCAL_TEST
+    for_each_possible_cpu(cpu) {
+        spin_lock_init(&per_cpu_ptr(ssb->cpu_pools, cpu)->lock);
+        for (i = 0; i < SVFS_POOL_SEGS; i++)
+            per_cpu_ptr(ssb->cpu_pools, cpu)->cache[i].seg = -1;
+    }
+#endif
+    INIT_LIST_HEAD(&ssb->mnt_list);
     /* TODO: init svfs_super_block here */
     svfs_debug(mdc, "kzalloc ssb %p size %ld\n", ssb,
                sizeof(struct svfs_super_block));
     return ssb;
 }
 
+enum {
+    opt_bs_size, opt_bs_max_size, opt_bs_shards, opt_err
+};
+
+static match_table_t svfs_tokens = {
+    {opt_bs_size, "bs_size=%u"},
+    {opt_bs_max_size, "bs_max_size=%u"},
+    {opt_bs_shards, "bs_shards=%s"},
+    {opt_err, NULL}
+};
+
+static int svfs_parse_options(struct svfs_super_block *ssb, char *options)
+{
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+    int token, option;
+
+    if (!options)
+        return 0;
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+        token = match_token(p, svfs_tokens, args);
+        switch (token) {
+#ifdef SVFS_LOCAL_TEST
+        case opt_bs_size:
+            if (match_int(&args[0], &option) || option <= 0)
+                return -EINVAL;
+            ssb->bs_opt_size = option;
+            break;
+        case opt_bs_max_size:
+            if (match_int(&args[0], &option) || option <= 0)
+                return -EINVAL;
+            ssb->bs_opt_max_size = option;
+            break;
+        case opt_bs_shards:
+            kfree(ssb->bs_opt_shards);
+            ssb->bs_opt_shards = match_strdup(&args[0]);
+            if (!ssb->bs_opt_shards)
+                return -ENOMEM;
+            break;
+#endif
+        default:
+            svfs_err(mdc, "unrecognized mount option '%s'\n", p);
+            return -EINVAL;
+        }
+    }
+#ifdef SVFS_LOCAL_TEST
+    if (ssb->bs_opt_max_size && ssb->bs_opt_size > ssb->bs_opt_max_size) {
+        svfs_err(mdc, "bs_size %u is larger than bs_max_size %u\n",
+                 ssb->bs_opt_size, ssb->bs_opt_max_size);
+        return -EINVAL;
+    }
+#endif
+    return 0;
+}
+
 /**
  * TODO: Setting up the server names and path.
  */
@@ -59,14 +131,18 @@ static int svfs_init_sb(struct svfs_super_block *ssb, int flags,
     /* FIXME: */
     ssb->flags = SVFS_SB_FREE;
     ssb->fsid = 0;
-    return 0;
+    return svfs_parse_options(ssb, raw_data);
 }
 
-static void svfs_free_sb(struct svfs_super_block *ssb)
+void svfs_free_sb(struct svfs_super_block *ssb)
 {
     if (!ssb)
         return;
     /* TODO: finalize other fields first */
+#ifdef SVFS_LOCAL_TEST
+    kfree(ssb->bs_opt_shards);
+#endif
+    free_percpu(ssb->cpu_pools);
     svfs_debug(mdc, "kfree ssb %p\n", ssb);
     kfree(ssb);
 }
@@ -94,6 +170,8 @@ static struct inode *svfs_alloc_inode(struct super_block *sb)
         return NULL;
     /* TODO: init the svfs inode here */
     si->state = 0;
+    atomic_set(&si->llfs_gen, 0);
+    atomic_set(&si->llfs_mmaps, 0);
     /* TODO: should journal the new inode? */
 
     svfs_debug(mdc, "alloc new svfs_inode: %p\n", si);
@@ -123,9 +201,12 @@ static void svfs_put_super(struct super_block *sb)
 static struct inode *svfs_nfs_get_inode(struct super_block *sb,
                                         u64 ino, u32 generation)
 {
+    struct svfs_super_block *bs;
     struct inode *inode;
+    unsigned long slot = ino;
 
-    if (ino > SVFS_SB(sb)->bs_size)
+    bs = svfs_bs_of(SVFS_SB(sb), &slot);
+    if (!bs || slot >= bs->bs_size)
         return ERR_PTR(-ESTALE);
 
     /* iget isn't really right if the inode is currently unallocated!!
@@ -178,8 +259,22 @@ static int svfs_statfs(struct dentry *dentry, struct kstatfs *buf)
     buf->f_bsize = sb->s_blocksize;
     /* Geting f_blocks,f_bfree,f_bavail from LLFSs */
     svfs_datastore_statfs(buf);
-    buf->f_files = ssb->bs_size;
-    buf->f_ffree = ssb->bs_size - (int)atomic_read(&ssb->bs_inuse);
+    /* the table grows on demand, so report the capacity we may reach */
+    buf->f_files = ssb->bs_max_segs * SVFS_BS_SEG_ENTRIES;
+    buf->f_ffree = buf->f_files - (int)atomic_read(&ssb->bs_inuse);
+#ifdef SVFS_LOCAL_TEST
+    {
+        struct svfs_super_block *bs;
+        int i;
+
+        for (i = 0; i < ssb->bs_nshards; i++) {
+            bs = ssb->bs_shards[i];
+            buf->f_files += bs->bs_max_segs * SVFS_BS_SEG_ENTRIES;
+            buf->f_ffree += bs->bs_max_segs * SVFS_BS_SEG_ENTRIES -
+                (int)atomic_read(&bs->bs_inuse);
+        }
+    }
+#endif
     buf->f_namelen = SVFS_NAME_LEN;
     buf->f_fsid.val[0] = ssb->fsid & 0xFFFFFFFFUL;
     buf->f_fsid.val[1] = (ssb->fsid >> 32) & 0xFFFFFFFFUL;
@@ -189,15 +284,43 @@ static int svfs_statfs(struct dentry *dentry, struct kstatfs *buf)
     return 0;
 }
 
+/* 
+ * Called periodically by the kupdate writeback if s_dirt is set. The
+ * table pages are written by the journal checkpoint, just push the
+ * pending records here.
+ */
+static void svfs_write_super(struct super_block *sb)
+{
+    sb->s_dirt = 0;
+#ifdef SVFS_LOCAL_TEST
+    {
+        int err = svfs_journal_commit(SVFS_SB(sb), 0);
+        err = svfs_shards_commit(SVFS_SB(sb), 0) ?: err;
+        if (err) {
+            svfs_err(mdc, "commit journal failed, err %d\n", err);
+            sb->s_dirt = 1;
+        }
+    }
+#endif
+}
+
 static int svfs_sync_fs(struct super_block *sb, int wait)
 {
+    struct svfs_super_block *ssb __attribute__((unused)) = SVFS_SB(sb);
+    int err = 0;
+
     sb->s_dirt = 0;
-    /* TODO: commit the dirty contents? */
+#ifdef SVFS_LOCAL_TEST
+    err = svfs_journal_commit(ssb, wait);
+    err = svfs_shards_commit(ssb, wait) ?: err;
+    if (err)
+        sb->s_dirt = 1;
+#endif
     svfs_debug(mdc, "svfs sync fs now, wait %d, s_io %d, s_dirty %d\n", 
                wait, list_empty(&sb->s_io), list_empty(&sb->s_dirty));
     if (IS_SVFS_VERBOSE(mdc))
         dump_stack();
-    return 0;
+    return err;
 }
 
 static int svfs_remount_fs(struct super_block *sb, int *flags, char *data)
@@ -234,6 +357,7 @@ static const struct super_operations svfs_sops = {
     .dirty_inode = svfs_dirty_inode,
     .delete_inode = svfs_delete_inode,
     .put_super = svfs_put_super,
+    .write_super = svfs_write_super,
     .statfs = svfs_statfs,
     .sync_fs = svfs_sync_fs,
     .remount_fs = svfs_remount_fs,
@@ -249,7 +373,6 @@ static int svfs_fill_super(struct super_block *sb, struct vfsmount *vfsmnt)
 #ifdef SVFS_LOCAL_TEST
     /* FIXME: opening the backing store here? */
     static int backing_store_counter = 0;
-    ssize_t br;
     err = -ENOMEM;
     ssb->backing_store = __getname();
     if (!ssb->backing_store)
@@ -258,21 +381,16 @@ static int svfs_fill_super(struct super_block *sb, struct vfsmount *vfsmnt)
             backing_store_counter++);
     ssb->bs_filp = filp_open(ssb->backing_store, O_RDWR | O_CREAT, 
                              S_IRWXU);
-    if (!ssb->bs_filp)
+    if (IS_ERR(ssb->bs_filp)) {
+        err = PTR_ERR(ssb->bs_filp);
         goto out1;
-    ssb->bse = vmalloc(SVFS_BACKING_STORE_SIZE);
-    if (!ssb->bse)
+    }
+    err = svfs_backing_store_init(ssb);
+    if (err)
         goto out2;
-    memset(ssb->bse, 0, SVFS_BACKING_STORE_SIZE);
-    br = svfs_backing_store_read(ssb);
-    if (br < 0)
-        goto out3;
     /* setting the SVFS_SB_LOCAL_TEST flags */
     ssb->flags |= SVFS_SB_LOCAL_TEST;
-    ssb->bs_size = SVFS_BACKING_STORE_SIZE / 
-        sizeof(struct backing_store_entry);
-    svfs_debug(mdc, "Reading %d bytes %d entries from backing_store %s\n",
-               (int)br, ssb->bs_size, ssb->backing_store);
+    err = -ENOMEM;
 #endif
     /* TODO: should statfs to get the superblock from the stable storage? */
 
@@ -289,6 +407,11 @@ static int svfs_fill_super(struct super_block *sb, struct vfsmount *vfsmnt)
     ssb->mtime = CURRENT_TIME;
     get_random_bytes(&ssb->next_generation, sizeof(u32));
     spin_lock_init(&ssb->next_gen_lock);
+#ifdef SVFS_LOCAL_TEST
+    err = svfs_shards_init(ssb);
+    if (err)
+        goto out3;
+#endif
 
     /* TODO: call iget to get the root inode? */
     err = -ENOMEM;
@@ -323,8 +446,8 @@ static int svfs_fill_super(struct super_block *sb, struct vfsmount *vfsmnt)
 
         unlock_new_inode(inode);
 #ifdef SVFS_LOCAL_TEST
+        /* the loader counts the other entries in use */
         svfs_backing_store_set_root(ssb);
-        atomic_set(&ssb->bs_inuse, svfs_backing_store_scan(ssb));
 #endif        
         svfs_debug(mdc, "root inode state I_NEW, ct=%d, i_flags 0x%x\n", 
                    atomic_read(&inode->i_count), inode->i_flags);
@@ -356,13 +479,21 @@ static int svfs_fill_super(struct super_block *sb, struct vfsmount *vfsmnt)
               list_empty(&sb->s_root->d_u.d_child),
               sb->s_root->d_op, list_empty(&sb->s_root->d_alias),
               sb->s_root->d_mounted);
+#ifdef SVFS_LOCAL_TEST
+    /* the mount works without it, only the flush window grows */
+    err = svfs_flusher_start(ssb);
+    if (err)
+        svfs_warning(mdc, "start the flusher failed, err %d\n", err);
+#endif
+    svfs_migrate_register(sb);
     err = 0;
 out:
     svfs_debug(mdc, "err %d\n", err);
     return err;
 out3:
 #ifdef SVFS_LOCAL_TEST
-    vfree(ssb->bse);
+    svfs_shards_exit(ssb);
+    svfs_backing_store_exit(ssb);
 #endif
 out2:__attribute__((unused))
 #ifdef SVFS_LOCAL_TEST
@@ -464,23 +595,33 @@ void svfs_kill_super(struct super_block *s)
 
     /* NOTE: why should we do atomic_dec? */
     atomic_dec(&s->s_root->d_inode->i_count);
+    /* the queued migrations hold inode references */
+    svfs_migrate_cancel(s);
+#ifdef SVFS_LOCAL_TEST
+    /* it holds inode references */
+    svfs_flusher_stop(ssb);
+    svfs_shards_stop(ssb);
+#endif
     bdi_unregister(&ssb->backing_dev_info);
     kill_anon_super(s);
 #ifdef SVFS_LOCAL_TEST
     {
-        ssize_t bw;
+        int err;
         svfs_backing_store_write_dirty(ssb);
-        bw = svfs_backing_store_write(ssb);
-        if (bw >= 0)
-            svfs_debug(mdc, "Write %d bytes to backing_store %s\n",
-                       (int)bw, ssb->backing_store);
+        svfs_backing_store_reclaim(ssb);
+        err = svfs_journal_checkpoint(ssb);
+        if (!err)
+            svfs_debug(mdc, "Checkpoint backing_store %s\n",
+                       ssb->backing_store);
         else
-            svfs_err(mdc, "Write to backing store failed, err %d\n",
-                      (int)bw);
+            svfs_err(mdc, "Checkpoint backing store failed, err %d\n",
+                      err);
     }
-    __putname(ssb->backing_store);
+    svfs_shards_exit(ssb);
+    svfs_backing_store_exit(ssb);
+    /* the segments pin the page cache of bs_filp until exit */
     fput(ssb->bs_filp);
-    vfree(ssb->bse);
+    __putname(ssb->backing_store);
 #endif
     svfs_free_sb(ssb);
 }
@@ -22,18 +22,48 @@
 
 #include "svfs.h"
 
+/*
+ * The target is copied out of the name heap, as the compaction may move
+ * it before put_link.
+ */
 static void *svfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 {
 #ifdef SVFS_LOCAL_TEST
     struct super_block *sb = dentry->d_inode->i_sb;
-    struct backing_store_entry *bse = SVFS_SB(sb)->bse + 
-        dentry->d_inode->i_ino;
-    nd_set_link(nd, (char *)bse->ref_path);
+    unsigned long ino = dentry->d_inode->i_ino;
+    struct svfs_super_block *bs = svfs_bs_of(SVFS_SB(sb), &ino);
+    struct backing_store_entry snap;
+    char *link;
+
+    link = __getname();
+    if (!link) {
+        nd_set_link(nd, ERR_PTR(-ENOMEM));
+        return NULL;
+    }
+    rcu_read_lock();
+    svfs_bse_read(bs, ino, &snap);
+    snap.link_len = min_t(int, snap.link_len, PATH_MAX - 1);
+    memcpy(link, svfs_bse_link(bs, &snap), snap.link_len);
+    rcu_read_unlock();
+    link[snap.link_len] = '\0';
+    nd_set_link(nd, link);
 #endif
     return NULL;
 }
 
+static void svfs_put_link(struct dentry *dentry, struct nameidata *nd,
+                          void *cookie)
+{
+#ifdef SVFS_LOCAL_TEST
+    char *link = nd_get_link(nd);
+
+    if (!IS_ERR(link))
+        __putname(link);
+#endif
+}
+
 const struct inode_operations svfs_fast_symlink_inode_operations = {
     .readlink = generic_readlink,
     .follow_link = svfs_follow_link,
+    .put_link = svfs_put_link,
 };
@@ -23,16 +23,15 @@
 #include "svfs.h"
 #include "svfs_i.h"
 
-static 
 ssize_t __svfs_backing_store_uread(struct file *filp, void *buf, 
-                                   size_t count)
+                                   size_t count, loff_t *pos)
 {
     ssize_t retval;
     ssize_t br, bl;
 
     bl = count;
     while (bl) {
-        br = vfs_read(filp, buf, bl, &filp->f_pos);
+        br = vfs_read(filp, buf, bl, pos);
         if (br < 0) {
             retval = br;
             goto out;
@@ -49,118 +48,1593 @@ out:
     return retval;
 }
 
+ssize_t __svfs_backing_store_uwrite(struct file *filp, const void *buf, 
+                                    size_t count, loff_t *pos)
+{
+    ssize_t retval;
+    ssize_t bw, bl;
+    const char *p = buf;
+
+    bl = count;
+    while (bl) {
+        bw = vfs_write(filp, p, bl, pos);
+        if (bw < 0) {
+            retval = bw;
+            goto out;
+        }
+        if (bw == 0) {
+            retval = count - bl;
+            goto out;
+        }
+        bl -= bw;
+        p += bw;
+    }
+    retval = count;
+out:
+    return retval;
+}
+
+static
+struct backing_store_node *__svfs_backing_store_alloc_bsn(int seg)
+{
+    struct backing_store_node *bsn;
+    int i;
+
+    bsn = vmalloc(SVFS_BS_SEG_ENTRIES * sizeof(struct backing_store_node));
+    if (!bsn)
+        return NULL;
+    for (i = 0; i < SVFS_BS_SEG_ENTRIES; i++) {
+        bsn[i].ino = seg * SVFS_BS_SEG_ENTRIES + i;
+        bsn[i].hlist.pprev = NULL;
+        spin_lock_init(&bsn[i].lock);
+        seqcount_init(&bsn[i].seq);
+        RB_CLEAR_NODE(&bsn[i].child);
+        bsn[i].children = RB_ROOT;
+        bsn[i].nr_children = 0;
+        bsn[i].flags = 0;
+        INIT_LIST_HEAD(&bsn[i].dirty);
+        INIT_LIST_HEAD(&bsn[i].reclaim);
+    }
+    return bsn;
+}
+
+/*
+ * Check the entries of a segment on its first access. A store without
+ * checksums gets them here, the loader flags the header once all the
+ * segments are done.
+ */
+static
+void __svfs_backing_store_check_seg(struct svfs_super_block *ssb, int seg,
+                                    struct backing_store_entry *bse,
+                                    struct backing_store_node *bsn,
+                                    struct page **pages)
+{
+    int i, bad = 0, sealed = 0;
+
+    for (i = 0; i < SVFS_BS_SEG_ENTRIES; i++) {
+        if (!bse[i].state)
+            continue;
+        if (!(ssb->bs_features & SVFS_BS_FEAT_CSUM)) {
+            svfs_bse_seal(&bse[i]);
+            sealed++;
+        } else if (bse[i].csum != svfs_bse_csum(&bse[i])) {
+            bsn[i].flags |= SVFS_BSN_BAD;
+            bad++;
+        }
+    }
+    if (sealed) {
+        for (i = 0; i < SVFS_BS_SEG_PAGES; i++)
+            set_page_dirty(pages[i]);
+    }
+    if (bad) {
+        atomic_add(bad, &ssb->bs_csum_errs);
+        svfs_err(mdc, "segment %d of %s: %d entries fail the checksum\n",
+                 seg, ssb->backing_store, bad);
+    }
+}
+
+static void __svfs_backing_store_drop(struct backing_store_entry *bse,
+                                      int i, struct page **pages)
+{
+    memset(&bse[i], 0, sizeof(bse[i]));
+    set_page_dirty(pages[((unsigned long)i * sizeof(*bse)) >>
+                         PAGE_CACHE_SHIFT]);
+    set_page_dirty(pages[((unsigned long)(i + 1) * sizeof(*bse) - 1) >>
+                         PAGE_CACHE_SHIFT]);
+}
+
+/*
+ * Read in the heap chunks of the names of a segment being mapped. An
+ * entry is as on disk here, so its names must lie below the heap length
+ * at mount and be whole: one beyond, or over the zeros of a reused
+ * chunk, was written back before its name reached the heap, it is
+ * dropped (a journal record still in the current epoch brings it back
+ * with its name).
+ */
+static
+int __svfs_backing_store_load_names(struct svfs_super_block *ssb, int seg,
+                                    struct backing_store_entry *bse,
+                                    struct backing_store_node *bsn,
+                                    struct page **pages)
+{
+    u32 limit = ssb->bs_heap_disk_len;
+    int i, err;
+
+    for (i = 0; i < SVFS_BS_SEG_ENTRIES; i++) {
+        if (!bse[i].state || (bsn[i].flags & SVFS_BSN_BAD))
+            continue;
+        if ((bse[i].name_len &&
+             bse[i].name_off + bse[i].name_len >= limit) ||
+            (bse[i].link_len &&
+             bse[i].link_off + bse[i].link_len >= limit)) {
+            svfs_warning(mdc, "bse %ld refers beyond the name heap\n",
+                         (unsigned long)seg * SVFS_BS_SEG_ENTRIES + i);
+            __svfs_backing_store_drop(bse, i, pages);
+            continue;
+        }
+        if (bse[i].name_len) {
+            err = svfs_heap_load(ssb, bse[i].name_off);
+            if (err)
+                return err;
+        }
+        if (bse[i].link_len) {
+            err = svfs_heap_load(ssb, bse[i].link_off);
+            if (err)
+                return err;
+        }
+        if (!svfs_heap_check(ssb, bse[i].name_off, bse[i].name_len) ||
+            !svfs_heap_check(ssb, bse[i].link_off, bse[i].link_len)) {
+            svfs_warning(mdc, "bse %ld refers to a name not in the heap\n",
+                         (unsigned long)seg * SVFS_BS_SEG_ENTRIES + i);
+            __svfs_backing_store_drop(bse, i, pages);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Map segment @seg: its pages are read into the page cache of the
+ * backing file, pinned and vmapped, so the entries are edited in place
+ * and the VM writes them back like any other dirty page. A non NULL
+ * bse says the segment is mapped, the state may already be INDEXED for
+ * an empty segment the loader left unmapped.
+ */
+int svfs_backing_store_map(struct svfs_super_block *ssb, int seg)
+{
+    struct backing_store_segment *s = &ssb->bs_segs[seg];
+    struct address_space *mapping = ssb->bs_filp->f_mapping;
+    struct backing_store_node *bsn;
+    struct page **pages;
+    pgoff_t index;
+    void *addr;
+    int i, err = 0;
+
+    mutex_lock(&ssb->bs_map_mutex);
+    if (s->bse)
+        goto out_unlock;
+    err = -EINVAL;
+    if (seg >= ssb->bs_nsegs)
+        goto out_unlock;
+    err = -ENOMEM;
+    pages = kcalloc(SVFS_BS_SEG_PAGES, sizeof(struct page *), GFP_KERNEL);
+    if (!pages)
+        goto out_unlock;
+    bsn = __svfs_backing_store_alloc_bsn(seg);
+    if (!bsn)
+        goto out_free;
+
+    index = (SVFS_BS_HDR_SIZE + (loff_t)seg * SVFS_BS_SEG_SIZE) >> 
+        PAGE_CACHE_SHIFT;
+    page_cache_sync_readahead(mapping, &ssb->bs_filp->f_ra, ssb->bs_filp,
+                              index, SVFS_BS_SEG_PAGES);
+    for (i = 0; i < SVFS_BS_SEG_PAGES; i++) {
+        pages[i] = read_mapping_page(mapping, index + i, ssb->bs_filp);
+        if (IS_ERR(pages[i])) {
+            err = PTR_ERR(pages[i]);
+            pages[i] = NULL;
+            goto out_put;
+        }
+    }
+    err = -ENOMEM;
+    addr = vmap(pages, SVFS_BS_SEG_PAGES, VM_MAP, PAGE_KERNEL);
+    if (!addr)
+        goto out_put;
+    __svfs_backing_store_check_seg(ssb, seg, addr, bsn, pages);
+    err = __svfs_backing_store_load_names(ssb, seg, addr, bsn, pages);
+    if (err)
+        goto out_vunmap;
+
+    s->bsn = bsn;
+    s->pages = pages;
+    /* the mapping must be visible before the pointer and the state */
+    smp_wmb();
+    s->bse = addr;
+    if (s->state == SVFS_SEG_UNMAPPED)
+        s->state = SVFS_SEG_MAPPED;
+    mutex_unlock(&ssb->bs_map_mutex);
+
+    svfs_debug(mdc, "map segment %d of backing store %s\n", seg, 
+               ssb->backing_store);
+    return 0;
+out_vunmap:
+    vunmap(addr);
+out_put:
+    for (i = 0; i < SVFS_BS_SEG_PAGES && pages[i]; i++)
+        page_cache_release(pages[i]);
+    vfree(bsn);
+out_free:
+    kfree(pages);
+out_unlock:
+    mutex_unlock(&ssb->bs_map_mutex);
+    return err;
+}
+
+static
+void __svfs_backing_store_unmap(struct svfs_super_block *ssb, int seg)
+{
+    struct backing_store_segment *s = &ssb->bs_segs[seg];
+    int i;
+
+    if (!s->bse)
+        return;
+    vunmap(s->bse);
+    for (i = 0; i < SVFS_BS_SEG_PAGES; i++)
+        page_cache_release(s->pages[i]);
+    kfree(s->pages);
+    vfree(s->bsn);
+    memset(s, 0, sizeof(*s));
+}
+
+/*
+ * Dirty the page cache pages under the entry, both of them if the entry
+ * straddles a page boundary.
+ */
+void svfs_backing_store_mark_dirty(struct svfs_super_block *ssb,
+                                   unsigned long ino)
+{
+    struct backing_store_segment *s = &ssb->bs_segs[ino / 
+                                                    SVFS_BS_SEG_ENTRIES];
+    unsigned long off;
+
+    off = (ino % SVFS_BS_SEG_ENTRIES) * sizeof(struct backing_store_entry);
+    set_page_dirty(s->pages[off >> PAGE_CACHE_SHIFT]);
+    set_page_dirty(s->pages[(off + sizeof(struct backing_store_entry) - 1)
+                            >> PAGE_CACHE_SHIFT]);
+    if (ssb->sb)
+        ssb->sb->s_dirt = 1;
+}
+
+static
+ssize_t __svfs_backing_store_write_header(struct svfs_super_block *ssb)
+{
+    struct backing_store_header hdr = {
+        .magic = SVFS_BS_MAGIC,
+        .version = SVFS_BS_VERSION,
+        .entry_size = sizeof(struct backing_store_entry),
+        .seg_size = SVFS_BS_SEG_SIZE,
+        .nsegs = ssb->bs_nsegs,
+        .features = ssb->bs_features,
+    };
+    mm_segment_t oldfs = get_fs();
+    loff_t pos = 0;
+    ssize_t bw;
+
+    set_fs(KERNEL_DS);
+    bw = __svfs_backing_store_uwrite(ssb->bs_filp, &hdr, sizeof(hdr), &pos);
+    set_fs(oldfs);
+    return bw;
+}
+
+/*
+ * The VM writes the dirty entries back at its own pace, here we just
+ * force them out. The name heap goes first and the header goes last, so
+ * the header never refers to segments that are not on disk. An entry
+ * written back by the VM before its name is caught by the journal
+ * replay or dropped when the segment is indexed.
+ */
+ssize_t svfs_backing_store_write(struct svfs_super_block *ssb)
+{
+    ssize_t bw;
+    int err;
+    
+    if (!ssb->bs_segs || !ssb->bs_filp)
+        return -EINVAL;
+
+    mutex_lock(&ssb->bs_flush_mutex);
+    err = svfs_heap_flush(ssb);
+    if (err)
+        goto out;
+    err = vfs_fsync(ssb->bs_filp, ssb->bs_filp->f_dentry, 1);
+    if (err)
+        goto out;
+    if (test_and_clear_bit(SVFS_BSF_HDR_DIRTY, &ssb->bs_flags)) {
+        bw = __svfs_backing_store_write_header(ssb);
+        if (bw != sizeof(struct backing_store_header)) {
+            set_bit(SVFS_BSF_HDR_DIRTY, &ssb->bs_flags);
+            err = bw < 0 ? bw : -EIO;
+            goto out;
+        }
+        err = vfs_fsync(ssb->bs_filp, ssb->bs_filp->f_dentry, 1);
+    }
+out:
+    mutex_unlock(&ssb->bs_flush_mutex);
+
+    svfs_debug(mdc, "flush backing store %s: %d\n", ssb->backing_store, 
+               err);
+    return err;
+}
+
+/*
+ * Name index: every VALID entry (except the root) is hashed by
+ * (parent_offset, name), so lookup does not sweep the table. The
+ * buckets have their own locks and lookup takes none, so lookups in
+ * different directories do not contend.
+ */
+static inline
+u32 __svfs_backing_store_hash(unsigned long dir_ino, const char *name)
+{
+    return full_name_hash(name, strlen(name)) ^ hash_long(dir_ino, 32);
+}
+
+static inline
+unsigned long __svfs_backing_store_bidx(struct svfs_super_block *ssb,
+                                        u32 hval)
+{
+    return hash_long(hval, ssb->bs_hbits);
+}
+
+/* the caller should hold the lock of the entry */
+static
+void __svfs_backing_store_hash_insert(struct svfs_super_block *ssb,
+                                      unsigned long ino)
+{
+    struct backing_store_entry *bse = svfs_bse(ssb, ino);
+    struct backing_store_node *bsn = svfs_bsn(ssb, ino);
+    struct backing_store_bucket *b;
+
+    bsn->hval = __svfs_backing_store_hash(bse->parent_offset,
+                                          svfs_bse_name(ssb, bse));
+    b = ssb->bs_htable + __svfs_backing_store_bidx(ssb, bsn->hval);
+    spin_lock(&b->lock);
+    hlist_nulls_add_head_rcu(&bsn->hlist, &b->head);
+    spin_unlock(&b->lock);
+}
+
+/*
+ * The node may be hashed again right away, a reader walking it lands
+ * in another chain and restarts when it sees the wrong nulls value.
+ *
+ * the caller should hold the lock of the entry
+ */
+static
+void __svfs_backing_store_hash_remove(struct svfs_super_block *ssb,
+                                      unsigned long ino)
+{
+    struct backing_store_node *bsn = svfs_bsn(ssb, ino);
+    struct backing_store_bucket *b;
+
+    if (hlist_nulls_unhashed(&bsn->hlist))
+        return;
+    b = ssb->bs_htable + __svfs_backing_store_bidx(ssb, bsn->hval);
+    spin_lock(&b->lock);
+    hlist_nulls_del_init_rcu(&bsn->hlist);
+    spin_unlock(&b->lock);
+}
+
+/*
+ * Child trees: every hashed entry is also linked in the rbtree of its
+ * parent, sorted by ino so readdir can resume from any f_pos. The tree
+ * is protected by the lock of the parent.
+ *
+ * the caller should hold the lock of the entry
+ */
+static
+void __svfs_backing_store_child_insert(struct svfs_super_block *ssb,
+                                       unsigned long ino)
+{
+    struct backing_store_node *bsn = svfs_bsn(ssb, ino);
+    struct backing_store_node *pn;
+    struct rb_node **p, *parent = NULL;
+
+    pn = svfs_bsn(ssb, svfs_bse(ssb, ino)->parent_offset);
+    spin_lock_nested(&pn->lock, SINGLE_DEPTH_NESTING);
+    p = &pn->children.rb_node;
+    while (*p) {
+        parent = *p;
+        if (ino < rb_entry(parent, struct backing_store_node, child)->ino)
+            p = &parent->rb_left;
+        else
+            p = &parent->rb_right;
+    }
+    rb_link_node(&bsn->child, parent, p);
+    rb_insert_color(&bsn->child, &pn->children);
+    pn->nr_children++;
+    spin_unlock(&pn->lock);
+}
+
+/* the caller should hold the lock of the entry */
+static
+void __svfs_backing_store_child_remove(struct svfs_super_block *ssb,
+                                       unsigned long ino)
+{
+    struct backing_store_node *bsn = svfs_bsn(ssb, ino);
+    struct backing_store_node *pn;
+
+    if (RB_EMPTY_NODE(&bsn->child))
+        return;
+    pn = svfs_bsn(ssb, svfs_bse(ssb, ino)->parent_offset);
+    spin_lock_nested(&pn->lock, SINGLE_DEPTH_NESTING);
+    rb_erase(&bsn->child, &pn->children);
+    RB_CLEAR_NODE(&bsn->child);
+    pn->nr_children--;
+    spin_unlock(&pn->lock);
+}
+
+/* the caller should hold the bs_alloc_lock */
+static inline
+void __svfs_backing_store_take_slot(struct svfs_super_block *ssb,
+                                    unsigned long ino)
+{
+    unsigned long w = ino / BITS_PER_LONG;
+
+    __set_bit(ino, ssb->bs_bitmap);
+    if (ssb->bs_bitmap[w] == ~0UL)
+        __set_bit(w, ssb->bs_summary);
+    ssb->bs_segs[ino / SVFS_BS_SEG_ENTRIES].nr_free--;
+}
+
+/*
+ * The caller should hold the bs_alloc_lock. A directory freed gives up
+ * its headroom, the word is seen by the segment allocator again.
+ */
+static inline
+void __svfs_backing_store_put_slot(struct svfs_super_block *ssb,
+                                   unsigned long ino)
+{
+    unsigned long w = ino / BITS_PER_LONG;
+
+    if (__test_and_clear_bit(ino, ssb->bs_bitmap))
+        ssb->bs_segs[ino / SVFS_BS_SEG_ENTRIES].nr_free++;
+    if (!(ino % BITS_PER_LONG))
+        __clear_bit(w, ssb->bs_reserved);
+    if (!test_bit(w, ssb->bs_reserved))
+        __clear_bit(w, ssb->bs_summary);
+}
+
+int svfs_backing_store_build_index(struct svfs_super_block *ssb)
+{
+    unsigned long i;
+
+    /* size the hash table for the largest table we may grow to */
+    ssb->bs_hbits = fls(ssb->bs_max_segs * SVFS_BS_SEG_ENTRIES);
+    ssb->bs_hbits = clamp_t(u32, ssb->bs_hbits, 4, 20);
+    ssb->bs_htable = vmalloc(sizeof(struct backing_store_bucket) << 
+                             ssb->bs_hbits);
+    if (!ssb->bs_htable)
+        return -ENOMEM;
+    for (i = 0; i < (1UL << ssb->bs_hbits); i++) {
+        INIT_HLIST_NULLS_HEAD(&ssb->bs_htable[i].head, i);
+        spin_lock_init(&ssb->bs_htable[i].lock);
+    }
+    return 0;
+}
+
+void svfs_backing_store_free_index(struct svfs_super_block *ssb)
+{
+    vfree(ssb->bs_htable);
+    ssb->bs_htable = NULL;
+}
+
+/*
+ * Is segment @seg all zeroes? Its pages go through the page cache but
+ * are not pinned, the loader does not map the empty segments.
+ */
+static
+int __svfs_backing_store_seg_empty(struct svfs_super_block *ssb, int seg)
+{
+    struct address_space *mapping = ssb->bs_filp->f_mapping;
+    struct page *page;
+    unsigned long *p;
+    pgoff_t index;
+    int i, j, empty = 1;
+
+    index = (SVFS_BS_HDR_SIZE + (loff_t)seg * SVFS_BS_SEG_SIZE) >> 
+        PAGE_CACHE_SHIFT;
+    page_cache_sync_readahead(mapping, &ssb->bs_filp->f_ra, ssb->bs_filp,
+                              index, SVFS_BS_SEG_PAGES);
+    for (i = 0; i < SVFS_BS_SEG_PAGES && empty; i++) {
+        page = read_mapping_page(mapping, index + i, ssb->bs_filp);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+        p = kmap(page);
+        for (j = 0; j < PAGE_CACHE_SIZE / sizeof(long); j++) {
+            if (p[j]) {
+                empty = 0;
+                break;
+            }
+        }
+        kunmap(page);
+        page_cache_release(page);
+    }
+    return empty;
+}
+
+/*
+ * Hand all the slots of the empty segment @seg to the allocator and
+ * leave it unmapped, its first allocation maps it (svfs_bse_get). Fails
+ * if somebody mapped it in the meantime.
+ */
+static
+int __svfs_backing_store_index_empty(struct svfs_super_block *ssb, int seg)
+{
+    unsigned long i;
+
+    mutex_lock(&ssb->bs_map_mutex);
+    if (ssb->bs_segs[seg].bse) {
+        mutex_unlock(&ssb->bs_map_mutex);
+        return -EAGAIN;
+    }
+    spin_lock(&ssb->bs_alloc_lock);
+    for (i = seg * SVFS_BS_SEG_ENTRIES; 
+         i < (seg + 1) * SVFS_BS_SEG_ENTRIES; i++) {
+        if (i != SVFS_ROOT_INODE)
+            __svfs_backing_store_put_slot(ssb, i);
+    }
+    spin_unlock(&ssb->bs_alloc_lock);
+    ssb->bs_segs[seg].state = SVFS_SEG_INDEXED;
+    mutex_unlock(&ssb->bs_map_mutex);
+
+    svfs_debug(mdc, "index segment %d: empty, left unmapped\n", seg);
+    return 0;
+}
+
+/*
+ * Hash the entries of segment @seg, link them to their parents and hand
+ * its free slots to the allocator. The segments of the parents are
+ * mapped first, as their nodes are locked in child_insert. An entry
+ * already hashed (an inode reached by handle before the loader) is
+ * left alone.
+ */
+static
+int __svfs_backing_store_index(struct svfs_super_block *ssb, int seg)
+{
+    struct backing_store_entry *bse;
+    struct backing_store_node *bsn;
+    unsigned long i, start, end;
+    int nr = 0, used = 0, err;
+
+    if (!ACCESS_ONCE(ssb->bs_segs[seg].bse)) {
+        err = __svfs_backing_store_seg_empty(ssb, seg);
+        if (err < 0)
+            return err;
+        if (err && !__svfs_backing_store_index_empty(ssb, seg))
+            return 0;
+    }
+    err = svfs_backing_store_map(ssb, seg);
+    if (err)
+        return err;
+    start = seg * SVFS_BS_SEG_ENTRIES;
+    end = start + SVFS_BS_SEG_ENTRIES;
+    for (i = start; i < end; i++) {
+        bse = svfs_bse(ssb, i);
+        if (!(bse->state & SVFS_BS_VALID) || 
+            bse->parent_offset >= ssb->bs_size)
+            continue;
+        bse = svfs_bse_get(ssb, bse->parent_offset);
+        if (IS_ERR(bse))
+            return PTR_ERR(bse);
+    }
+
+    for (i = start; i < end; i++) {
+        if (i == SVFS_ROOT_INODE)
+            continue;
+        bse = svfs_bse(ssb, i);
+        bsn = svfs_bsn(ssb, i);
+        spin_lock(&bsn->lock);
+        if (bsn->flags & SVFS_BSN_BAD) {
+            /* keep the slot, but out of the namespace */
+            spin_unlock(&bsn->lock);
+            used++;
+            continue;
+        }
+        /* the names were checked against the heap when it was mapped */
+        if (bse->state)
+            used++;
+        /* deleted before the last umount, the reclaimer frees it */
+        if (bse->state & SVFS_BS_DELETING) {
+            spin_lock(&ssb->bs_reclaim_lock);
+            if (list_empty(&bsn->reclaim))
+                list_add_tail(&bsn->reclaim, &ssb->bs_reclaim_list);
+            spin_unlock(&ssb->bs_reclaim_lock);
+        }
+        if ((bse->state & SVFS_BS_VALID) &&
+            !(bse->state & SVFS_BS_DELETING) &&
+            bse->parent_offset < ssb->bs_size &&
+            hlist_nulls_unhashed(&bsn->hlist)) {
+            __svfs_backing_store_hash_insert(ssb, i);
+            __svfs_backing_store_child_insert(ssb, i);
+            nr++;
+        }
+        spin_unlock(&bsn->lock);
+    }
+
+    spin_lock(&ssb->bs_alloc_lock);
+    for (i = start; i < end; i++) {
+        if (i == SVFS_ROOT_INODE || svfs_bse(ssb, i)->state)
+            continue;
+        __svfs_backing_store_put_slot(ssb, i);
+    }
+    spin_unlock(&ssb->bs_alloc_lock);
+    atomic_add(used, &ssb->bs_inuse);
+    ssb->bs_segs[seg].state = SVFS_SEG_INDEXED;
+    if (!list_empty(&ssb->bs_reclaim_list))
+        schedule_delayed_work(&ssb->bs_reclaim_work, 
+                              SVFS_BS_RECLAIM_DELAY);
+
+    svfs_debug(mdc, "index segment %d: %d entries, %d in use\n",
+               seg, nr, used);
+    return 0;
+}
+
+/*
+ * The mount only maps what it touches, the loader indexes the segments
+ * in the background. Lookup misses, readdir and the allocator wait for
+ * it, as they need the whole index.
+ */
+/* index the segments handed out by bs_scan_next until none is left */
+static
+void __svfs_backing_store_scan(struct svfs_super_block *ssb)
+{
+    int seg, err;
+
+    while (!ACCESS_ONCE(ssb->bs_scan_stop)) {
+        seg = atomic_inc_return(&ssb->bs_scan_next) - 1;
+        if (seg >= ssb->bs_nsegs)
+            break;
+        if (ssb->bs_segs[seg].state == SVFS_SEG_INDEXED)
+            continue;
+        err = __svfs_backing_store_index(ssb, seg);
+        if (err) {
+            svfs_err(mdc, "index segment %d of %s failed %d\n",
+                     seg, ssb->backing_store, err);
+            ssb->bs_scan_err = err;
+            ssb->bs_scan_stop = 1;
+        }
+    }
+    if (atomic_dec_and_test(&ssb->bs_scanners))
+        complete(&ssb->bs_scan_done);
+}
+
+static int svfs_backing_store_scanner(void *data)
+{
+    __svfs_backing_store_scan(data);
+    return 0;
+}
+
+/*
+ * The loader indexes the table with up to one scanner per CPU, each
+ * taking the next unindexed segment. The segments are independent: the
+ * hash buckets and the parent entries have their own locks, the in-use
+ * counts are added up atomically and the free slots are merged into the
+ * bitmap under bs_alloc_lock.
+ */
+static int svfs_backing_store_loader(void *data)
+{
+    struct svfs_super_block *ssb = data;
+    struct task_struct *task;
+    unsigned long start = jiffies;
+    int i, nr;
+
+    nr = min_t(int, num_online_cpus(), SVFS_BS_MAX_SCANNERS);
+    nr = min(nr, ssb->bs_nsegs);
+    atomic_set(&ssb->bs_scan_next, 0);
+    atomic_set(&ssb->bs_scanners, 1);
+    init_completion(&ssb->bs_scan_done);
+    for (i = 1; i < nr; i++) {
+        atomic_inc(&ssb->bs_scanners);
+        task = kthread_run(svfs_backing_store_scanner, ssb, 
+                           "svfs_bsscan/%d", i);
+        if (IS_ERR(task)) {
+            atomic_dec(&ssb->bs_scanners);
+            break;
+        }
+    }
+    ssb->bs_nr_scanners = i;
+    __svfs_backing_store_scan(ssb);
+    wait_for_completion(&ssb->bs_scan_done);
+
+    if (!ssb->bs_scan_err && !ssb->bs_scan_stop &&
+        !(ssb->bs_features & SVFS_BS_FEAT_CSUM)) {
+        /* all the entries are sealed now */
+        ssb->bs_features |= SVFS_BS_FEAT_CSUM;
+        set_bit(SVFS_BSF_HDR_DIRTY, &ssb->bs_flags);
+        svfs_info(mdc, "backing store %s has entry checksums now\n",
+                  ssb->backing_store);
+    }
+    /* do not block the waiters forever, even if the index is partial */
+    ssb->bs_index_ms = jiffies_to_msecs(jiffies - start);
+    ssb->bs_loaded = 1;
+    wake_up_all(&ssb->bs_load_wait);
+    svfs_info(mdc, "index %d segments of %s with %d scanners in %u ms "
+              "(mount %u ms)\n", ssb->bs_nsegs, ssb->backing_store, 
+              ssb->bs_nr_scanners, ssb->bs_index_ms, ssb->bs_mount_ms);
+
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+    return ssb->bs_scan_err;
+}
+
+void svfs_backing_store_wait_loaded(struct svfs_super_block *ssb)
+{
+    wait_event(ssb->bs_load_wait, ACCESS_ONCE(ssb->bs_loaded));
+}
+
+static
+unsigned long __svfs_backing_store_lookup(struct svfs_super_block *ssb,
+                                          unsigned long dir_ino,
+                                          const char *name, int wait)
+{
+    struct backing_store_node *bsn;
+    struct backing_store_entry bse;
+    struct hlist_nulls_node *pos;
+    unsigned long bidx, ino;
+    int len = strlen(name);
+    u32 hval;
+
+    ssb = svfs_bs_dir(ssb, &dir_ino);
+    if (!ssb)
+        return -1UL;
+    hval = __svfs_backing_store_hash(dir_ino, name);
+    bidx = __svfs_backing_store_bidx(ssb, hval);
+retry:
+    ino = -1UL;
+    rcu_read_lock();
+begin:
+    hlist_nulls_for_each_entry_rcu(bsn, pos, &ssb->bs_htable[bidx].head,
+                                   hlist) {
+        if (bsn->hval != hval)
+            continue;
+        /* the name stays put until rcu_read_unlock, see heap.c */
+        svfs_bse_read(ssb, bsn->ino, &bse);
+        if (bse.parent_offset == dir_ino && bse.name_len == len &&
+            !memcmp(svfs_bse_name(ssb, &bse), name, len)) {
+            ino = bsn->ino;
+            break;
+        }
+    }
+    /* we followed a node moved to another chain */
+    if (ino == -1UL && get_nulls_value(pos) != bidx)
+        goto begin;
+    rcu_read_unlock();
+    /* a miss is only final once every segment is indexed */
+    if (ino == -1UL && wait && !ACCESS_ONCE(ssb->bs_loaded)) {
+        svfs_backing_store_wait_loaded(ssb);
+        goto retry;
+    }
+    
+    return ino == -1UL ? ino : svfs_bs_ino(ssb, ino);
+}
+
+unsigned long svfs_backing_store_lookup(struct svfs_super_block *ssb,
+                                        unsigned long dir_ino, 
+                                        const char *name)
+{
+    return __svfs_backing_store_lookup(ssb, dir_ino, name, 1);
+}
+
+/* a miss is not final until the store is loaded */
+unsigned long svfs_backing_store_lookup_nowait(struct svfs_super_block *ssb,
+                                               unsigned long dir_ino,
+                                               const char *name)
+{
+    return __svfs_backing_store_lookup(ssb, dir_ino, name, 0);
+}
+
+unsigned long svfs_backing_store_lookup_parent(struct svfs_super_block *ssb, 
+                                               unsigned long child_ino)
+{
+    struct svfs_super_block *bs;
+    struct backing_store_entry *bse;
+    unsigned long parent;
+
+    if (child_ino == SVFS_ROOT_INODE)
+        return SVFS_ROOT_INODE;
+    bs = svfs_bs_of(ssb, &child_ino);
+    if (!bs || child_ino >= bs->bs_size)
+        return -1UL;
+    bse = svfs_bse_get(bs, child_ino);
+    if (IS_ERR(bse))
+        return -1UL;
+    parent = ACCESS_ONCE(bse->parent_offset);
+    /* the root of a shard hangs on its stub in the root table */
+    if (bs != ssb && parent == SVFS_ROOT_INODE)
+        return svfs_shard_stub(ssb, bs);
+    return svfs_bs_ino(bs, parent);
+}
+
+/*
+ * Free slot allocator: bit N of bs_bitmap is set iff entry N is in use
+ * (or is the root), bit W of bs_summary is set iff bitmap word W is full
+ * or is the headroom of a directory, bit W of bs_reserved. The maps
+ * cover bs_max_segs segments and start full, the free slots of a
+ * segment show up when it is indexed or grown. The headroom is not on
+ * disk, it is given to the directories created since the mount.
+ */
+int svfs_backing_store_build_bitmap(struct svfs_super_block *ssb)
+{
+    unsigned long max = ssb->bs_max_segs * SVFS_BS_SEG_ENTRIES;
+    unsigned long nwords = BITS_TO_LONGS(max);
+
+    ssb->bs_bitmap = vmalloc(nwords * sizeof(unsigned long));
+    if (!ssb->bs_bitmap)
+        return -ENOMEM;
+    ssb->bs_summary = vmalloc(BITS_TO_LONGS(nwords) * 
+                              sizeof(unsigned long));
+    if (!ssb->bs_summary)
+        goto out_free;
+    ssb->bs_reserved = vmalloc(BITS_TO_LONGS(nwords) *
+                               sizeof(unsigned long));
+    if (!ssb->bs_reserved)
+        goto out_free;
+    memset(ssb->bs_bitmap, 0xff, nwords * sizeof(unsigned long));
+    memset(ssb->bs_summary, 0xff, BITS_TO_LONGS(nwords) * 
+           sizeof(unsigned long));
+    memset(ssb->bs_reserved, 0, BITS_TO_LONGS(nwords) *
+           sizeof(unsigned long));
+    spin_lock_init(&ssb->bs_alloc_lock);
+    ssb->bs_cursor = 0;
+    return 0;
+
+out_free:
+    svfs_backing_store_free_bitmap(ssb);
+    return -ENOMEM;
+}
+
+void svfs_backing_store_free_bitmap(struct svfs_super_block *ssb)
+{
+    vfree(ssb->bs_bitmap);
+    vfree(ssb->bs_summary);
+    vfree(ssb->bs_reserved);
+    ssb->bs_bitmap = NULL;
+    ssb->bs_summary = NULL;
+    ssb->bs_reserved = NULL;
+}
+
+/*
+ * Take the first free slot in the bitmap words [@lo, @hi), searching
+ * from word @w and wrapping around. The caller should hold the
+ * bs_alloc_lock.
+ */
+static
+unsigned long __svfs_backing_store_alloc_slot(struct svfs_super_block *ssb,
+                                              unsigned long lo,
+                                              unsigned long hi,
+                                              unsigned long w)
+{
+    unsigned long ino;
+
+    w = find_next_zero_bit(ssb->bs_summary, hi, w);
+    if (w >= hi)
+        w = find_next_zero_bit(ssb->bs_summary, hi, lo);
+    if (w >= hi)
+        return -1UL;
+
+    ino = w * BITS_PER_LONG + ffz(ssb->bs_bitmap[w]);
+    if (ino >= ssb->bs_size)
+        return -1UL;
+    __svfs_backing_store_take_slot(ssb, ino);
+    return ino;
+}
+
+/*
+ * Pick the segment for a new entry under the directory @dir, like the
+ * Orlov allocator of ext3/4: the entries go to the segment of their
+ * parent, so readdir and the page flush touch few pages. A directory
+ * stays with its parent only if the segment has SVFS_BS_DIR_HEADROOM
+ * free slots left for its own children, and the top level directories
+ * are spread to the emptiest segment. The free counts are read without
+ * the lock, it is only a hint. Returns -1 if no indexed segment has
+ * room.
+ */
+static
+int __svfs_backing_store_pick_seg(struct svfs_super_block *ssb,
+                                  unsigned long dir, int is_dir)
+{
+    int nsegs = ACCESS_ONCE(ssb->bs_nsegs);
+    int seg, i, best = -1, best_free = 0, want, nr_free;
+
+    seg = dir / SVFS_BS_SEG_ENTRIES;
+    if (seg >= nsegs)
+        seg = 0;
+    want = is_dir ? SVFS_BS_DIR_HEADROOM : 1;
+
+    if (is_dir && dir == SVFS_ROOT_INODE) {
+        for (i = 0; i < nsegs; i++) {
+            if (ssb->bs_segs[i].state != SVFS_SEG_INDEXED)
+                continue;
+            nr_free = ACCESS_ONCE(ssb->bs_segs[i].nr_free);
+            if (nr_free > best_free) {
+                best = i;
+                best_free = nr_free;
+            }
+        }
+        return best_free >= want ? best : -1;
+    }
+
+    for (i = 0; i < nsegs; i++, seg = (seg + 1) % nsegs) {
+        if (ssb->bs_segs[seg].state == SVFS_SEG_INDEXED &&
+            ACCESS_ONCE(ssb->bs_segs[seg].nr_free) >= want)
+            return seg;
+    }
+    return -1;
+}
+
+/* is @dir a directory with a headroom left? bs_alloc_lock is held */
+static inline
+int __svfs_backing_store_has_room(struct svfs_super_block *ssb,
+                                  unsigned long dir)
+{
+    unsigned long w = dir / BITS_PER_LONG;
+
+    return !(dir % BITS_PER_LONG) && test_bit(w, ssb->bs_reserved) &&
+        ssb->bs_bitmap[w] != ~0UL;
+}
+
+/*
+ * Reserve up to SVFS_POOL_SLOTS slots of segment @seg for one CPU,
+ * starting after @dir when it lives there; any segment if @seg is -1.
+ * The batch shrinks as the table fills up, so the pools can not starve
+ * the other CPUs. The headroom of other directories is passed over, a
+ * batch for @headroom comes from the headroom of @dir only.
+ */
+static
+int __svfs_backing_store_alloc_batch(struct svfs_super_block *ssb,
+                                     int seg, unsigned long dir,
+                                     int headroom, u32 *slot)
+{
+    unsigned long ino, lo, hi, w;
+    int free, batch, nr = 0;
+
+    free = ssb->bs_size - atomic_read(&ssb->bs_inuse);
+    batch = free / (4 * SVFS_POOL_SEGS * num_online_cpus());
+    batch = clamp_t(int, batch, 1, SVFS_POOL_SLOTS);
+
+    spin_lock(&ssb->bs_alloc_lock);
+    if (headroom) {
+        w = dir / BITS_PER_LONG;
+        while (nr < batch && __svfs_backing_store_has_room(ssb, dir)) {
+            ino = w * BITS_PER_LONG + ffz(ssb->bs_bitmap[w]);
+            __svfs_backing_store_take_slot(ssb, ino);
+            slot[nr++] = ino;
+        }
+        spin_unlock(&ssb->bs_alloc_lock);
+        return nr;
+    }
+    if (seg < 0) {
+        lo = 0;
+        hi = BITS_TO_LONGS(ssb->bs_size);
+        w = ssb->bs_cursor;
+    } else {
+        lo = seg * SVFS_BS_SEG_ENTRIES / BITS_PER_LONG;
+        hi = BITS_TO_LONGS((seg + 1) * SVFS_BS_SEG_ENTRIES);
+        w = dir / BITS_PER_LONG;
+        if (w < lo || w >= hi)
+            w = lo;
+    }
+    while (nr < batch) {
+        ino = __svfs_backing_store_alloc_slot(ssb, lo, hi, w);
+        if (ino == -1UL)
+            break;
+        slot[nr++] = ino;
+        w = ino / BITS_PER_LONG;
+    }
+    if (seg < 0)
+        ssb->bs_cursor = w;
+    spin_unlock(&ssb->bs_alloc_lock);
+    return nr;
+}
+
+/*
+ * A new directory takes the first slot of an empty bitmap word, the
+ * rest of the word is the headroom for its children: the summary bit
+ * keeps the segment allocator out of it until the directory is freed.
+ */
+static
+unsigned long __svfs_backing_store_alloc_dir(struct svfs_super_block *ssb,
+                                             int seg, unsigned long dir)
+{
+    unsigned long lo, hi, w, i, ino = -1UL;
+
+    lo = DIV_ROUND_UP(seg * SVFS_BS_SEG_ENTRIES, BITS_PER_LONG);
+    hi = (seg + 1) * SVFS_BS_SEG_ENTRIES / BITS_PER_LONG;
+    w = dir / BITS_PER_LONG;
+    if (w < lo || w >= hi)
+        w = lo;
+
+    spin_lock(&ssb->bs_alloc_lock);
+    for (i = 0; i < hi - lo; i++, w = (w + 1 < hi) ? w + 1 : lo) {
+        if (ssb->bs_bitmap[w])
+            continue;
+        ino = w * BITS_PER_LONG;
+        __svfs_backing_store_take_slot(ssb, ino);
+        __set_bit(w, ssb->bs_reserved);
+        __set_bit(w, ssb->bs_summary);
+        break;
+    }
+    spin_unlock(&ssb->bs_alloc_lock);
+    return ino;
+}
+
+/*
+ * The table is full and can not grow: the headroom of the directories
+ * is given up, a slot is taken from the first one with room.
+ */
+static
+unsigned long __svfs_backing_store_take_headroom(struct svfs_super_block *ssb)
+{
+    unsigned long nwords = BITS_TO_LONGS(ACCESS_ONCE(ssb->bs_size));
+    unsigned long w, ino = -1UL;
+
+    spin_lock(&ssb->bs_alloc_lock);
+    for (w = find_first_bit(ssb->bs_reserved, nwords); w < nwords;
+         w = find_next_bit(ssb->bs_reserved, nwords, w + 1)) {
+        if (ssb->bs_bitmap[w] == ~0UL)
+            continue;
+        ino = w * BITS_PER_LONG + ffz(ssb->bs_bitmap[w]);
+        __svfs_backing_store_take_slot(ssb, ino);
+        break;
+    }
+    spin_unlock(&ssb->bs_alloc_lock);
+    return ino;
+}
+
+/* the table is full, take a reserved slot from another CPU */
 static
-ssize_t __svfs_backing_store_uwrite(struct file *filp, const void *buf, 
-                                    size_t count)
+unsigned long __svfs_backing_store_steal_slot(struct svfs_super_block *ssb)
 {
-    ssize_t retval;
-    ssize_t bw, bl;
-    const char *p = buf;
+    struct svfs_cpu_pool *pool;
+    struct svfs_slot_cache *sc;
+    unsigned long ino = -1UL;
+    int cpu, i;
 
-    bl = count;
-    while (bl) {
-        bw = vfs_write(filp, p, bl, &filp->f_pos);
-        if (bw < 0) {
-            retval = bw;
-            goto out;
+    for_each_possible_cpu(cpu) {
+        pool = per_cpu_ptr(ssb->cpu_pools, cpu);
+        spin_lock(&pool->lock);
+        for (i = 0; i < SVFS_POOL_SEGS && ino == -1UL; i++) {
+            sc = &pool->cache[i];
+            if (sc->pos < sc->nr)
+                ino = sc->slot[sc->pos++];
         }
-        if (bw == 0) {
-            retval = count - bl;
+        spin_unlock(&pool->lock);
+        if (ino != -1UL)
+            break;
+    }
+    return ino;
+}
+
+static
+void __svfs_backing_store_free_slot(struct svfs_super_block *ssb,
+                                    unsigned long ino)
+{
+    if (unlikely(ino == SVFS_ROOT_INODE || ino >= ssb->bs_size))
+        return;
+    /* the loader frees it when the segment is indexed */
+    if (ssb->bs_segs[ino / SVFS_BS_SEG_ENTRIES].state != SVFS_SEG_INDEXED)
+        return;
+    spin_lock(&ssb->bs_alloc_lock);
+    __svfs_backing_store_put_slot(ssb, ino);
+    spin_unlock(&ssb->bs_alloc_lock);
+}
+
+/* return a batch of slots under one lock */
+static
+void __svfs_backing_store_free_slots(struct svfs_super_block *ssb,
+                                     u32 *slot, int nr)
+{
+    int i;
+
+    spin_lock(&ssb->bs_alloc_lock);
+    for (i = 0; i < nr; i++) {
+        if (ssb->bs_segs[slot[i] / SVFS_BS_SEG_ENTRIES].state != 
+            SVFS_SEG_INDEXED)
+            continue;
+        __svfs_backing_store_put_slot(ssb, slot[i]);
+    }
+    spin_unlock(&ssb->bs_alloc_lock);
+}
+
+/*
+ * Append one segment to the table and to the backing file. @size is the
+ * bs_size the caller saw full, if someone else has grown the table in the
+ * meantime we just return.
+ */
+int svfs_backing_store_grow(struct svfs_super_block *ssb, int size)
+{
+    unsigned long i;
+    int seg, err = 0;
+
+    mutex_lock(&ssb->bs_grow_mutex);
+    if (ssb->bs_size != size)
+        goto out_unlock;
+    seg = ssb->bs_nsegs;
+    err = svfs_backing_store_extend(ssb, seg + 1);
+    if (err)
+        goto out_unlock;
+    err = svfs_backing_store_map(ssb, seg);
+    if (err)
+        goto out_unlock;
+
+    /* a new segment is empty, nothing to index */
+    spin_lock(&ssb->bs_alloc_lock);
+    for (i = seg * SVFS_BS_SEG_ENTRIES; 
+         i < (seg + 1) * SVFS_BS_SEG_ENTRIES; i++)
+        __svfs_backing_store_put_slot(ssb, i);
+    spin_unlock(&ssb->bs_alloc_lock);
+    ssb->bs_segs[seg].state = SVFS_SEG_INDEXED;
+    mutex_unlock(&ssb->bs_grow_mutex);
+
+    svfs_debug(mdc, "grow backing store %s to %d segments, %d entries\n",
+               ssb->backing_store, seg + 1, ssb->bs_size);
+    return 0;
+out_unlock:
+    mutex_unlock(&ssb->bs_grow_mutex);
+    return err;
+}
+
+/*
+ * The slot cache of segment @seg, or of the headroom of @dir if not 0,
+ * in a CPU pool. A miss takes an empty cache or hands back the least
+ * recently used one, so a CPU creating in the directories of a few
+ * segments keeps all their reservations.
+ */
+static
+struct svfs_slot_cache *__svfs_backing_store_pool_cache(
+    struct svfs_super_block *ssb, struct svfs_cpu_pool *pool, int seg,
+    unsigned long dir)
+{
+    struct svfs_slot_cache *sc, *victim = NULL;
+    int i;
+
+    for (i = 0; i < SVFS_POOL_SEGS; i++) {
+        sc = &pool->cache[i];
+        if (sc->seg == seg && sc->dir == dir)
             goto out;
-        }
-        bl -= bw;
-        p += bw;
+        if (!victim || (victim->pos < victim->nr &&
+                        (sc->pos == sc->nr ||
+                         (s32)(sc->used - victim->used) < 0)))
+            victim = sc;
     }
-    retval = count;
+    sc = victim;
+    if (sc->pos < sc->nr)
+        __svfs_backing_store_free_slots(ssb, sc->slot + sc->pos,
+                                        sc->nr - sc->pos);
+    sc->seg = seg;
+    sc->dir = dir;
+    sc->pos = sc->nr = 0;
 out:
-    return retval;
+    sc->used = ++pool->tick;
+    return sc;
 }
 
-ssize_t svfs_backing_store_read(struct svfs_super_block *ssb)
+/*
+ * Allocate a slot for a new entry under the directory @dir. The per-CPU
+ * pool caches the slots of a few segments and headrooms, the entry takes
+ * one of the headroom of @dir while it lasts, then one of the segment
+ * pick_seg chose for it.
+ */
+unsigned long svfs_backing_store_find_mark_ino(struct svfs_super_block *ssb,
+                                               unsigned long dir, int is_dir)
 {
-    ssize_t retval;
-    mm_segment_t oldfs = get_fs();
-    
-    if (!ssb->bse || !ssb->bs_filp)
-        return -EINVAL;
+    struct backing_store_entry *bse;
+    struct svfs_cpu_pool *pool;
+    struct svfs_slot_cache *sc;
+    unsigned long ino;
+    int size, seg;
+
+    ssb = svfs_bs_dir(ssb, &dir);
+    if (!ssb)
+        return -1UL;
+retry:
+    ino = -1UL;
+    size = ACCESS_ONCE(ssb->bs_size);
+    seg = __svfs_backing_store_pick_seg(ssb, dir, is_dir);
+    if (is_dir && seg >= 0)
+        ino = __svfs_backing_store_alloc_dir(ssb, seg, dir);
+
+    pool = per_cpu_ptr(ssb->cpu_pools, get_cpu());
+    spin_lock(&pool->lock);
+    if (ino != -1UL)
+        goto got;
+    /* the bit is a hint, alloc_batch checks it under the lock */
+    if (!(dir % BITS_PER_LONG) &&
+        test_bit(dir / BITS_PER_LONG, ssb->bs_reserved)) {
+        sc = __svfs_backing_store_pool_cache(ssb, pool,
+                                             dir / SVFS_BS_SEG_ENTRIES, dir);
+        if (sc->pos == sc->nr) {
+            sc->nr = __svfs_backing_store_alloc_batch(ssb, -1, dir, 1,
+                                                      sc->slot);
+            sc->pos = 0;
+        }
+        if (sc->pos < sc->nr) {
+            ino = sc->slot[sc->pos++];
+            goto got;
+        }
+    }
+    sc = __svfs_backing_store_pool_cache(ssb, pool, seg, 0);
+    if (sc->pos == sc->nr) {
+        sc->nr = __svfs_backing_store_alloc_batch(ssb, seg, dir, 0,
+                                                  sc->slot);
+        sc->pos = 0;
+        if (!sc->nr && seg >= 0) {
+            /* lost the race for the last slots of the segment */
+            sc = __svfs_backing_store_pool_cache(ssb, pool, -1, 0);
+            if (sc->pos == sc->nr) {
+                sc->nr = __svfs_backing_store_alloc_batch(ssb, -1, dir, 0,
+                                                          sc->slot);
+                sc->pos = 0;
+            }
+        }
+    }
+    if (sc->pos < sc->nr)
+        ino = sc->slot[sc->pos++];
+got:
+    spin_unlock(&pool->lock);
+    put_cpu();
+
+    if (unlikely(ino == -1UL)) {
+        /* the free slots of the unindexed segments are not known yet */
+        if (!ACCESS_ONCE(ssb->bs_loaded)) {
+            svfs_backing_store_wait_loaded(ssb);
+            goto retry;
+        }
+        if (!svfs_backing_store_grow(ssb, size))
+            goto retry;
+        ino = __svfs_backing_store_steal_slot(ssb);
+        if (ino == -1UL)
+            ino = __svfs_backing_store_take_headroom(ssb);
+    }
+    if (likely(ino != -1UL)) {
+        /* the first allocation maps an empty segment */
+        bse = svfs_bse_get(ssb, ino);
+        if (IS_ERR(bse)) {
+            __svfs_backing_store_free_slot(ssb, ino);
+            return -1UL;
+        }
+        svfs_bse_write_begin(ssb, ino);
+        bse->state = SVFS_BS_NEW;
+        svfs_bse_write_end(ssb, ino);
+        svfs_backing_store_mark_dirty(ssb, ino);
+        atomic_inc(&ssb->bs_inuse);
+    }
+    svfs_debug(mdc, "find new bse %ld in dir %ld\n", ino, dir);
+    return ino == -1UL ? ino : svfs_bs_ino(ssb, ino);
+}
 
-    ssb->bs_filp->f_pos = 0;
+/*
+ * Append zeroed segments to the backing file up to @nsegs. They are
+ * written through the page cache, so the file never has holes under
+ * the mapped pages; the header is rewritten on the next flush.
+ */
+int svfs_backing_store_extend(struct svfs_super_block *ssb, int nsegs)
+{
+    mm_segment_t oldfs;
+    loff_t pos, end;
+    ssize_t bw;
+    void *zero;
+    int err = 0;
+
+    if (nsegs > ssb->bs_max_segs)
+        return -ENOSPC;
+    if (nsegs <= ssb->bs_nsegs)
+        return 0;
+    zero = (void *)get_zeroed_page(GFP_KERNEL);
+    if (!zero)
+        return -ENOMEM;
+    pos = SVFS_BS_HDR_SIZE + (loff_t)ssb->bs_nsegs * SVFS_BS_SEG_SIZE;
+    end = SVFS_BS_HDR_SIZE + (loff_t)nsegs * SVFS_BS_SEG_SIZE;
+    oldfs = get_fs();
     set_fs(KERNEL_DS);
-    retval = __svfs_backing_store_uread(ssb->bs_filp, ssb->bse, 
-                                        SVFS_BACKING_STORE_SIZE);
+    while (pos < end) {
+        bw = __svfs_backing_store_uwrite(ssb->bs_filp, zero, 
+                                         PAGE_CACHE_SIZE, &pos);
+        if (bw != PAGE_CACHE_SIZE) {
+            err = bw < 0 ? bw : -EIO;
+            break;
+        }
+    }
     set_fs(oldfs);
+    free_page((unsigned long)zero);
+    if (err)
+        return err;
 
-    return retval;
+    ssb->bs_size += (nsegs - ssb->bs_nsegs) * SVFS_BS_SEG_ENTRIES;
+    ssb->bs_nsegs = nsegs;
+    set_bit(SVFS_BSF_HDR_DIRTY, &ssb->bs_flags);
+    return 0;
 }
 
-ssize_t svfs_backing_store_write(struct svfs_super_block *ssb)
+/*
+ * Convert a version 1 file (no header, names embedded in the entries).
+ * The old table is read in whole as the new layout overwrites it, this
+ * is done once. The checkpoint at the end of the mount writes the
+ * header, which marks the file as converted.
+ */
+static
+int __svfs_backing_store_convert(struct svfs_super_block *ssb, 
+                                 int v1_segs, int nsegs)
 {
-    ssize_t retval;
+    struct backing_store_entry_v1 *old, *v1;
+    struct backing_store_entry *bse;
+    unsigned long ino, nr_v1;
     mm_segment_t oldfs = get_fs();
-    
-    if (!ssb->bse || !ssb->bs_filp)
-        return -EINVAL;
+    loff_t pos = 0;
+    ssize_t br;
+    int len, nr = 0, err = 0;
 
-    /* seek to head */
-    ssb->bs_filp->f_pos = 0;
+    nr_v1 = (unsigned long)v1_segs * SVFS_BS_SEG_SIZE / 
+        sizeof(struct backing_store_entry_v1);
+    old = vmalloc(nr_v1 * sizeof(*old));
+    if (!old)
+        return -ENOMEM;
+    memset(old, 0, nr_v1 * sizeof(*old));
     set_fs(KERNEL_DS);
-    retval = __svfs_backing_store_uwrite(ssb->bs_filp, ssb->bse,
-                                         SVFS_BACKING_STORE_SIZE);
+    br = __svfs_backing_store_uread(ssb->bs_filp, old, 
+                                    nr_v1 * sizeof(*old), &pos);
     set_fs(oldfs);
+    if (br < 0) {
+        err = br;
+        goto out;
+    }
+    for (ino = 0; ino < nr_v1; ino++) {
+        if (old[ino].state)
+            nsegs = max_t(int, nsegs, ino / SVFS_BS_SEG_ENTRIES + 1);
+    }
+    err = svfs_backing_store_extend(ssb, nsegs);
+    if (err)
+        goto out;
 
-#if 1
-    {
-        /* Checking */
-        int i;
-        struct backing_store_entry *bse = ssb->bse;
-        for (i = 0; i < ssb->bs_size; i++, bse++) {
-            if (bse->state & SVFS_BS_VALID) {
-                svfs_debug(mdc, "ino %d, size %lu, "
-                           "state 0x%x, atime %lx\n", 
-                           i, (unsigned long)bse->disksize, bse->state,
-                           bse->atime.tv_sec);
-            }
+    for (ino = 0, v1 = old; ino < nr_v1; ino++, v1++) {
+        if (!v1->state)
+            continue;
+        bse = svfs_bse_get(ssb, ino);
+        if (IS_ERR(bse)) {
+            err = PTR_ERR(bse);
+            goto out;
+        }
+        bse->parent_offset = v1->parent_offset;
+        bse->depth = v1->depth;
+        bse->state = v1->state;
+        bse->disk_flags = v1->disk_flags;
+        bse->disksize = v1->disksize;
+        bse->nlink = v1->nlink;
+        bse->mode = v1->mode;
+        bse->uid = v1->uid;
+        bse->gid = v1->gid;
+        bse->atime = v1->atime;
+        bse->ctime = v1->ctime;
+        bse->mtime = v1->mtime;
+        bse->generation = v1->generation;
+        bse->llfs_type = v1->llfs_type;
+        bse->llfs_fsid = v1->llfs_fsid;
+        if (ino != SVFS_ROOT_INODE) {
+            len = strnlen(v1->relative_path, NAME_MAX - 1);
+            err = svfs_backing_store_set_name(ssb, bse, 
+                                              v1->relative_path, len);
+            if (err)
+                goto out;
         }
+        len = strnlen(v1->ref_path, NAME_MAX);
+        if ((v1->state & SVFS_BS_LINK) && len) {
+            err = svfs_backing_store_set_link(ssb, ino, v1->ref_path, len);
+            if (err)
+                goto out;
+        }
+        svfs_bse_seal(bse);
+        svfs_backing_store_mark_dirty(ssb, ino);
+        nr++;
     }
-#endif
-
-    return retval;
+    svfs_info(mdc, "convert %d version 1 entries of %s\n", nr, 
+              ssb->backing_store);
+out:
+    vfree(old);
+    return err;
 }
 
-unsigned long svfs_backing_store_lookup(struct svfs_super_block *ssb,
-                                        unsigned long dir_ino, 
-                                        const char *name)
+static void svfs_backing_store_reclaimer(struct work_struct *);
+
+/*
+ * Set up the segment directory of the backing store. The table starts
+ * with the segments recorded in the header (at least bs_size= entries)
+ * and may grow up to bs_max_size= entries. Only the header is read
+ * here, the segments are mapped on first touch and indexed by the
+ * loader thread.
+ */
+int svfs_backing_store_init(struct svfs_super_block *ssb)
 {
-    unsigned long ino = 0;
-    struct backing_store_entry *bse = ssb->bse;
+    struct backing_store_header hdr;
+    mm_segment_t oldfs = get_fs();
+    unsigned long start = jiffies;
+    loff_t fsize, pos = 0;
+    ssize_t br;
+    int i, nsegs, present = 0, v1_segs = 0, err = -ENOMEM;
+
+    mutex_init(&ssb->bs_grow_mutex);
+    mutex_init(&ssb->bs_flush_mutex);
+    mutex_init(&ssb->bs_map_mutex);
+    mutex_init(&ssb->bs_snap_mutex);
+    ssb->bs_snap = NULL;
+    init_waitqueue_head(&ssb->bs_load_wait);
+    INIT_LIST_HEAD(&ssb->bs_dirty_list);
+    spin_lock_init(&ssb->bs_dirty_lock);
+    ssb->bs_nr_dirty = 0;
+    init_waitqueue_head(&ssb->bs_flush_wait);
+    ssb->bs_flusher = NULL;
+    ssb->bs_flush_interval = SVFS_BS_FLUSH_INTERVAL;
+    ssb->bs_dirty_thresh = SVFS_BS_DIRTY_THRESH;
+    INIT_LIST_HEAD(&ssb->bs_reclaim_list);
+    spin_lock_init(&ssb->bs_reclaim_lock);
+    INIT_DELAYED_WORK(&ssb->bs_reclaim_work, svfs_backing_store_reclaimer);
+    ssb->bs_reclaim_last = jiffies;
+    ssb->bs_reclaimed = 0;
+    ssb->bs_reclaim_rate = 0;
+    ssb->bs_loaded = 0;
+    atomic_set(&ssb->bs_csum_errs, 0);
+    ssb->bs_scan_stop = 0;
+    ssb->bs_scan_err = 0;
+    ssb->bs_flags = 0;
+    ssb->bs_max_segs = SVFS_BS_MAX_SEGS;
+    if (ssb->bs_opt_max_size)
+        ssb->bs_max_segs = DIV_ROUND_UP(ssb->bs_opt_max_size,
+                                        SVFS_BS_SEG_ENTRIES);
+    nsegs = max_t(int, DIV_ROUND_UP(ssb->bs_opt_size, SVFS_BS_SEG_ENTRIES),
+                  1);
 
-    while (ino < SVFS_BACKING_STORE_SIZE / 
-           sizeof(struct backing_store_entry)) {
-        if (bse->parent_offset == dir_ino &&
-            bse->state &&
-            !strcmp(bse->relative_path, name)) {
-            return ino;
+    /* a new or converted store is sealed from the start */
+    ssb->bs_features = SVFS_BS_FEAT_CSUM;
+
+    /* probe the format */
+    fsize = i_size_read(ssb->bs_filp->f_dentry->d_inode);
+    memset(&hdr, 0, sizeof(hdr));
+    set_fs(KERNEL_DS);
+    br = __svfs_backing_store_uread(ssb->bs_filp, &hdr, sizeof(hdr), &pos);
+    set_fs(oldfs);
+    if (br < 0) {
+        err = br;
+        goto out;
+    }
+    if (br == sizeof(hdr) && hdr.magic == SVFS_BS_MAGIC) {
+        if (hdr.version != SVFS_BS_VERSION ||
+            hdr.entry_size != sizeof(struct backing_store_entry) ||
+            hdr.seg_size != SVFS_BS_SEG_SIZE) {
+            svfs_err(mdc, "backing store %s: unsupported format, version "
+                     "%d, entry size %d, segment size %d\n", 
+                     ssb->backing_store, hdr.version, hdr.entry_size,
+                     hdr.seg_size);
+            err = -EINVAL;
+            goto out;
         }
-        ino++;
-        bse++;
+        /* never trust the header beyond the end of the file */
+        if (fsize > SVFS_BS_HDR_SIZE)
+            present = min_t(loff_t, hdr.nsegs, 
+                            (fsize - SVFS_BS_HDR_SIZE) / SVFS_BS_SEG_SIZE);
+        nsegs = max_t(int, nsegs, hdr.nsegs);
+        ssb->bs_features = hdr.features;
+    } else if (fsize) {
+        /* a version 1 file never needs more segments than it had */
+        v1_segs = DIV_ROUND_UP(fsize, SVFS_BS_SEG_SIZE);
+        ssb->bs_max_segs = max(ssb->bs_max_segs, v1_segs);
     }
-    
-    return -1UL;
+    if (nsegs > ssb->bs_max_segs) {
+        svfs_warning(mdc, "backing store %s has %d segments, raise "
+                     "bs_max_size to %d entries\n", ssb->backing_store,
+                     nsegs, nsegs * (int)SVFS_BS_SEG_ENTRIES);
+        ssb->bs_max_segs = nsegs;
+    }
+    /* a slot must stay below the shard id in the ino */
+    if (nsegs > SVFS_SHARD_SLOTS / SVFS_BS_SEG_ENTRIES) {
+        svfs_err(mdc, "backing store %s is too large, %d segments\n",
+                 ssb->backing_store, nsegs);
+        err = -EFBIG;
+        goto out;
+    }
+    ssb->bs_max_segs = min_t(int, ssb->bs_max_segs,
+                             SVFS_SHARD_SLOTS / SVFS_BS_SEG_ENTRIES);
+
+    ssb->bs_segs = kzalloc(ssb->bs_max_segs * 
+                           sizeof(struct backing_store_segment),
+                           GFP_KERNEL);
+    if (!ssb->bs_segs)
+        goto out;
+    err = svfs_heap_open(ssb);
+    if (err)
+        goto out_free;
+    if (v1_segs) {
+        err = __svfs_backing_store_convert(ssb, v1_segs, nsegs);
+    } else {
+        ssb->bs_nsegs = present;
+        ssb->bs_size = present * SVFS_BS_SEG_ENTRIES;
+        err = svfs_backing_store_extend(ssb, nsegs);
+    }
+    if (err)
+        goto out_unmap;
+    /* the mount touches the root right away */
+    err = svfs_backing_store_map(ssb, 0);
+    if (err)
+        goto out_unmap;
+    err = svfs_backing_store_build_index(ssb);
+    if (err)
+        goto out_unmap;
+    err = svfs_backing_store_build_bitmap(ssb);
+    if (err)
+        goto out_free_index;
+    err = svfs_path_cache_init(ssb);
+    if (err)
+        goto out_free_bitmap;
+    /* redo the journal before the loader derives anything from it */
+    err = svfs_journal_open(ssb);
+    if (err)
+        goto out_pcache;
+    /* write the replayed entries back and start a new epoch */
+    err = svfs_journal_checkpoint(ssb);
+    if (err)
+        goto out_close;
+    ssb->bs_mount_ms = jiffies_to_msecs(jiffies - start);
+    ssb->bs_loader = kthread_run(svfs_backing_store_loader, ssb, 
+                                 "svfs_bsload");
+    if (IS_ERR(ssb->bs_loader)) {
+        err = PTR_ERR(ssb->bs_loader);
+        ssb->bs_loader = NULL;
+        goto out_close;
+    }
+    /* the stats are optional */
+    svfs_backing_store_proc_init(ssb);
+    svfs_debug(mdc, "backing store %s: %d segments, %d entries\n",
+               ssb->backing_store, ssb->bs_nsegs, ssb->bs_size);
+    return 0;
+
+out_close:
+    svfs_journal_close(ssb);
+out_pcache:
+    svfs_path_cache_exit(ssb);
+out_free_bitmap:
+    svfs_backing_store_free_bitmap(ssb);
+out_free_index:
+    svfs_backing_store_free_index(ssb);
+out_unmap:
+    for (i = 0; i < ssb->bs_nsegs; i++)
+        __svfs_backing_store_unmap(ssb, i);
+    svfs_heap_close(ssb);
+out_free:
+    kfree(ssb->bs_segs);
+    ssb->bs_segs = NULL;
+out:
+    return err;
 }
 
-unsigned long svfs_backing_store_lookup_parent(struct svfs_super_block *ssb, 
-                                               unsigned long child_ino)
+void svfs_backing_store_exit(struct svfs_super_block *ssb)
 {
-    struct backing_store_entry *bse = ssb->bse;
+    int i;
 
-    if (child_ino == SVFS_ROOT_INODE)
-        return SVFS_ROOT_INODE;
-    if (child_ino < SVFS_BACKING_STORE_SIZE /
-        sizeof(struct backing_store_entry)) {
-        bse += child_ino;
-        return bse->parent_offset;
-    }
-    return -1UL;
+    svfs_backing_store_proc_exit(ssb);
+    /* the scanners finish the segment at hand and quit */
+    ssb->bs_scan_stop = 1;
+    if (ssb->bs_loader)
+        kthread_stop(ssb->bs_loader);
+    cancel_delayed_work_sync(&ssb->bs_reclaim_work);
+    svfs_journal_close(ssb);
+    svfs_heap_close(ssb);
+    svfs_path_cache_exit(ssb);
+    svfs_backing_store_free_bitmap(ssb);
+    svfs_backing_store_free_index(ssb);
+    /* the dirty pages stay in the page cache, the VM writes them back */
+    for (i = 0; i < ssb->bs_nsegs; i++)
+        __svfs_backing_store_unmap(ssb, i);
+    kfree(ssb->bs_segs);
+    ssb->bs_segs = NULL;
 }
 
 int svfs_backing_store_delete(struct svfs_super_block *ssb,
@@ -168,19 +1642,52 @@ int svfs_backing_store_delete(struct svfs_super_block *ssb,
                               unsigned long ino,
                               const char *name)
 {
-    struct backing_store_entry *bse = ssb->bse + ino;
+    struct backing_store_entry *bse;
+    struct backing_store_node *bsn;
+
+    if (ssb->bs_nshards)
+        svfs_shard_unlink(ssb, ino);
+    svfs_bs_dir(ssb, &dir_ino);
+    ssb = svfs_bs_of(ssb, &ino);
+    if (!ssb)
+        return -EINVAL;
+    bse = svfs_bse(ssb, ino);
+    bsn = svfs_bsn(ssb, ino);
 
+    spin_lock(&bsn->lock);
     if (likely(bse->state & SVFS_BS_VALID)) {
         /* checking it */
         ASSERT(dir_ino == bse->parent_offset);
-        if (strncmp(bse->relative_path, name, strlen(name))) {
+        if (strncmp(svfs_bse_name(ssb, bse), name, strlen(name))) {
             /* invalid name, ignore it? */
             svfs_warning(mdc, "Invalid name %s vs %s @ %ld\n",
-                         name, bse->relative_path, ino);
+                         name, svfs_bse_name(ssb, bse), ino);
         }
+        __svfs_backing_store_hash_remove(ssb, ino);
+        __svfs_backing_store_child_remove(ssb, ino);
+        svfs_bse_cow(ssb, ino);
+        write_seqcount_begin(&bsn->seq);
         bse->state |= SVFS_BS_DELETING;
+        svfs_bse_seal(bse);
+        write_seqcount_end(&bsn->seq);
+        spin_unlock(&bsn->lock);
+        svfs_backing_store_mark_dirty(ssb, ino);
+        svfs_journal_log(ssb, SVFS_JNL_ATTR, ino);
+        spin_lock(&ssb->bs_reclaim_lock);
+        if (list_empty(&bsn->reclaim))
+            list_add_tail(&bsn->reclaim, &ssb->bs_reclaim_list);
+        spin_unlock(&ssb->bs_reclaim_lock);
+        schedule_delayed_work(&ssb->bs_reclaim_work, SVFS_BS_RECLAIM_DELAY);
     } else {
+        svfs_bse_cow(ssb, ino);
+        write_seqcount_begin(&bsn->seq);
         bse->state = 0;
+        svfs_bse_seal(bse);
+        write_seqcount_end(&bsn->seq);
+        spin_unlock(&bsn->lock);
+        svfs_backing_store_mark_dirty(ssb, ino);
+        svfs_journal_log(ssb, SVFS_JNL_FREE, ino);
+        __svfs_backing_store_free_slot(ssb, ino);
         svfs_warning(mdc, "delete invalid bse entry %lu %s @ %lu\n",
                      ino, name, dir_ino);
     }
@@ -188,40 +1695,56 @@ int svfs_backing_store_delete(struct svfs_super_block *ssb,
     return 0;
 }
 
-int svfs_backing_store_scan(struct svfs_super_block *ssb)
-{
-    unsigned long i;
-    struct backing_store_entry *bse = ssb->bse;
-    int rc = 0;
-
-    for (i = 0; i < ssb->bs_size; i++, bse++) {
-        if (bse->state) {
-            rc++;
-        }
-    }
-    return rc;
-}
-
 /*
  * @offset: the index of the dentry
+ *
+ * Return the first child of parent_ino whose ino is above offset.
  */
 unsigned long svfs_backing_store_find_child(struct svfs_super_block *ssb,
                                             unsigned long parent_ino,
                                             unsigned long offset)
 {
-    unsigned long ino;
-    struct backing_store_entry *bse = ssb->bse + offset + 1;
+    struct backing_store_node *pn;
+    struct rb_node *n;
+    unsigned long ino, found = -1UL;
 
-    for (ino = offset + 1; ino < ssb->bs_size; ino++, bse++) {
-        if (!(bse->state & SVFS_BS_VALID))
-            continue;
-        if (parent_ino == ino)
-            continue;
-        if (bse->parent_offset == parent_ino) {
-            return ino;
-        }
+    ssb = svfs_bs_dir(ssb, &parent_ino);
+    if (!ssb || parent_ino >= ssb->bs_size)
+        return -1UL;
+    offset &= SVFS_SHARD_SLOTS - 1;
+    if (!ACCESS_ONCE(ssb->bs_loaded))
+        svfs_backing_store_wait_loaded(ssb);
+    if (!ACCESS_ONCE(ssb->bs_segs[parent_ino / SVFS_BS_SEG_ENTRIES].bse))
+        return -1UL;
+    smp_rmb();
+    /* only the readers of this directory contend */
+    pn = svfs_bsn(ssb, parent_ino);
+    spin_lock(&pn->lock);
+    n = pn->children.rb_node;
+    while (n) {
+        ino = rb_entry(n, struct backing_store_node, child)->ino;
+        if (ino > offset) {
+            found = ino;
+            n = n->rb_left;
+        } else
+            n = n->rb_right;
     }
-    return -1UL;
+    spin_unlock(&pn->lock);
+    return found == -1UL ? found : svfs_bs_ino(ssb, found);
+}
+
+u32 svfs_backing_store_nr_children(struct svfs_super_block *ssb,
+                                   unsigned long ino)
+{
+    ssb = svfs_bs_dir(ssb, &ino);
+    if (!ssb || ino >= ssb->bs_size)
+        return 0;
+    if (!ACCESS_ONCE(ssb->bs_loaded))
+        svfs_backing_store_wait_loaded(ssb);
+    if (!ACCESS_ONCE(ssb->bs_segs[ino / SVFS_BS_SEG_ENTRIES].bse))
+        return 0;
+    smp_rmb();
+    return ACCESS_ONCE(svfs_bsn(ssb, ino)->nr_children);
 }
 
 void svfs_backing_store_mark_new_inode(struct svfs_super_block *ssb, 
@@ -234,36 +1757,254 @@ int svfs_backing_store_update_bse(struct svfs_super_block *ssb,
                                struct dentry *dentry, struct inode *inode)
 {
     struct backing_store_entry *bse, *parent;
+    struct backing_store_node *bsn;
+    struct svfs_super_block *top = ssb;
     struct inode *dir = dentry->d_parent->d_inode;
-    
+    unsigned long ino = inode->i_ino, pino = dir->i_ino;
+    u32 name_off;
+    int moved, err;
 
     if (!(ssb->flags & SVFS_SB_LOCAL_TEST))
         return -EINVAL;
+    ssb = svfs_bs_of(top, &ino);
+    if (!ssb || ssb != svfs_bs_dir(top, &pino))
+        return -EXDEV;
+    /*
+     * A directory moved to the root under a shard name becomes its stub
+     * below, as a created one does. A stub can not move: the shard would
+     * stay attached to it, or get lost.
+     */
+    if (top->bs_nshards && ssb == top && S_ISDIR(inode->i_mode) &&
+        (ACCESS_ONCE(svfs_bse(ssb, ino)->state) & SVFS_BS_VALID) &&
+        svfs_shard_is_stub(top, ino))
+        return -EBUSY;
 
-    bse = (ssb->bse + inode->i_ino);
-    parent = (ssb->bse + dir->i_ino);
-    bse->parent_offset = (u32)dir->i_ino;
-    bse->depth = parent->depth + 1;
+    err = svfs_heap_append(ssb, dentry->d_name.name, dentry->d_name.len,
+                           &name_off);
+    if (err)
+        return err;
+    bse = svfs_bse(ssb, ino);
+    bsn = svfs_bsn(ssb, ino);
+    parent = svfs_bse(ssb, pino);
+    moved = S_ISDIR(inode->i_mode) && (bse->state & SVFS_BS_VALID);
+    spin_lock(&bsn->lock);
+    __svfs_backing_store_hash_remove(ssb, ino);
+    __svfs_backing_store_child_remove(ssb, ino);
+    svfs_bse_cow(ssb, ino);
+    write_seqcount_begin(&bsn->seq);
+    bse->parent_offset = (u32)pino;
+    bse->depth = ACCESS_ONCE(parent->depth) + 1;
     bse->state &= ~SVFS_BS_NEW;
-    strcpy(bse->relative_path, dentry->d_name.name);
-    /* FIXME: setting up the entry automatically */
+    bse->name_off = name_off;
+    bse->name_len = dentry->d_name.len;
+    /* the ref path of the others is derived from the ino */
     if (!S_ISLNK(inode->i_mode))
-        sprintf(bse->ref_path, "ino_%ld", inode->i_ino);
+        bse->link_len = 0;
     bse->state |= SVFS_BS_VALID;
+    svfs_bse_seal(bse);
+    write_seqcount_end(&bsn->seq);
+    __svfs_backing_store_hash_insert(ssb, ino);
+    __svfs_backing_store_child_insert(ssb, ino);
+    spin_unlock(&bsn->lock);
+    svfs_heap_publish(ssb, name_off);
+    /* a moved directory takes the cached paths below it along */
+    if (moved)
+        svfs_path_cache_invalidate(ssb);
+    if (top->bs_nshards && ssb == top && pino == SVFS_ROOT_INODE &&
+        S_ISDIR(inode->i_mode))
+        svfs_shard_link(top, dentry->d_name.name, dentry->d_name.len, ino);
+    svfs_backing_store_mark_dirty(ssb, ino);
+    svfs_journal_log(ssb, SVFS_JNL_LINK, ino);
 
     svfs_debug(mdc, "Update the bse %ld: po %d, state 0x%x, "
-               "rel path %s, ref path %s, depth %d\n", inode->i_ino, 
-               bse->parent_offset,
-               bse->state, bse->relative_path, bse->ref_path, bse->depth);
+               "rel path %s, link %s, depth %d\n", ino, 
+               bse->parent_offset, bse->state, svfs_bse_name(ssb, bse), 
+               svfs_bse_link(ssb, bse), bse->depth);
+
+    return 0;
+}
+
+int svfs_backing_store_set_name(struct svfs_super_block *ssb,
+                                struct backing_store_entry *bse,
+                                const char *name, int len)
+{
+    u32 off;
+    int err;
+
+    err = svfs_heap_append(ssb, name, len, &off);
+    if (err)
+        return err;
+    bse->name_off = off;
+    bse->name_len = len;
+    svfs_heap_publish(ssb, off);
+    return 0;
+}
+
+/* the target of a fast symlink */
+int svfs_backing_store_set_link(struct svfs_super_block *ssb,
+                                unsigned long ino, const char *target,
+                                int len)
+{
+    struct backing_store_entry *bse;
+    u32 off;
+    int err;
 
+    ssb = svfs_bs_of(ssb, &ino);
+    if (!ssb)
+        return -EINVAL;
+    bse = svfs_bse(ssb, ino);
+    if (!len || len > USHORT_MAX)
+        return -ENAMETOOLONG;
+    err = svfs_heap_append(ssb, target, len, &off);
+    if (err)
+        return err;
+    svfs_bse_write_begin(ssb, ino);
+    bse->link_off = off;
+    bse->link_len = len;
+    svfs_bse_write_end(ssb, ino);
+    svfs_heap_publish(ssb, off);
+    svfs_backing_store_mark_dirty(ssb, ino);
     return 0;
 }
 
+/*
+ * The entries flagged SVFS_BS_DIRTY are kept on bs_dirty_list, so
+ * write_dirty only visits them.
+ */
+void svfs_backing_store_dirty_entry(struct svfs_super_block *ssb,
+                                    unsigned long ino)
+{
+    struct backing_store_node *bsn = svfs_bsn(ssb, ino);
+    int nr = -1;
+
+    if (!list_empty(&bsn->dirty))
+        return;
+    spin_lock(&ssb->bs_dirty_lock);
+    if (list_empty(&bsn->dirty)) {
+        list_add_tail(&bsn->dirty, &ssb->bs_dirty_list);
+        nr = ++ssb->bs_nr_dirty;
+    }
+    spin_unlock(&ssb->bs_dirty_lock);
+    /* the same test as the flusher, the knob may have moved below nr */
+    if (nr > 0 && nr >= ACCESS_ONCE(ssb->bs_dirty_thresh))
+        svfs_flusher_kick(ssb);
+}
+
+static
+void __svfs_backing_store_clean_entry(struct svfs_super_block *ssb,
+                                      unsigned long ino)
+{
+    struct backing_store_node *bsn = svfs_bsn(ssb, ino);
+
+    if (list_empty(&bsn->dirty))
+        return;
+    spin_lock(&ssb->bs_dirty_lock);
+    if (!list_empty(&bsn->dirty)) {
+        list_del_init(&bsn->dirty);
+        ssb->bs_nr_dirty--;
+    }
+    spin_unlock(&ssb->bs_dirty_lock);
+}
+
+/* the inode got to commit_bse first */
+static
+void __svfs_backing_store_unqueue(struct svfs_super_block *ssb,
+                                  unsigned long ino)
+{
+    struct backing_store_node *bsn = svfs_bsn(ssb, ino);
+
+    if (list_empty(&bsn->reclaim))
+        return;
+    spin_lock(&ssb->bs_reclaim_lock);
+    list_del_init(&bsn->reclaim);
+    spin_unlock(&ssb->bs_reclaim_lock);
+}
+
+/*
+ * Finalize the deleting entries whose inode is gone. An entry with an
+ * inode in memory is left to commit_bse at eviction. The slots go back
+ * to the allocator in batches.
+ */
+void svfs_backing_store_reclaim(struct svfs_super_block *ssb)
+{
+    struct backing_store_node *bsn;
+    struct backing_store_entry *bse;
+    struct inode *inode;
+    LIST_HEAD(busy);
+    u32 slot[SVFS_BS_RECLAIM_BATCH];
+    unsigned long ino, now;
+    int nr = 0, total = 0;
+
+    spin_lock(&ssb->bs_reclaim_lock);
+    while (!list_empty(&ssb->bs_reclaim_list)) {
+        bsn = list_first_entry(&ssb->bs_reclaim_list, 
+                               struct backing_store_node, reclaim);
+        list_del_init(&bsn->reclaim);
+        ino = bsn->ino;
+        spin_unlock(&ssb->bs_reclaim_lock);
+
+        inode = ssb->sb ? ilookup(ssb->sb, svfs_bs_ino(ssb, ino)) : NULL;
+        if (inode) {
+            iput(inode);
+            spin_lock(&ssb->bs_reclaim_lock);
+            if (list_empty(&bsn->reclaim))
+                list_add_tail(&bsn->reclaim, &busy);
+            continue;
+        }
+        bse = svfs_bse(ssb, ino);
+        svfs_bse_write_begin(ssb, ino);
+        if (!(bse->state & SVFS_BS_DELETING)) {
+            /* commit_bse beat us */
+            svfs_bse_write_end(ssb, ino);
+            spin_lock(&ssb->bs_reclaim_lock);
+            continue;
+        }
+        bse->state = 0;
+        svfs_bse_write_end(ssb, ino);
+        __svfs_backing_store_clean_entry(ssb, ino);
+        svfs_backing_store_mark_dirty(ssb, ino);
+        svfs_journal_log(ssb, SVFS_JNL_FREE, ino);
+        slot[nr++] = ino;
+        if (nr == SVFS_BS_RECLAIM_BATCH) {
+            __svfs_backing_store_free_slots(ssb, slot, nr);
+            total += nr;
+            nr = 0;
+            cond_resched();
+        }
+        spin_lock(&ssb->bs_reclaim_lock);
+    }
+    /* retry the busy ones on the next pass */
+    list_splice(&busy, &ssb->bs_reclaim_list);
+    spin_unlock(&ssb->bs_reclaim_lock);
+    if (nr) {
+        __svfs_backing_store_free_slots(ssb, slot, nr);
+        total += nr;
+    }
+
+    now = jiffies;
+    ssb->bs_reclaimed += total;
+    ssb->bs_reclaim_rate = total * 1000U / 
+        max(jiffies_to_msecs(now - ssb->bs_reclaim_last), 1U);
+    ssb->bs_reclaim_last = now;
+    if (total)
+        svfs_debug(mdc, "reclaim %d deleting entries\n", total);
+}
+
+static void svfs_backing_store_reclaimer(struct work_struct *work)
+{
+    struct svfs_super_block *ssb = container_of(work, 
+                                                struct svfs_super_block,
+                                                bs_reclaim_work.work);
+
+    svfs_backing_store_reclaim(ssb);
+}
+
 /* is this inode out-of-date? */
 int svfs_backing_store_is_ood(struct inode *inode)
 {
-    struct super_block *sb = inode->i_sb;
-    struct backing_store_entry *bse = SVFS_SB(sb)->bse + inode->i_ino;
+    unsigned long ino = inode->i_ino;
+    struct svfs_super_block *ssb = svfs_bs_of(SVFS_SB(inode->i_sb), &ino);
+    struct backing_store_entry *bse = svfs_bse(ssb, ino);
 
     if (bse->state & SVFS_BS_DELETING ||
         bse->state & SVFS_BS_DIRTY ||
@@ -277,20 +2018,33 @@ void svfs_backing_store_commit_bse(struct inode *inode)
 {
     struct backing_store_entry *bse;
     struct svfs_inode *si = SVFS_I(inode);
+    unsigned long ino = inode->i_ino;
+    struct svfs_super_block *ssb = svfs_bs_of(SVFS_SB(inode->i_sb), &ino);
 
-    bse = (SVFS_SB(inode->i_sb)->bse + inode->i_ino);
+    bse = svfs_bse(ssb, ino);
+    svfs_bse_write_begin(ssb, ino);
     
     /* checking the freeing flags */
     if (bse->state & SVFS_BS_DELETING) {
-        ASSERT(inode->i_state & I_FREEING);
+        /* the slot belongs to the inode until its eviction */
+        if (!(inode->i_state & I_FREEING)) {
+            svfs_bse_write_end(ssb, ino);
+            return;
+        }
         bse->state = 0;
+        svfs_bse_write_end(ssb, ino);
+        __svfs_backing_store_clean_entry(ssb, ino);
+        __svfs_backing_store_unqueue(ssb, ino);
+        svfs_backing_store_mark_dirty(ssb, ino);
+        svfs_journal_log(ssb, SVFS_JNL_FREE, ino);
+        __svfs_backing_store_free_slot(ssb, ino);
         return;
     }
 
     svfs_get_inode_flags(si);
     bse->disk_flags = si->flags;
     if (S_ISDIR(inode->i_mode))
-        bse->disksize = inode->i_size = SVFS_SB(inode->i_sb)->bs_size;
+        bse->disksize = inode->i_size = ssb->bs_size;
     else
         bse->disksize = inode->i_size;
     bse->nlink = inode->i_nlink;
@@ -327,49 +2081,23 @@ void svfs_backing_store_commit_bse(struct inode *inode)
         bse->state |= SVFS_BS_LINK;
     else
         bse->state |= SVFS_BS_FREE; /* FIXME */
+    svfs_bse_write_end(ssb, ino);
+    __svfs_backing_store_clean_entry(ssb, ino);
+
+    svfs_backing_store_mark_dirty(ssb, ino);
+    svfs_journal_log(ssb, SVFS_JNL_ATTR, ino);
 
     if (!(bse->state & SVFS_BS_VALID)) {
         svfs_warning(mdc, "This bse %ld is INVALID.\n", inode->i_ino);
     }
 }
 
-unsigned long svfs_backing_store_find_mark_ino(struct svfs_super_block *ssb)
-{
-    static unsigned long ino = 0;
-    struct backing_store_entry *bse;
-    int counter = 0;
-
-    ino++;
-    if (unlikely(ino == ssb->bs_size)) {
-        ino = 1;
-        counter++;
-    }
-    for (; counter < ssb->bs_size; counter++) {
-        bse = ssb->bse + ino;
-        if (!bse->state) {
-            bse->state = SVFS_BS_NEW;
-            break;
-        }
-        ino++;
-        if (unlikely(ino == ssb->bs_size)) {
-            ino = 1;
-            counter++;
-        }
-    }
-
-    if (unlikely(counter >= ssb->bs_size)) {
-        ino = -1UL;
-    } else
-        atomic_inc(&ssb->bs_inuse);
-    svfs_debug(mdc, "find new bse %ld\n", ino);
-    return ino;
-}
-
 void svfs_backing_store_set_root(struct svfs_super_block *ssb)
 {
-    struct backing_store_entry *root = ssb->bse;
+    struct backing_store_entry *root = svfs_bse(ssb, SVFS_ROOT_INODE);
 
     atomic_inc(&ssb->bs_inuse);
+    svfs_bse_write_begin(ssb, SVFS_ROOT_INODE);
     root->parent_offset = 0;
     root->depth = 0;
     root->state = SVFS_BS_VALID | SVFS_BS_DIR;
@@ -378,77 +2106,190 @@ void svfs_backing_store_set_root(struct svfs_super_block *ssb)
     root->mode = S_IFDIR;
     root->uid = 0;
     root->gid = 0;
-    sprintf(root->relative_path, "/");
-    sprintf(root->ref_path, "/");
+    root->name_len = 0;
+    root->link_len = 0;
+    svfs_bse_write_end(ssb, SVFS_ROOT_INODE);
+    svfs_backing_store_mark_dirty(ssb, SVFS_ROOT_INODE);
 }
 
-int svfs_backing_store_get_path(struct svfs_super_block *ssb,
-                                struct backing_store_entry *bse,
-                                char *buf, size_t len)
+/*
+ * Build "/.a.b.c" for @ino backwards from the end of @buf, so no
+ * per-level state is kept. The walk stops at the first ancestor with a
+ * valid cached path, and the result and the path of the parent (a
+ * prefix of it) are cached in turn.
+ */
+static
+int __svfs_backing_store_get_path(struct svfs_super_block *ssb,
+                                  unsigned long ino,
+                                  char *buf, size_t len)
 {
-    struct backing_store_entry *pos = bse;
-    int depth = bse->depth, bp = 0;
-    char *cursor[depth], *p;
+    struct backing_store_entry self, cur, *pos;
+    unsigned long at = ino;
+    char *end, *p, *q;
+    int l;
+    u32 gen;
 
-    memset(buf, 0, len);
-    if (len < 0 || !(bse->state & SVFS_BS_VALID))
+    if (len < 2)
+        return -EINVAL;
+    pos = svfs_bse_get(ssb, ino);
+    if (IS_ERR(pos))
+        return PTR_ERR(pos);
+    /* a name is copied in the RCU read section its entry is read in */
+    rcu_read_lock();
+    svfs_bse_read(ssb, ino, &self);
+    if (!(self.state & SVFS_BS_VALID)) {
+        rcu_read_unlock();
         return -EINVAL;
-    if (unlikely(!depth)) {
+    }
+    if (unlikely(!self.depth)) {
+        rcu_read_unlock();
         snprintf(buf, len, "/");
         return 0;
     }
-        
-    while (depth > 0) {
-        cursor[--depth] = pos->relative_path;
-        pos = ssb->bse + pos->parent_offset;
+
+    gen = atomic_read(&ssb->bs_pcache.gen);
+    end = p = buf + len - 1;
+    *end = '\0';
+    cur = self;
+    for (;;) {
+        q = svfs_path_cache_prepend(ssb, at, &cur, buf, p);
+        if (q) {
+            p = q;
+            break;
+        }
+        /* each level costs the dot and a name */
+        l = cur.name_len;
+        if (p - buf < l + 2) {
+            rcu_read_unlock();
+            return -ENAMETOOLONG;
+        }
+        p -= l;
+        memcpy(p, svfs_bse_name(ssb, &cur), l);
+        *--p = '.';
+        at = cur.parent_offset;
+        if (at == SVFS_ROOT_INODE) {
+            *--p = '/';
+            break;
+        }
+        rcu_read_unlock();
+        pos = svfs_bse_get(ssb, at);
+        if (IS_ERR(pos))
+            return PTR_ERR(pos);
+        rcu_read_lock();
+        svfs_bse_read(ssb, at, &cur);
+        /* an ancestor went away under us */
+        if (!(cur.state & SVFS_BS_VALID)) {
+            rcu_read_unlock();
+            return -ESTALE;
+        }
     }
+    rcu_read_unlock();
+    l = end - p;
+    memmove(buf, p, l + 1);
 
-    buf[0] = '/';
-    p = &buf[1];
-    len--;
-    while (depth < bse->depth) {
-        bp = snprintf(p, len, ".%s", cursor[depth++]);
-        p += bp;
-        len -= bp;
+    if (gen == atomic_read(&ssb->bs_pcache.gen)) {
+        svfs_path_cache_insert(ssb, ino, &self, gen, buf, l);
+        if (self.parent_offset != SVFS_ROOT_INODE) {
+            svfs_bse_read(ssb, self.parent_offset, &cur);
+            svfs_path_cache_insert(ssb, self.parent_offset, &cur, gen,
+                                   buf, l - self.name_len - 1);
+        }
     }
     return 0;
 }
 
+/* the path in a shard is the path of the stub and the path below it */
+int svfs_backing_store_get_path(struct svfs_super_block *ssb,
+                                unsigned long ino,
+                                char *buf, size_t len)
+{
+    struct svfs_super_block *bs = svfs_bs_of(ssb, &ino);
+    unsigned long stub;
+    int l, err;
+
+    if (!bs)
+        return -EINVAL;
+    if (bs == ssb)
+        return __svfs_backing_store_get_path(ssb, ino, buf, len);
+    stub = svfs_shard_stub(ssb, bs);
+    if (stub == -1UL)
+        return -ESTALE;
+    err = __svfs_backing_store_get_path(ssb, stub, buf, len);
+    if (err)
+        return err;
+    l = strlen(buf);
+    err = __svfs_backing_store_get_path(bs, ino, buf + l, len - l);
+    if (err)
+        return err;
+    /* drop the leading '/' of the shard path */
+    memmove(buf + l, buf + l + 1, strlen(buf + l + 1) + 1);
+    return 0;
+}
+
 int svfs_backing_store_get_path2(struct svfs_super_block *ssb,
-                                 struct backing_store_entry *bse,
+                                 unsigned long ino,
                                  char *buf, size_t len)
 {
+    struct backing_store_entry snap, *bse = &snap;
+    unsigned long slot = ino;
     char *p = &buf[2];
 
-    if (len < 0 || !(bse->state & SVFS_BS_VALID))
+    /* the ino keeps the shard id, the names must not collide */
+    ssb = svfs_bs_of(ssb, &slot);
+    if (!ssb)
         return -EINVAL;
-    if (unlikely(!bse->depth))
+    rcu_read_lock();
+    svfs_bse_read(ssb, slot, &snap);
+    if (len < 0 || !(bse->state & SVFS_BS_VALID)) {
+        rcu_read_unlock();
+        return -EINVAL;
+    }
+    if (unlikely(!bse->depth)) {
+        rcu_read_unlock();
         return 0;
+    }
 
     len -= 2;
     memset(p, 0, len);
     buf[0] = '/';
     buf[1] = '.';
     
-    strncpy(p, bse->ref_path, len);
+    if (bse->link_len)
+        strncpy(p, svfs_bse_link(ssb, bse), len);
+    else
+        snprintf(p, len, "ino_%ld", ino);
+    rcu_read_unlock();
     return 0;
 }
 
+/* commit the dirty entries that still have an inode */
 void svfs_backing_store_write_dirty(struct svfs_super_block *ssb)
 {
-    int i = 0;
-    struct backing_store_entry *bse = ssb->bse;
+    struct backing_store_node *bsn;
     struct inode *inode;
+    unsigned long ino;
 
-    for (; i < ssb->bs_size; i++, bse++) {
-        if (bse->state & SVFS_BS_DIRTY) {
-            inode = ilookup(ssb->sb, i);
-            if (inode) {
-                /* this is the valid inode, do the data commit */
-                svfs_backing_store_commit_bse(inode);
-            } else
-                continue;
+    spin_lock(&ssb->bs_dirty_lock);
+    while (!list_empty(&ssb->bs_dirty_list)) {
+        bsn = list_first_entry(&ssb->bs_dirty_list, 
+                               struct backing_store_node, dirty);
+        list_del_init(&bsn->dirty);
+        ssb->bs_nr_dirty--;
+        ino = bsn->ino;
+        spin_unlock(&ssb->bs_dirty_lock);
+
+        /* left to the eviction or the reclaimer, both check the icache */
+        if (ACCESS_ONCE(svfs_bse(ssb, ino)->state) & SVFS_BS_DELETING) {
+            spin_lock(&ssb->bs_dirty_lock);
+            continue;
+        }
+        inode = ilookup(ssb->sb, svfs_bs_ino(ssb, ino));
+        if (inode) {
+            /* this is the valid inode, do the data commit */
+            svfs_backing_store_commit_bse(inode);
             iput(inode);
         }
-    }    
+        spin_lock(&ssb->bs_dirty_lock);
+    }
+    spin_unlock(&ssb->bs_dirty_lock);
 }
@@ -0,0 +1,79 @@
+/**
+ * Copyright (c) 2009 Ma Can <ml.macana@gmail.com>
+ *                           <macan@ncic.ac.cn>
+ *
+ * Time-stamp: <2009-08-28 09:47:03 macan>
+ *
+ * flusher.c: the metadata flusher of each mount
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "svfs.h"
+#include "svfs_i.h"
+
+/*
+ * The flusher commits the dirty entries into the table and the journal
+ * every flush_interval ms, or as soon as dirty_thresh entries are
+ * dirty, so create and unlink never wait for the metadata I/O.
+ */
+static int svfs_flusher(void *data)
+{
+    struct svfs_super_block *ssb = data;
+    int err;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible_timeout(
+            ssb->bs_flush_wait,
+            kthread_should_stop() || 
+            ACCESS_ONCE(ssb->bs_nr_dirty) >= ssb->bs_dirty_thresh,
+            msecs_to_jiffies(ssb->bs_flush_interval));
+        if (kthread_should_stop())
+            break;
+        svfs_backing_store_write_dirty(ssb);
+        err = svfs_journal_commit(ssb, 1);
+        if (err)
+            svfs_err(mdc, "flusher commit failed, err %d\n", err);
+    }
+    return 0;
+}
+
+/* called by the dirtiers, kick the flusher early */
+void svfs_flusher_kick(struct svfs_super_block *ssb)
+{
+    if (ssb->bs_flusher)
+        wake_up(&ssb->bs_flush_wait);
+}
+
+int svfs_flusher_start(struct svfs_super_block *ssb)
+{
+    struct task_struct *task;
+
+    task = kthread_run(svfs_flusher, ssb, "svfs_flush/%d", 
+                       MINOR(ssb->sb->s_dev));
+    if (IS_ERR(task))
+        return PTR_ERR(task);
+    ssb->bs_flusher = task;
+    return 0;
+}
+
+void svfs_flusher_stop(struct svfs_super_block *ssb)
+{
+    if (!ssb->bs_flusher)
+        return;
+    kthread_stop(ssb->bs_flusher);
+    ssb->bs_flusher = NULL;
+}
@@ -0,0 +1,227 @@
+/**
+ * Copyright (c) 2009 Ma Can <ml.macana@gmail.com>
+ *                           <macan@ncic.ac.cn>
+ *
+ * Time-stamp: <2009-08-31 16:12:40 macan>
+ *
+ * fsck.c: online check of the backing store table
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "svfs.h"
+#include "svfs_i.h"
+
+struct svfs_fsck
+{
+    struct svfs_super_block *ssb;
+    atomic_t next;              /* the next segment to check */
+    atomic_t running;
+    struct completion done;
+    struct svfs_fsck_result *res;
+};
+
+/* a directory has a link from each subdirectory */
+static
+u32 __svfs_fsck_subdirs(struct svfs_super_block *ssb, unsigned long ino)
+{
+    struct backing_store_node *bsn = svfs_bsn(ssb, ino), *cn;
+    struct backing_store_entry snap;
+    struct rb_node *n;
+    u32 nr = 0;
+
+    spin_lock(&bsn->lock);
+    for (n = rb_first(&bsn->children); n; n = rb_next(n)) {
+        cn = rb_entry(n, struct backing_store_node, child);
+        svfs_bse_read(ssb, cn->ino, &snap);
+        if (snap.state & SVFS_BS_DIR)
+            nr++;
+    }
+    spin_unlock(&bsn->lock);
+    return nr;
+}
+
+/*
+ * Walk up to the root, each hop must be a valid directory one level up.
+ * Returns 0, or the counter of the first problem.
+ */
+static
+atomic_t *__svfs_fsck_walk(struct svfs_super_block *ssb,
+                           struct backing_store_entry *bse,
+                           struct svfs_fsck_result *res)
+{
+    struct backing_store_entry parent;
+    u32 depth = bse->depth, p = bse->parent_offset;
+
+    while (depth) {
+        if (p >= ssb->bs_size ||
+            ssb->bs_segs[p / SVFS_BS_SEG_ENTRIES].state != SVFS_SEG_INDEXED ||
+            !ssb->bs_segs[p / SVFS_BS_SEG_ENTRIES].bse)
+            return &res->orphans;
+        svfs_bse_read(ssb, p, &parent);
+        if (!(parent.state & SVFS_BS_VALID) ||
+            (parent.state & SVFS_BS_DELETING) ||
+            !(parent.state & SVFS_BS_DIR))
+            return &res->orphans;
+        if (parent.depth + 1 != depth)
+            return &res->depth;
+        if (p == SVFS_ROOT_INODE)
+            return NULL;
+        depth = parent.depth;
+        p = parent.parent_offset;
+    }
+    /* only the root lives at depth 0 */
+    return &res->depth;
+}
+
+/* the subdirectories of a shard stub are in the root of its shard */
+static
+u32 __svfs_fsck_stub_subdirs(struct svfs_super_block *ssb, unsigned long ino)
+{
+    int i;
+
+    for (i = 0; i < ssb->bs_nshards; i++) {
+        if (ssb->bs_shard_stub[i] == ino)
+            return __svfs_fsck_subdirs(ssb->bs_shards[i], SVFS_ROOT_INODE);
+    }
+    return __svfs_fsck_subdirs(ssb, ino);
+}
+
+static
+void __svfs_fsck_entry(struct svfs_super_block *ssb, unsigned long ino,
+                       struct svfs_fsck_result *res)
+{
+    struct backing_store_entry snap;
+    atomic_t *err;
+
+    svfs_bse_read(ssb, ino, &snap);
+    if (!snap.state)
+        return;
+    atomic_inc(&res->checked);
+    if (snap.csum != svfs_bse_csum(&snap)) {
+        svfs_err(mdc, "fsck: bse %ld fails the checksum\n", ino);
+        atomic_inc(&res->csum);
+        return;
+    }
+    if (ino == SVFS_ROOT_INODE || !(snap.state & SVFS_BS_VALID) ||
+        (snap.state & SVFS_BS_DELETING))
+        return;
+
+    err = __svfs_fsck_walk(ssb, &snap, res);
+    if (err) {
+        svfs_err(mdc, "fsck: bse %ld is %s\n", ino,
+                 err == &res->orphans ? "unreachable" : "at a bad depth");
+        atomic_inc(err);
+    }
+    if ((snap.state & SVFS_BS_DIR) ?
+        snap.nlink != 2 + __svfs_fsck_stub_subdirs(ssb, ino) :
+        !snap.nlink) {
+        svfs_err(mdc, "fsck: bse %ld has a bad nlink %d\n", ino,
+                 snap.nlink);
+        atomic_inc(&res->nlink);
+    }
+}
+
+static int svfs_fsck_worker(void *data)
+{
+    struct svfs_fsck *f = data;
+    struct svfs_super_block *ssb = f->ssb;
+    unsigned long ino;
+    int seg;
+
+    while ((seg = atomic_inc_return(&f->next) - 1) < ssb->bs_nsegs) {
+        if (ssb->bs_segs[seg].state != SVFS_SEG_INDEXED)
+            continue;
+        /* an unmapped one is empty */
+        if (!ssb->bs_segs[seg].bse) {
+            atomic_inc(&f->res->segments);
+            continue;
+        }
+        for (ino = seg * SVFS_BS_SEG_ENTRIES;
+             ino < (seg + 1) * SVFS_BS_SEG_ENTRIES; ino++) {
+            __svfs_fsck_entry(ssb, ino, f->res);
+            if (!(ino & 0xff))
+                cond_resched();
+        }
+        atomic_inc(&f->res->segments);
+    }
+    if (atomic_dec_and_test(&f->running))
+        complete(&f->done);
+    return 0;
+}
+
+/* check one store, the counters add up in @res */
+static
+void __svfs_backing_store_fsck(struct svfs_super_block *ssb,
+                               struct svfs_fsck_result *res)
+{
+    struct svfs_fsck f;
+    struct task_struct *task;
+    int i, nr;
+
+    f.ssb = ssb;
+    f.res = res;
+    atomic_set(&f.next, 0);
+    atomic_set(&f.running, 1);
+    init_completion(&f.done);
+
+    nr = min_t(int, num_online_cpus(), SVFS_BS_MAX_SCANNERS);
+    nr = min(nr, ssb->bs_nsegs);
+    for (i = 1; i < nr; i++) {
+        atomic_inc(&f.running);
+        task = kthread_run(svfs_fsck_worker, &f, "svfs_fsck/%d", i);
+        if (IS_ERR(task)) {
+            atomic_dec(&f.running);
+            break;
+        }
+    }
+    res->workers = max(res->workers, i);
+    svfs_fsck_worker(&f);
+    wait_for_completion(&f.done);
+}
+
+/*
+ * Check the checksum, the parent chain, the depth and the nlink of every
+ * entry of the mounted table and of its shards, with up to one worker
+ * per CPU. The checks run on snapshots of the live entries, so the
+ * result is only exact on a quiet file system. Nothing is repaired.
+ */
+int svfs_backing_store_fsck(struct svfs_super_block *ssb,
+                            struct svfs_fsck_result *res)
+{
+    unsigned long start = jiffies;
+    int i;
+
+    /* the stubs are checked against the roots of the shards */
+    svfs_backing_store_wait_loaded(ssb);
+    for (i = 0; i < ssb->bs_nshards; i++)
+        svfs_backing_store_wait_loaded(ssb->bs_shards[i]);
+    memset(res, 0, sizeof(*res));
+    __svfs_backing_store_fsck(ssb, res);
+    for (i = 0; i < ssb->bs_nshards; i++)
+        __svfs_backing_store_fsck(ssb->bs_shards[i], res);
+    res->ms = jiffies_to_msecs(jiffies - start);
+
+    svfs_info(mdc, "fsck %s: %d entries in %u ms, %d bad checksums, "
+              "%d unreachable, %d bad depths, %d bad nlinks\n",
+              ssb->backing_store, atomic_read(&res->checked), res->ms,
+              atomic_read(&res->csum), atomic_read(&res->orphans),
+              atomic_read(&res->depth), atomic_read(&res->nlink));
+    if (atomic_read(&res->csum) || atomic_read(&res->orphans) ||
+        atomic_read(&res->depth) || atomic_read(&res->nlink))
+        return -EUCLEAN;
+    return 0;
+}
@@ -0,0 +1,549 @@
+/**
+ * Copyright (c) 2009 Ma Can <ml.macana@gmail.com>
+ *                           <macan@ncic.ac.cn>
+ *
+ * Time-stamp: <2009-08-24 10:31:52 macan>
+ *
+ * heap.c: the name heap of the backing store
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "svfs.h"
+#include "svfs_i.h"
+
+/*
+ * A rename appends the new name and leaves the old one behind. The file
+ * offset of a name equals its heap offset, so the heap file is just the
+ * chunks laid out back to back. The names of a chunk all dead, the
+ * chunk is appended to again from its start, see the compaction below.
+ *
+ * The chunks are read in on first use, not at mount: a segment loads the
+ * chunks of its names when it is mapped (so the names of a mapped entry
+ * are always there), an append the chunk it writes to. Only the part
+ * below bs_heap_disk_len is in the file, and a chunk appended to from
+ * its start (@fresh) has nothing worth reading. The caller holds
+ * bs_heap_mutex.
+ */
+static int __svfs_heap_chunk(struct svfs_super_block *ssb, int idx,
+                             int fresh)
+{
+    mm_segment_t oldfs;
+    loff_t pos = (loff_t)idx * SVFS_BS_HEAP_CHUNK;
+    ssize_t br;
+    char *chunk;
+    int len;
+
+    if (ssb->bs_heap[idx].data)
+        return 0;
+    chunk = vmalloc(SVFS_BS_HEAP_CHUNK);
+    if (!chunk)
+        return -ENOMEM;
+    memset(chunk, 0, SVFS_BS_HEAP_CHUNK);
+    if (!fresh && pos < ssb->bs_heap_disk_len) {
+        len = min_t(loff_t, SVFS_BS_HEAP_CHUNK,
+                    ssb->bs_heap_disk_len - pos);
+        oldfs = get_fs();
+        set_fs(KERNEL_DS);
+        br = __svfs_backing_store_uread(ssb->bs_heap_filp, chunk, len, &pos);
+        set_fs(oldfs);
+        if (br != len) {
+            vfree(chunk);
+            return br < 0 ? br : -EIO;
+        }
+    }
+    /* the lockless readers find the bytes behind the pointer */
+    smp_wmb();
+    ssb->bs_heap[idx].data = chunk;
+    return 0;
+}
+
+/* read in the chunk under @off, before the names in it are used */
+int svfs_heap_load(struct svfs_super_block *ssb, u32 off)
+{
+    int idx = off / SVFS_BS_HEAP_CHUNK, err;
+
+    if (idx >= SVFS_BS_HEAP_CHUNKS)
+        return -EINVAL;
+    if (likely(ACCESS_ONCE(ssb->bs_heap[idx].data)))
+        return 0;
+    mutex_lock(&ssb->bs_heap_mutex);
+    err = __svfs_heap_chunk(ssb, idx, 0);
+    mutex_unlock(&ssb->bs_heap_mutex);
+    return err;
+}
+
+/*
+ * Is the name at @off whole in the loaded chunk? An entry written back
+ * ahead of its name finds zeros there, the chunk was wiped before reuse.
+ */
+int svfs_heap_check(struct svfs_super_block *ssb, u32 off, int len)
+{
+    char *p;
+
+    if (!len)
+        return 1;
+    if (off % SVFS_BS_HEAP_CHUNK + len + 1 > SVFS_BS_HEAP_CHUNK)
+        return 0;
+    p = __svfs_heap(ssb, off);
+    return p[len] == '\0' && !memchr(p, '\0', len);
+}
+
+/* the current chunk is full: take a free one, or one past the end */
+static int __svfs_heap_next(struct svfs_super_block *ssb)
+{
+    int idx, nr = DIV_ROUND_UP(ssb->bs_heap_len, SVFS_BS_HEAP_CHUNK);
+
+    for (idx = 0; idx < nr; idx++) {
+        if (ssb->bs_heap[idx].state == SVFS_HEAP_FREE)
+            break;
+    }
+    if (idx >= SVFS_BS_HEAP_CHUNKS)
+        return -ENOSPC;
+    ssb->bs_heap[idx].state = SVFS_HEAP_USED;
+    ssb->bs_heap_used++;
+    ssb->bs_heap_cur = idx;
+    return idx;
+}
+
+/*
+ * Append @name (not NUL terminated) and return its offset in @off. The
+ * caller stores it in the entry and calls svfs_heap_publish().
+ */
+int svfs_heap_append(struct svfs_super_block *ssb, const char *name,
+                     int len, u32 *off)
+{
+    struct svfs_heap_chunk *c;
+    int idx, err;
+    u32 pos;
+
+    if (len + 1 > SVFS_BS_HEAP_CHUNK)
+        return -ENAMETOOLONG;
+
+    mutex_lock(&ssb->bs_heap_mutex);
+    idx = ssb->bs_heap_cur;
+    if (ssb->bs_heap[idx].fill + len + 1 > SVFS_BS_HEAP_CHUNK) {
+        idx = __svfs_heap_next(ssb);
+        if (idx < 0) {
+            err = idx;
+            goto out;
+        }
+    }
+    c = &ssb->bs_heap[idx];
+    err = __svfs_heap_chunk(ssb, idx, !c->fill);
+    if (err)
+        goto out;
+    memcpy(c->data + c->fill, name, len);
+    c->data[c->fill + len] = '\0';
+    pos = idx * SVFS_BS_HEAP_CHUNK + c->fill;
+    /* the bytes must be there before the flusher sees the new fill */
+    smp_wmb();
+    c->fill += len + 1;
+    atomic_inc(&c->pending);
+    if (pos + len + 1 > ssb->bs_heap_len)
+        ssb->bs_heap_len = pos + len + 1;
+    *off = pos;
+out:
+    mutex_unlock(&ssb->bs_heap_mutex);
+    return err;
+}
+
+/* the name appended at @off is in its entry now */
+void svfs_heap_publish(struct svfs_super_block *ssb, u32 off)
+{
+    smp_mb__before_atomic_dec();
+    atomic_dec(&ssb->bs_heap[off / SVFS_BS_HEAP_CHUNK].pending);
+}
+
+/*
+ * Write the appended bytes of each chunk out, called by
+ * svfs_backing_store_write under bs_flush_mutex.
+ */
+int svfs_heap_flush(struct svfs_super_block *ssb)
+{
+    struct svfs_heap_chunk *c;
+    mm_segment_t oldfs;
+    loff_t pos;
+    ssize_t bw;
+    u32 end;
+    int idx, nr, dirty = 0;
+
+    nr = DIV_ROUND_UP(ACCESS_ONCE(ssb->bs_heap_len), SVFS_BS_HEAP_CHUNK);
+    oldfs = get_fs();
+    set_fs(KERNEL_DS);
+    for (idx = 0; idx < nr; idx++) {
+        c = &ssb->bs_heap[idx];
+        end = ACCESS_ONCE(c->fill);
+        smp_rmb();
+        if (c->flushed >= end)
+            continue;
+        pos = (loff_t)idx * SVFS_BS_HEAP_CHUNK + c->flushed;
+        bw = __svfs_backing_store_uwrite(ssb->bs_heap_filp,
+                                         c->data + c->flushed,
+                                         end - c->flushed, &pos);
+        if (bw != end - c->flushed) {
+            set_fs(oldfs);
+            return bw < 0 ? bw : -EIO;
+        }
+        c->flushed = end;
+        dirty = 1;
+    }
+    set_fs(oldfs);
+    if (!dirty)
+        return 0;
+
+    return vfs_fsync(ssb->bs_heap_filp, ssb->bs_heap_filp->f_dentry, 1);
+}
+
+/*
+ * The compaction runs in the checkpoint once the chunks in use doubled
+ * since the last run, more often as the heap fills up. It counts the
+ * names of the chunks, moves the names out of the chunks mostly dead
+ * and frees the chunks left without a name once the table is on disk
+ * (svfs_heap_retire).
+ *
+ * Only the chunks in use, not appended to and with no name pending are
+ * counted. No name goes into them during the run, so a count can only
+ * be too high. A moved name is appended again, swapped in under the
+ * entry lock if the entry still has it, and journaled. The readers may
+ * still see the old bytes until they leave their RCU read section, so a
+ * freed chunk is reused after a grace period, and it is never released
+ * while mounted.
+ */
+#define SVFS_HEAP_WALK_MIN 16   /* chunks */
+
+static inline
+void __svfs_heap_count(struct svfs_super_block *ssb, u32 off, int len)
+{
+    struct svfs_heap_chunk *c;
+
+    if (!len || off / SVFS_BS_HEAP_CHUNK >= SVFS_BS_HEAP_CHUNKS)
+        return;
+    c = &ssb->bs_heap[off / SVFS_BS_HEAP_CHUNK];
+    if (c->mark == SVFS_HEAP_CAND)
+        c->live += len + 1;
+}
+
+static inline
+int __svfs_heap_moving(struct svfs_super_block *ssb, u32 off, int len)
+{
+    return len && off / SVFS_BS_HEAP_CHUNK < SVFS_BS_HEAP_CHUNKS &&
+        ssb->bs_heap[off / SVFS_BS_HEAP_CHUNK].mark == SVFS_HEAP_MOVE;
+}
+
+/* move the name (or the @link) at @old of entry @ino to the current chunk */
+static int __svfs_heap_move(struct svfs_super_block *ssb, unsigned long ino,
+                            u32 old, int len, int link)
+{
+    struct backing_store_entry *bse = svfs_bse(ssb, ino);
+    int moved = 0, err;
+    u32 off;
+
+    /* the stale name of a new entry may not be read in */
+    err = svfs_heap_load(ssb, old);
+    if (err)
+        return err;
+    err = svfs_heap_append(ssb, __svfs_heap(ssb, old), len, &off);
+    if (err)
+        return err;
+    svfs_bse_write_begin(ssb, ino);
+    if (link && bse->link_off == old && bse->link_len == len) {
+        bse->link_off = off;
+        moved = 1;
+    } else if (!link && bse->name_off == old && bse->name_len == len) {
+        bse->name_off = off;
+        moved = 1;
+    }
+    svfs_bse_write_end(ssb, ino);
+    svfs_heap_publish(ssb, off);
+    if (!moved)
+        return 0;
+    svfs_backing_store_mark_dirty(ssb, ino);
+    if (ACCESS_ONCE(bse->state) & SVFS_BS_VALID)
+        svfs_journal_log(ssb, SVFS_JNL_LINK, ino);
+    ssb->bs_heap_moved++;
+    return 0;
+}
+
+/* count the names in the candidate chunks, or move them out (@move) */
+static int __svfs_heap_walk(struct svfs_super_block *ssb, int move)
+{
+    struct backing_store_entry snap;
+    unsigned long ino, end;
+    int seg, err;
+
+    for (seg = 0; seg < ssb->bs_nsegs; seg++) {
+        /* an unmapped segment is empty once the loader is done */
+        if (!ACCESS_ONCE(ssb->bs_segs[seg].bse))
+            continue;
+        smp_rmb();
+        ino = (unsigned long)seg * SVFS_BS_SEG_ENTRIES;
+        for (end = ino + SVFS_BS_SEG_ENTRIES; ino < end; ino++) {
+            if (svfs_bsn(ssb, ino)->flags & SVFS_BSN_BAD)
+                continue;
+            svfs_bse_read(ssb, ino, &snap);
+            /* a new entry may have its link already */
+            if (!snap.state)
+                continue;
+            if (!move) {
+                __svfs_heap_count(ssb, snap.name_off, snap.name_len);
+                __svfs_heap_count(ssb, snap.link_off, snap.link_len);
+                continue;
+            }
+            if (__svfs_heap_moving(ssb, snap.name_off, snap.name_len)) {
+                err = __svfs_heap_move(ssb, ino, snap.name_off,
+                                       snap.name_len, 0);
+                if (err)
+                    return err;
+            }
+            if (__svfs_heap_moving(ssb, snap.link_off, snap.link_len)) {
+                err = __svfs_heap_move(ssb, ino, snap.link_off,
+                                       snap.link_len, 1);
+                if (err)
+                    return err;
+            }
+        }
+        cond_resched();
+    }
+    return 0;
+}
+
+/*
+ * Called by the checkpoint under bs_snap_mutex, as a snapshot streams
+ * the heap as it is. Returns the number of chunks to free.
+ */
+int svfs_heap_compact(struct svfs_super_block *ssb)
+{
+    struct svfs_heap_chunk *c;
+    int idx, nr, cand = 0, move = 0, dead = 0, err;
+    u64 live = 0;
+
+    if (!ssb->bs_heap || !ACCESS_ONCE(ssb->bs_loaded) ||
+        ssb->bs_scan_err || ssb->bs_scan_stop ||
+        ssb->bs_heap_used < ssb->bs_heap_walk_at)
+        return 0;
+
+    mutex_lock(&ssb->bs_heap_mutex);
+    nr = DIV_ROUND_UP(ssb->bs_heap_len, SVFS_BS_HEAP_CHUNK);
+    for (idx = 0; idx < nr; idx++) {
+        c = &ssb->bs_heap[idx];
+        c->live = 0;
+        if (c->state == SVFS_HEAP_USED && idx != ssb->bs_heap_cur &&
+            !atomic_read(&c->pending)) {
+            c->mark = SVFS_HEAP_CAND;
+            cand++;
+        }
+    }
+    mutex_unlock(&ssb->bs_heap_mutex);
+    /* the names stored before the pending counts dropped are seen */
+    smp_mb();
+    if (!cand)
+        goto out;
+
+    __svfs_heap_walk(ssb, 0);
+    for (idx = 0; idx < nr; idx++) {
+        c = &ssb->bs_heap[idx];
+        if (c->mark != SVFS_HEAP_CAND)
+            continue;
+        live += c->live;
+        if (c->live && c->live <= SVFS_BS_HEAP_CHUNK / 2) {
+            c->mark = SVFS_HEAP_MOVE;
+            move++;
+        }
+    }
+    /* not worth it unless half of the candidates is dead */
+    if (live > (u64)cand * SVFS_BS_HEAP_CHUNK / 2) {
+        for (idx = 0; idx < nr; idx++) {
+            if (ssb->bs_heap[idx].mark == SVFS_HEAP_MOVE)
+                ssb->bs_heap[idx].mark = SVFS_HEAP_CAND;
+        }
+        move = 0;
+    }
+    err = move ? __svfs_heap_walk(ssb, 1) : 0;
+    if (err)
+        svfs_warning(mdc, "compact the name heap of %s failed %d\n",
+                     ssb->backing_store, err);
+
+    for (idx = 0; idx < nr; idx++) {
+        c = &ssb->bs_heap[idx];
+        if ((c->mark == SVFS_HEAP_CAND && !c->live) ||
+            (c->mark == SVFS_HEAP_MOVE && !err)) {
+            c->mark = SVFS_HEAP_DEAD;
+            dead++;
+        } else
+            c->mark = 0;
+    }
+    svfs_debug(mdc, "compact the name heap of %s: %d chunks counted, "
+               "%d moved, %d to free\n", ssb->backing_store, cand, move,
+               dead);
+out:
+    /* double, but at most half of the room left */
+    nr = ssb->bs_heap_used - dead;
+    idx = min(max(nr, SVFS_HEAP_WALK_MIN), (SVFS_BS_HEAP_CHUNKS - nr) / 2);
+    ssb->bs_heap_walk_at = nr + max(idx, 1);
+    return dead;
+}
+
+/*
+ * Zero the dead chunks on disk before they are appended to again. The VM
+ * writes a table page back when it likes, so an entry may reach the disk
+ * ahead of its name in a reused chunk: the load must find zeros under
+ * it then, not an old name (svfs_heap_check). The caller holds
+ * bs_flush_mutex and bs_heap_mutex.
+ */
+static int __svfs_heap_wipe(struct svfs_super_block *ssb, int nr)
+{
+    struct svfs_heap_chunk *c;
+    mm_segment_t oldfs;
+    loff_t pos;
+    ssize_t bw;
+    int idx, dirty = 0, err = 0;
+
+    oldfs = get_fs();
+    set_fs(KERNEL_DS);
+    for (idx = 0; idx < nr; idx++) {
+        c = &ssb->bs_heap[idx];
+        if (c->mark != SVFS_HEAP_DEAD || !c->flushed)
+            continue;
+        /* the readers of the old names are gone, see synchronize_rcu */
+        if (c->data) {
+            memset(c->data, 0, SVFS_BS_HEAP_CHUNK);
+        } else {
+            err = __svfs_heap_chunk(ssb, idx, 1);
+            if (err)
+                break;
+        }
+        pos = (loff_t)idx * SVFS_BS_HEAP_CHUNK;
+        bw = __svfs_backing_store_uwrite(ssb->bs_heap_filp, c->data,
+                                         c->flushed, &pos);
+        if (bw != c->flushed) {
+            err = bw < 0 ? bw : -EIO;
+            break;
+        }
+        dirty = 1;
+    }
+    set_fs(oldfs);
+    if (!err && dirty)
+        err = vfs_fsync(ssb->bs_heap_filp, ssb->bs_heap_filp->f_dentry, 1);
+    if (err)
+        svfs_warning(mdc, "wipe the dead chunks of %s failed %d, "
+                     "kept them\n", ssb->backing_store, err);
+    return err;
+}
+
+/*
+ * Free the chunks the compaction left without a name, once the table
+ * refers to the moved names on disk. @err is the checkpoint's: the old
+ * names are still in use then, the chunks are kept. So are they when
+ * they can not be wiped.
+ */
+void svfs_heap_retire(struct svfs_super_block *ssb, int err)
+{
+    struct svfs_heap_chunk *c;
+    int idx, nr;
+
+    if (!err)
+        synchronize_rcu();
+    mutex_lock(&ssb->bs_flush_mutex);
+    mutex_lock(&ssb->bs_heap_mutex);
+    nr = DIV_ROUND_UP(ssb->bs_heap_len, SVFS_BS_HEAP_CHUNK);
+    if (!err)
+        err = __svfs_heap_wipe(ssb, nr);
+    for (idx = 0; idx < nr; idx++) {
+        c = &ssb->bs_heap[idx];
+        if (c->mark == SVFS_HEAP_DEAD && !err) {
+            c->state = SVFS_HEAP_FREE;
+            c->fill = c->flushed = 0;
+            ssb->bs_heap_used--;
+            ssb->bs_heap_freed++;
+        }
+        c->mark = 0;
+    }
+    mutex_unlock(&ssb->bs_heap_mutex);
+    mutex_unlock(&ssb->bs_flush_mutex);
+    /* a cached path is checked by name_off, which a new name may reuse */
+    if (!err)
+        svfs_path_cache_invalidate(ssb);
+}
+
+int svfs_heap_open(struct svfs_super_block *ssb)
+{
+    char *name;
+    loff_t size;
+    int idx, nr, err = -ENOMEM;
+
+    mutex_init(&ssb->bs_heap_mutex);
+    ssb->bs_heap = vmalloc(SVFS_BS_HEAP_CHUNKS *
+                           sizeof(struct svfs_heap_chunk));
+    if (!ssb->bs_heap)
+        goto out;
+    memset(ssb->bs_heap, 0, SVFS_BS_HEAP_CHUNKS *
+           sizeof(struct svfs_heap_chunk));
+
+    name = __getname();
+    if (!name)
+        goto out_free;
+    snprintf(name, PATH_MAX, "%s.heap", ssb->backing_store);
+    ssb->bs_heap_filp = filp_open(name, O_RDWR | O_CREAT | O_LARGEFILE,
+                                  S_IRWXU);
+    __putname(name);
+    if (IS_ERR(ssb->bs_heap_filp)) {
+        err = PTR_ERR(ssb->bs_heap_filp);
+        goto out_free;
+    }
+
+    size = i_size_read(ssb->bs_heap_filp->f_dentry->d_inode);
+    if (size > (loff_t)SVFS_BS_HEAP_CHUNKS * SVFS_BS_HEAP_CHUNK) {
+        err = -EFBIG;
+        goto out_close;
+    }
+    /* the chunks on disk are taken as full until a compaction counts them */
+    nr = DIV_ROUND_UP(size, SVFS_BS_HEAP_CHUNK);
+    for (idx = 0; idx < nr; idx++) {
+        ssb->bs_heap[idx].fill = ssb->bs_heap[idx].flushed =
+            min_t(loff_t, SVFS_BS_HEAP_CHUNK,
+                  size - (loff_t)idx * SVFS_BS_HEAP_CHUNK);
+    }
+    ssb->bs_heap_cur = nr ? nr - 1 : 0;
+    ssb->bs_heap_used = nr ? nr : 1;
+    ssb->bs_heap_walk_at = SVFS_HEAP_WALK_MIN;
+    ssb->bs_heap_len = size;
+    ssb->bs_heap_disk_len = size;
+    svfs_debug(mdc, "open name heap %s.heap, %d bytes\n",
+               ssb->backing_store, (int)size);
+    return 0;
+
+out_close:
+    fput(ssb->bs_heap_filp);
+out_free:
+    vfree(ssb->bs_heap);
+    ssb->bs_heap = NULL;
+out:
+    return err;
+}
+
+void svfs_heap_close(struct svfs_super_block *ssb)
+{
+    int i;
+
+    if (!ssb->bs_heap)
+        return;
+    for (i = 0; i < SVFS_BS_HEAP_CHUNKS; i++)
+        vfree(ssb->bs_heap[i].data);
+    vfree(ssb->bs_heap);
+    ssb->bs_heap = NULL;
+    fput(ssb->bs_heap_filp);
+}
@@ -0,0 +1,472 @@
+/**
+ * Copyright (c) 2009 Ma Can <ml.macana@gmail.com>
+ *                           <macan@ncic.ac.cn>
+ *
+ * Time-stamp: <2009-08-20 15:12:07 macan>
+ *
+ * journal.c: the redo journal of the backing store
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "svfs.h"
+#include "svfs_i.h"
+
+/*
+ * Records are appended to an in-memory buffer and written out in groups,
+ * by the commit timer, sync_fs or when the buffer fills up. A checkpoint
+ * flushes the dirty table pages, then bumps the epoch in the header so
+ * the old records are ignored by the next replay.
+ */
+#define SVFS_JNL_COMMIT_INTERVAL (HZ)
+#define SVFS_JNL_CKPT_INTERVAL   (30 * HZ)
+#define SVFS_JNL_CKPT_SIZE       (4 * 1024 * 1024)
+
+/* the names are logged by value, their heap offsets are not stable */
+#define SVFS_JNL_HEAD_LEN offsetof(struct backing_store_entry, name_off)
+#define SVFS_JNL_MAX_REC (sizeof(struct svfs_jnl_record) +             \
+                          ALIGN(SVFS_JNL_HEAD_LEN + NAME_MAX + 1 +     \
+                                PATH_MAX + 1, 8))
+
+static u32 __svfs_journal_crc(struct svfs_jnl_record *rec)
+{
+    u32 crc, saved = rec->crc;
+
+    rec->crc = 0;
+    crc = crc32c(~0, rec, sizeof(*rec) + rec->len);
+    rec->crc = saved;
+    return crc;
+}
+
+static
+int __svfs_journal_write_header(struct svfs_journal *j)
+{
+    struct svfs_jnl_header hdr = {
+        .magic = SVFS_JNL_MAGIC,
+        .version = SVFS_JNL_VERSION,
+        .epoch = j->epoch,
+    };
+    mm_segment_t oldfs = get_fs();
+    loff_t pos = 0;
+    ssize_t bw;
+
+    set_fs(KERNEL_DS);
+    bw = __svfs_backing_store_uwrite(j->filp, &hdr, sizeof(hdr), &pos);
+    set_fs(oldfs);
+    if (bw != sizeof(hdr))
+        return bw < 0 ? bw : -EIO;
+    return vfs_fsync(j->filp, j->filp->f_dentry, 1);
+}
+
+/*
+ * Records were dropped: the commits fail until a checkpoint has put the
+ * table on disk, which is forced by the next run of the worker.
+ */
+static void __svfs_journal_lost(struct svfs_journal *j, int err)
+{
+    if (!j->err)
+        j->err = err;
+    j->last_ckpt = jiffies - SVFS_JNL_CKPT_INTERVAL - 1;
+    schedule_delayed_work(&j->work, 0);
+}
+
+/*
+ * The caller should hold the commit_mutex. The records of a failed
+ * write go back in front of the new ones and the tail stays, so the
+ * next commit writes them again.
+ */
+static
+int __svfs_journal_commit(struct svfs_journal *j, int sync)
+{
+    struct svfs_jnl_record *rec;
+    mm_segment_t oldfs;
+    loff_t pos;
+    char *buf;
+    ssize_t bw;
+    u64 seq;
+    int len, off, lost = 0, err;
+
+    spin_lock(&j->lock);
+    buf = j->buf[j->cur];
+    len = j->len;
+    seq = j->seq;
+    j->cur ^= 1;
+    j->len = 0;
+    spin_unlock(&j->lock);
+
+    if (!len)
+        goto out_sync;
+    /* the epoch is stamped now, a checkpoint may have bumped it */
+    for (off = 0; off < len;
+         off += sizeof(*rec) + rec->len) {
+        rec = (struct svfs_jnl_record *)(buf + off);
+        rec->epoch = j->epoch;
+        rec->crc = __svfs_journal_crc(rec);
+    }
+
+    pos = j->tail;
+    oldfs = get_fs();
+    set_fs(KERNEL_DS);
+    bw = __svfs_backing_store_uwrite(j->filp, buf, len, &pos);
+    set_fs(oldfs);
+    if (bw != len) {
+        err = bw < 0 ? bw : -EIO;
+        svfs_err(mdc, "write journal %s failed, err %d\n", j->name, err);
+        spin_lock(&j->lock);
+        if (len + j->len <= SVFS_JNL_BUF_SIZE) {
+            memcpy(buf + len, j->buf[j->cur], j->len);
+            j->len += len;
+            j->cur ^= 1;
+        } else
+            lost = 1;
+        spin_unlock(&j->lock);
+        if (lost)
+            __svfs_journal_lost(j, err);
+        return err;
+    }
+    j->tail = pos;
+out_sync:
+    if (sync && j->committed != seq) {
+        err = vfs_fsync(j->filp, j->filp->f_dentry, 1);
+        if (err)
+            return err;
+    }
+    j->committed = seq;
+    return 0;
+}
+
+/* a lost record fails every commit up to the next checkpoint */
+int svfs_journal_commit(struct svfs_super_block *ssb, int sync)
+{
+    struct svfs_journal *j = &ssb->bs_jnl;
+    int err;
+
+    mutex_lock(&j->commit_mutex);
+    err = __svfs_journal_commit(j, sync);
+    if (!err)
+        err = j->err;
+    mutex_unlock(&j->commit_mutex);
+    return err;
+}
+
+/*
+ * The name heap is compacted first, outside commit_mutex as the moved
+ * names are journaled, and its dead chunks are freed once the table is
+ * written. A running snapshot streams the heap, the compaction waits
+ * for the next checkpoint then.
+ */
+int svfs_journal_checkpoint(struct svfs_super_block *ssb)
+{
+    struct svfs_journal *j = &ssb->bs_jnl;
+    int compact, dead = 0, err;
+
+    compact = mutex_trylock(&ssb->bs_snap_mutex);
+    if (compact)
+        dead = svfs_heap_compact(ssb);
+    mutex_lock(&j->commit_mutex);
+    /* the records it fails to write are kept, the table covers them */
+    __svfs_journal_commit(j, 0);
+    /* forces the dirty table pages out */
+    err = svfs_backing_store_write(ssb);
+    if (err)
+        goto out;
+
+    /* the table is stable now, retire all the records */
+    j->epoch++;
+    err = __svfs_journal_write_header(j);
+    if (err)
+        goto out;
+    j->tail = sizeof(struct svfs_jnl_header);
+    j->err = 0;
+    j->last_ckpt = jiffies;
+    svfs_debug(mdc, "checkpoint journal %s, epoch %d, seq %lld\n",
+               j->name, j->epoch, j->committed);
+out:
+    mutex_unlock(&j->commit_mutex);
+    if (dead)
+        svfs_heap_retire(ssb, err);
+    if (compact)
+        mutex_unlock(&ssb->bs_snap_mutex);
+    return err;
+}
+
+static void svfs_journal_worker(struct work_struct *work)
+{
+    struct svfs_journal *j = container_of(work, struct svfs_journal,
+                                          work.work);
+    struct svfs_super_block *ssb = container_of(j, struct svfs_super_block,
+                                                bs_jnl);
+
+    if (j->tail > SVFS_JNL_CKPT_SIZE ||
+        time_after(jiffies, j->last_ckpt + SVFS_JNL_CKPT_INTERVAL))
+        svfs_journal_checkpoint(ssb);
+    else
+        svfs_journal_commit(ssb, 1);
+}
+
+/*
+ * Append the after-image of entry @ino, with its names. The entry is
+ * already updated in memory and nothing holds the VM off writing its
+ * table page back first: an entry on disk ahead of its name is dropped
+ * at load (__svfs_backing_store_load_names), the record brings it back.
+ */
+void svfs_journal_log(struct svfs_super_block *ssb, int type,
+                      unsigned long ino)
+{
+    struct svfs_journal *j = &ssb->bs_jnl;
+    struct backing_store_entry snap, *bse = &snap;
+    struct svfs_jnl_record *rec;
+    int len, l1 = 0, l2 = 0, err;
+    char *p;
+
+    if (!j->filp)
+        return;
+retry:
+    /*
+     * A consistent image, the concurrent writers log their own. Its
+     * names are copied before rcu_read_unlock, see heap.c.
+     */
+    rcu_read_lock();
+    svfs_bse_read(ssb, ino, &snap);
+    len = 0;
+    if (type != SVFS_JNL_FREE)
+        len = SVFS_JNL_HEAD_LEN;
+    if (type == SVFS_JNL_LINK) {
+        l1 = bse->name_len + 1;
+        l2 = bse->link_len + 1;
+        len += l1 + l2;
+    }
+    len = ALIGN(len, 8);
+
+    spin_lock(&j->lock);
+    if (j->len + sizeof(*rec) + len > SVFS_JNL_BUF_SIZE) {
+        spin_unlock(&j->lock);
+        rcu_read_unlock();
+        mutex_lock(&j->commit_mutex);
+        err = __svfs_journal_commit(j, 0);
+        /* the buffer is still full of the failed records */
+        if (err)
+            __svfs_journal_lost(j, err);
+        mutex_unlock(&j->commit_mutex);
+        if (err)
+            return;
+        goto retry;
+    }
+    rec = (struct svfs_jnl_record *)(j->buf[j->cur] + j->len);
+    memset(rec, 0, sizeof(*rec) + len);
+    rec->magic = SVFS_JNL_REC_MAGIC;
+    rec->type = type;
+    rec->ino = ino;
+    rec->len = len;
+    rec->seq = ++j->seq;
+    p = (char *)(rec + 1);
+    if (type != SVFS_JNL_FREE)
+        memcpy(p, bse, SVFS_JNL_HEAD_LEN);
+    if (type == SVFS_JNL_LINK) {
+        p += SVFS_JNL_HEAD_LEN;
+        memcpy(p, svfs_bse_name(ssb, bse), l1 - 1);
+        memcpy(p + l1, svfs_bse_link(ssb, bse), l2 - 1);
+    }
+    j->len += sizeof(*rec) + len;
+    spin_unlock(&j->lock);
+    rcu_read_unlock();
+
+    schedule_delayed_work(&j->work, SVFS_JNL_COMMIT_INTERVAL);
+}
+
+static
+int __svfs_journal_apply(struct svfs_super_block *ssb,
+                         struct svfs_jnl_record *rec)
+{
+    struct backing_store_entry *bse;
+    char *p = (char *)(rec + 1);
+    int l1, l2, err;
+
+    if (rec->ino >= ssb->bs_size) {
+        err = svfs_backing_store_extend(ssb,
+                                        rec->ino / SVFS_BS_SEG_ENTRIES + 1);
+        if (err)
+            return err;
+    }
+    bse = svfs_bse_get(ssb, rec->ino);
+    if (IS_ERR(bse))
+        return PTR_ERR(bse);
+    switch (rec->type) {
+    case SVFS_JNL_FREE:
+        memset(bse, 0, sizeof(*bse));
+        break;
+    case SVFS_JNL_LINK:
+        if (rec->len < SVFS_JNL_HEAD_LEN + 2)
+            return -EINVAL;
+        p += SVFS_JNL_HEAD_LEN;
+        l1 = strnlen(p, rec->len - SVFS_JNL_HEAD_LEN);
+        l2 = strnlen(p + l1 + 1, rec->len - SVFS_JNL_HEAD_LEN - l1 - 1);
+        if (l1 > NAME_MAX || SVFS_JNL_HEAD_LEN + l1 + 1 + l2 >= rec->len)
+            return -EINVAL;
+        err = svfs_backing_store_set_name(ssb, bse, p, l1);
+        if (err)
+            return err;
+        if (l2) {
+            err = svfs_backing_store_set_link(ssb, rec->ino, p + l1 + 1, 
+                                              l2);
+            if (err)
+                return err;
+        } else
+            bse->link_len = 0;
+        p = (char *)(rec + 1);
+        /* fall through */
+    case SVFS_JNL_ATTR:
+        if (rec->len < SVFS_JNL_HEAD_LEN)
+            return -EINVAL;
+        memcpy(bse, p, SVFS_JNL_HEAD_LEN);
+        break;
+    default:
+        return -EINVAL;
+    }
+    svfs_bse_seal(bse);
+    svfs_backing_store_mark_dirty(ssb, rec->ino);
+    return 0;
+}
+
+/*
+ * Redo the records of the current epoch, stop at the first torn or stale
+ * one. The caller checkpoints right after, so the tail is never reused.
+ */
+static
+int __svfs_journal_replay(struct svfs_super_block *ssb)
+{
+    struct svfs_journal *j = &ssb->bs_jnl;
+    struct svfs_jnl_record *rec;
+    mm_segment_t oldfs = get_fs();
+    loff_t pos = sizeof(struct svfs_jnl_header);
+    ssize_t br;
+    u64 last = 0;
+    int nr = 0, err = 0;
+
+    rec = kmalloc(SVFS_JNL_MAX_REC, GFP_KERNEL);
+    if (!rec)
+        return -ENOMEM;
+
+    set_fs(KERNEL_DS);
+    while (1) {
+        br = __svfs_backing_store_uread(j->filp, rec, sizeof(*rec), &pos);
+        if (br != sizeof(*rec))
+            break;
+        if (rec->magic != SVFS_JNL_REC_MAGIC || rec->epoch != j->epoch ||
+            rec->seq <= last ||
+            rec->len > SVFS_JNL_MAX_REC - sizeof(*rec))
+            break;
+        br = __svfs_backing_store_uread(j->filp, rec + 1, rec->len, &pos);
+        if (br != rec->len)
+            break;
+        if (rec->crc != __svfs_journal_crc(rec)) {
+            svfs_warning(mdc, "journal %s: bad crc @ seq %lld\n",
+                         j->name, rec->seq);
+            break;
+        }
+        err = __svfs_journal_apply(ssb, rec);
+        if (err) {
+            svfs_err(mdc, "journal %s: apply record %lld failed, "
+                     "err %d\n", j->name, rec->seq, err);
+            break;
+        }
+        last = rec->seq;
+        nr++;
+    }
+    set_fs(oldfs);
+    kfree(rec);
+
+    j->seq = j->committed = last;
+    svfs_info(mdc, "journal %s: replay %d records of epoch %d\n",
+              j->name, nr, j->epoch);
+    return err;
+}
+
+int svfs_journal_open(struct svfs_super_block *ssb)
+{
+    struct svfs_journal *j = &ssb->bs_jnl;
+    struct svfs_jnl_header hdr;
+    mm_segment_t oldfs;
+    loff_t pos = 0;
+    ssize_t br;
+    int err = -ENOMEM;
+
+    spin_lock_init(&j->lock);
+    mutex_init(&j->commit_mutex);
+    INIT_DELAYED_WORK(&j->work, svfs_journal_worker);
+    j->last_ckpt = jiffies;
+
+    j->name = __getname();
+    if (!j->name)
+        goto out;
+    snprintf(j->name, PATH_MAX, "%s.jnl", ssb->backing_store);
+    j->buf[0] = vmalloc(SVFS_JNL_BUF_SIZE);
+    j->buf[1] = vmalloc(SVFS_JNL_BUF_SIZE);
+    if (!j->buf[0] || !j->buf[1])
+        goto out_free;
+    j->filp = filp_open(j->name, O_RDWR | O_CREAT | O_LARGEFILE, S_IRWXU);
+    if (IS_ERR(j->filp)) {
+        err = PTR_ERR(j->filp);
+        j->filp = NULL;
+        goto out_free;
+    }
+
+    oldfs = get_fs();
+    set_fs(KERNEL_DS);
+    br = __svfs_backing_store_uread(j->filp, &hdr, sizeof(hdr), &pos);
+    set_fs(oldfs);
+    if (br == sizeof(hdr) && hdr.magic == SVFS_JNL_MAGIC &&
+        hdr.version == SVFS_JNL_VERSION) {
+        j->epoch = hdr.epoch;
+        err = __svfs_journal_replay(ssb);
+        if (err)
+            goto out_close;
+    } else {
+        /* a new journal */
+        j->epoch = 1;
+        err = __svfs_journal_write_header(j);
+        if (err)
+            goto out_close;
+    }
+    /* new records go after the header, the next checkpoint moves on */
+    j->tail = sizeof(struct svfs_jnl_header);
+    return 0;
+
+out_close:
+    fput(j->filp);
+    j->filp = NULL;
+out_free:
+    vfree(j->buf[0]);
+    vfree(j->buf[1]);
+    __putname(j->name);
+out:
+    return err;
+}
+
+void svfs_journal_close(struct svfs_super_block *ssb)
+{
+    struct svfs_journal *j = &ssb->bs_jnl;
+
+    if (!j->filp)
+        return;
+    cancel_delayed_work_sync(&j->work);
+    svfs_journal_commit(ssb, 1);
+    fput(j->filp);
+    j->filp = NULL;
+    vfree(j->buf[0]);
+    vfree(j->buf[1]);
+    __putname(j->name);
+}
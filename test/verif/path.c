@@ -0,0 +1,159 @@
+/**
+ * Copyright (c) 2009 Ma Can <ml.macana@gmail.com>
+ *                           <macan@ncic.ac.cn>
+ *
+ * Time-stamp: <2009-08-26 15:12:40 macan>
+ *
+ * path.c: the path cache of the backing store
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "svfs.h"
+#include "svfs_i.h"
+
+int svfs_path_cache_init(struct svfs_super_block *ssb)
+{
+    struct svfs_path_cache *pc = &ssb->bs_pcache;
+    int i;
+
+    pc->hash = kmalloc(sizeof(struct hlist_head) << SVFS_PATH_CACHE_BITS,
+                       GFP_KERNEL);
+    if (!pc->hash)
+        return -ENOMEM;
+    for (i = 0; i < (1 << SVFS_PATH_CACHE_BITS); i++)
+        INIT_HLIST_HEAD(pc->hash + i);
+    spin_lock_init(&pc->lock);
+    INIT_LIST_HEAD(&pc->lru);
+    pc->nr = 0;
+    atomic_set(&pc->gen, 0);
+    return 0;
+}
+
+void svfs_path_cache_exit(struct svfs_super_block *ssb)
+{
+    struct svfs_path_cache *pc = &ssb->bs_pcache;
+    struct svfs_path_ent *pe, *n;
+
+    if (!pc->hash)
+        return;
+    list_for_each_entry_safe(pe, n, &pc->lru, lru)
+        kfree(pe);
+    kfree(pc->hash);
+    pc->hash = NULL;
+}
+
+/* the caller should hold the pc->lock */
+static
+struct svfs_path_ent *__svfs_path_cache_find(struct svfs_path_cache *pc,
+                                             unsigned long ino)
+{
+    struct svfs_path_ent *pe;
+    struct hlist_node *pos;
+
+    hlist_for_each_entry(pe, pos, 
+                         pc->hash + hash_long(ino, SVFS_PATH_CACHE_BITS),
+                         hlist) {
+        if (pe->ino == ino)
+            return pe;
+    }
+    return NULL;
+}
+
+/* the caller should hold the pc->lock */
+static
+void __svfs_path_cache_free(struct svfs_path_cache *pc,
+                            struct svfs_path_ent *pe)
+{
+    hlist_del(&pe->hlist);
+    list_del(&pe->lru);
+    pc->nr--;
+    kfree(pe);
+}
+
+/*
+ * Copy the cached path of @ino to the bytes right before @end, @bse is
+ * a snapshot of the entry to validate against. Return the start of the
+ * path in @buf, or NULL on a miss.
+ */
+char *svfs_path_cache_prepend(struct svfs_super_block *ssb,
+                              unsigned long ino,
+                              struct backing_store_entry *bse,
+                              char *buf, char *end)
+{
+    struct svfs_path_cache *pc = &ssb->bs_pcache;
+    struct svfs_path_ent *pe;
+    char *p = NULL;
+
+    spin_lock(&pc->lock);
+    pe = __svfs_path_cache_find(pc, ino);
+    if (!pe)
+        goto out;
+    if (pe->parent != bse->parent_offset || pe->name_off != bse->name_off ||
+        pe->gen != atomic_read(&pc->gen)) {
+        __svfs_path_cache_free(pc, pe);
+        goto out;
+    }
+    if (pe->len <= end - buf) {
+        p = end - pe->len;
+        memcpy(p, pe->path, pe->len);
+        list_move(&pe->lru, &pc->lru);
+    }
+out:
+    spin_unlock(&pc->lock);
+    return p;
+}
+
+/* remember @path as the path of @ino, computed at generation @gen */
+void svfs_path_cache_insert(struct svfs_super_block *ssb,
+                            unsigned long ino,
+                            struct backing_store_entry *bse,
+                            u32 gen, const char *path, int len)
+{
+    struct svfs_path_cache *pc = &ssb->bs_pcache;
+    struct svfs_path_ent *pe, *old;
+
+    pe = kmalloc(sizeof(*pe) + len + 1, GFP_NOFS);
+    if (!pe)
+        return;
+    pe->ino = ino;
+    pe->parent = bse->parent_offset;
+    pe->name_off = bse->name_off;
+    pe->gen = gen;
+    pe->len = len;
+    memcpy(pe->path, path, len);
+    pe->path[len] = '\0';
+
+    spin_lock(&pc->lock);
+    old = __svfs_path_cache_find(pc, ino);
+    if (old)
+        __svfs_path_cache_free(pc, old);
+    /* bounded, the coldest path goes first */
+    if (pc->nr >= SVFS_PATH_CACHE_MAX)
+        __svfs_path_cache_free(pc, list_entry(pc->lru.prev, 
+                                              struct svfs_path_ent, lru));
+    hlist_add_head(&pe->hlist, 
+                   pc->hash + hash_long(ino, SVFS_PATH_CACHE_BITS));
+    list_add(&pe->lru, &pc->lru);
+    pc->nr++;
+    spin_unlock(&pc->lock);
+}
+
+/* a directory moved, every cached path below it may be stale */
+void svfs_path_cache_invalidate(struct svfs_super_block *ssb)
+{
+    atomic_inc(&ssb->bs_pcache.gen);
+}
@@ -0,0 +1,288 @@
+/**
+ * Copyright (c) 2009 Ma Can <ml.macana@gmail.com>
+ *                           <macan@ncic.ac.cn>
+ *
+ * Time-stamp: <2009-08-27 10:05:18 macan>
+ *
+ * proc.c: /proc/fs/svfs/<backing store>/ of each mount
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "svfs.h"
+#include "svfs_i.h"
+
+static int svfs_bs_stats_show(struct seq_file *m, void *v)
+{
+    struct svfs_super_block *ssb = m->private;
+
+    seq_printf(m, "segments: %d/%d\n", ssb->bs_nsegs, ssb->bs_max_segs);
+    seq_printf(m, "entries: %d\n", ssb->bs_size);
+    seq_printf(m, "inuse: %d\n", atomic_read(&ssb->bs_inuse));
+    seq_printf(m, "loaded: %d\n", ssb->bs_loaded);
+    seq_printf(m, "mount_ms: %u\n", ssb->bs_mount_ms);
+    seq_printf(m, "index_ms: %u (%d scanners)\n", ssb->bs_index_ms,
+               ssb->bs_nr_scanners);
+    seq_printf(m, "dirty_entries: %d\n", ACCESS_ONCE(ssb->bs_nr_dirty));
+    seq_printf(m, "heap_bytes: %u\n", ssb->bs_heap_len);
+    seq_printf(m, "heap_chunks: %d\n", ssb->bs_heap_used);
+    seq_printf(m, "heap_moved: %llu\n",
+               (unsigned long long)ssb->bs_heap_moved);
+    seq_printf(m, "heap_freed: %llu\n",
+               (unsigned long long)ssb->bs_heap_freed);
+    seq_printf(m, "cached_paths: %d\n", ssb->bs_pcache.nr);
+    seq_printf(m, "reclaimed: %llu\n", (unsigned long long)ssb->bs_reclaimed);
+    seq_printf(m, "reclaim_rate: %u/s\n", ssb->bs_reclaim_rate);
+    seq_printf(m, "csum_errors: %d\n", atomic_read(&ssb->bs_csum_errs));
+    return 0;
+}
+
+static int svfs_bs_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, svfs_bs_stats_show, PDE(inode)->data);
+}
+
+static const struct file_operations svfs_bs_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = svfs_bs_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* reading the file runs a full check, one worker per CPU */
+static int svfs_bs_fsck_show(struct seq_file *m, void *v)
+{
+    struct svfs_super_block *ssb = m->private;
+    struct svfs_fsck_result res;
+    int err;
+
+    err = svfs_backing_store_fsck(ssb, &res);
+    seq_printf(m, "result: %s\n", err ? "errors" : "clean");
+    seq_printf(m, "segments: %d\n", atomic_read(&res.segments));
+    seq_printf(m, "entries: %d\n", atomic_read(&res.checked));
+    seq_printf(m, "bad_csum: %d\n", atomic_read(&res.csum));
+    seq_printf(m, "unreachable: %d\n", atomic_read(&res.orphans));
+    seq_printf(m, "bad_depth: %d\n", atomic_read(&res.depth));
+    seq_printf(m, "bad_nlink: %d\n", atomic_read(&res.nlink));
+    seq_printf(m, "time_ms: %u (%d workers)\n", res.ms, res.workers);
+    return 0;
+}
+
+static int svfs_bs_fsck_open(struct inode *inode, struct file *file)
+{
+    /* the file is world readable, the scan is not for everybody */
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    return single_open(file, svfs_bs_fsck_show, PDE(inode)->data);
+}
+
+static const struct file_operations svfs_bs_fsck_fops = {
+    .owner = THIS_MODULE,
+    .open = svfs_bs_fsck_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int svfs_bs_snapshot_show(struct seq_file *m, void *v)
+{
+    struct svfs_super_block *ssb = m->private;
+
+    seq_printf(m, "last_result: %d\n", ssb->bs_snap_err);
+    seq_printf(m, "last_ms: %u\n", ssb->bs_snap_ms);
+    seq_printf(m, "last_cow_pages: %lu\n", ssb->bs_snap_copied);
+    return 0;
+}
+
+static int svfs_bs_snapshot_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, svfs_bs_snapshot_show, PDE(inode)->data);
+}
+
+/* accept the path of the image, it returns when the image is written */
+static ssize_t svfs_bs_snapshot_write(struct file *file,
+                                      const char __user *buffer,
+                                      size_t count, loff_t *ppos)
+{
+    struct svfs_super_block *ssb = 
+        ((struct seq_file *)file->private_data)->private;
+    char *path;
+    int err;
+
+    if (!count || count >= PATH_MAX)
+        return -EINVAL;
+    path = __getname();
+    if (!path)
+        return -ENOMEM;
+    err = -EFAULT;
+    if (copy_from_user(path, buffer, count))
+        goto out;
+    path[count] = '\0';
+    if (path[count - 1] == '\n')
+        path[count - 1] = '\0';
+    err = -EINVAL;
+    if (path[0] != '/')
+        goto out;
+    err = svfs_backing_store_snapshot(ssb, path);
+out:
+    __putname(path);
+    return err ? err : count;
+}
+
+static const struct file_operations svfs_bs_snapshot_fops = {
+    .owner = THIS_MODULE,
+    .open = svfs_bs_snapshot_open,
+    .read = seq_read,
+    .write = svfs_bs_snapshot_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/*
+ * The knobs are plain unsigned ints of the svfs_super_block, @show and
+ * @write find them by offset.
+ */
+struct svfs_bs_knob
+{
+    char *name;
+    size_t offset;
+    unsigned int min;
+};
+
+static struct svfs_bs_knob svfs_bs_knobs[] = {
+    {"flush_interval", offsetof(struct svfs_super_block, 
+                                bs_flush_interval), 10},
+    {"dirty_thresh", offsetof(struct svfs_super_block, 
+                              bs_dirty_thresh), 1},
+};
+
+static inline
+unsigned int *svfs_bs_knob(struct svfs_super_block *ssb,
+                           struct svfs_bs_knob *k)
+{
+    return (unsigned int *)((char *)ssb + k->offset);
+}
+
+static int svfs_bs_knobs_show(struct seq_file *m, void *v)
+{
+    struct svfs_super_block *ssb = m->private;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(svfs_bs_knobs); i++)
+        seq_printf(m, "%s: %u\n", svfs_bs_knobs[i].name,
+                   *svfs_bs_knob(ssb, &svfs_bs_knobs[i]));
+    return 0;
+}
+
+static int svfs_bs_knobs_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, svfs_bs_knobs_show, PDE(inode)->data);
+}
+
+/* accept "name value" */
+static ssize_t svfs_bs_knobs_write(struct file *file, 
+                                   const char __user *buffer,
+                                   size_t count, loff_t *ppos)
+{
+    struct svfs_super_block *ssb = 
+        ((struct seq_file *)file->private_data)->private;
+    char buf[64], *p;
+    unsigned long val;
+    int i, len;
+
+    if (count >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, buffer, count))
+        return -EFAULT;
+    buf[count] = '\0';
+    for (i = 0; i < ARRAY_SIZE(svfs_bs_knobs); i++) {
+        len = strlen(svfs_bs_knobs[i].name);
+        if (strncmp(buf, svfs_bs_knobs[i].name, len) || buf[len] != ' ')
+            continue;
+        val = simple_strtoul(buf + len + 1, &p, 0);
+        if (p == buf + len + 1 || val < svfs_bs_knobs[i].min ||
+            val > UINT_MAX)
+            return -EINVAL;
+        *svfs_bs_knob(ssb, &svfs_bs_knobs[i]) = val;
+        /* let the flusher pick the new value up */
+        svfs_flusher_kick(ssb);
+        return count;
+    }
+    return -EINVAL;
+}
+
+static const struct file_operations svfs_bs_knobs_fops = {
+    .owner = THIS_MODULE,
+    .open = svfs_bs_knobs_open,
+    .read = seq_read,
+    .write = svfs_bs_knobs_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* the directory is named after the backing store file */
+static const char *svfs_bs_proc_name(struct svfs_super_block *ssb)
+{
+    const char *p = strrchr(ssb->backing_store, '/');
+
+    return p ? p + 1 : ssb->backing_store;
+}
+
+int svfs_backing_store_proc_init(struct svfs_super_block *ssb)
+{
+    struct proc_dir_entry *dir;
+    int err;
+
+    dir = svfs_lib_proc_add_dir(NULL, (char *)svfs_bs_proc_name(ssb));
+    if (IS_ERR(dir)) {
+        ssb->bs_proc = NULL;
+        return PTR_ERR(dir);
+    }
+    ssb->bs_proc = dir;
+    err = svfs_lib_proc_add_entry_data(dir, "stats", &svfs_bs_stats_fops,
+                                       ssb);
+    if (err)
+        goto out;
+    err = svfs_lib_proc_add_entry_data(dir, "knobs", &svfs_bs_knobs_fops,
+                                       ssb);
+    if (err)
+        goto out;
+    err = svfs_lib_proc_add_entry_data(dir, "fsck", &svfs_bs_fsck_fops,
+                                       ssb);
+    if (err)
+        goto out;
+    err = svfs_lib_proc_add_entry_data(dir, "snapshot", 
+                                       &svfs_bs_snapshot_fops, ssb);
+    if (err)
+        goto out;
+    return 0;
+out:
+    svfs_backing_store_proc_exit(ssb);
+    return err;
+}
+
+void svfs_backing_store_proc_exit(struct svfs_super_block *ssb)
+{
+    if (!ssb->bs_proc)
+        return;
+    svfs_lib_proc_remove_entry(ssb->bs_proc, "snapshot");
+    svfs_lib_proc_remove_entry(ssb->bs_proc, "fsck");
+    svfs_lib_proc_remove_entry(ssb->bs_proc, "knobs");
+    svfs_lib_proc_remove_entry(ssb->bs_proc, "stats");
+    svfs_lib_proc_remove_entry(NULL, (char *)svfs_bs_proc_name(ssb));
+    ssb->bs_proc = NULL;
+}
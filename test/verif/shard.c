@@ -0,0 +1,297 @@
+/**
+ * Copyright (c) 2009 Ma Can <ml.macana@gmail.com>
+ *                           <macan@ncic.ac.cn>
+ *
+ * Time-stamp: <2009-09-04 15:38:21 macan>
+ *
+ * shard.c: the subtree shards of the backing store
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "svfs.h"
+#include "svfs_i.h"
+
+/*
+ * The bs_shards=a:b mount option gives the directories /a and /b a
+ * store each: file, heap, journal, allocator, index and flusher. The
+ * directory itself (the stub) stays in the root table, its children
+ * live in the shard under the shard's root slot. The shard id is kept
+ * above the slot in the ino, see svfs_bs_of() and svfs_bs_dir().
+ */
+static
+struct svfs_super_block *__svfs_shard_open(struct svfs_super_block *ssb,
+                                           const char *name, int id)
+{
+    struct svfs_super_block *bs;
+    int err = -ENOMEM;
+
+    bs = svfs_alloc_sb();
+    if (IS_ERR(bs))
+        return bs;
+    bs->flags = ssb->flags;
+    bs->sb = ssb->sb;
+    bs->bs_opt_size = ssb->bs_opt_size;
+    bs->bs_opt_max_size = ssb->bs_opt_max_size;
+    bs->bs_shard_id = id;
+    bs->bs_shard_name = kstrdup(name, GFP_KERNEL);
+    if (!bs->bs_shard_name)
+        goto out_free;
+    bs->backing_store = __getname();
+    if (!bs->backing_store)
+        goto out_free_name;
+    snprintf(bs->backing_store, PATH_MAX, "%s.shard.%s",
+             ssb->backing_store, name);
+    bs->bs_filp = filp_open(bs->backing_store, O_RDWR | O_CREAT, S_IRWXU);
+    if (IS_ERR(bs->bs_filp)) {
+        err = PTR_ERR(bs->bs_filp);
+        goto out_putname;
+    }
+    err = svfs_backing_store_init(bs);
+    if (err)
+        goto out_close;
+    svfs_backing_store_set_root(bs);
+    err = svfs_flusher_start(bs);
+    if (err)
+        svfs_warning(mdc, "start the flusher of shard %s failed, err %d\n",
+                     name, err);
+    svfs_info(mdc, "shard %d: /%s in %s\n", id, name, bs->backing_store);
+    return bs;
+
+out_close:
+    fput(bs->bs_filp);
+out_putname:
+    __putname(bs->backing_store);
+out_free_name:
+    kfree(bs->bs_shard_name);
+out_free:
+    svfs_free_sb(bs);
+    return ERR_PTR(err);
+}
+
+static
+void __svfs_shard_close(struct svfs_super_block *bs)
+{
+    int err;
+
+    svfs_flusher_stop(bs);
+    svfs_backing_store_write_dirty(bs);
+    svfs_backing_store_reclaim(bs);
+    err = svfs_journal_checkpoint(bs);
+    if (err)
+        svfs_err(mdc, "checkpoint shard %s failed, err %d\n",
+                 bs->bs_shard_name, err);
+    svfs_backing_store_exit(bs);
+    fput(bs->bs_filp);
+    __putname(bs->backing_store);
+    kfree(bs->bs_shard_name);
+    svfs_free_sb(bs);
+}
+
+/*
+ * Find the stubs not known yet without waiting for the index of the
+ * root table. Returns nonzero if a miss is not final, the stub is then
+ * resolved on the first use of its directory (svfs_shard_resolve()) or
+ * once the root table is loaded.
+ */
+static
+int __svfs_shard_find_stubs(struct svfs_super_block *ssb)
+{
+    struct backing_store_entry snap;
+    unsigned long ino;
+    char *name;
+    int i, loaded, pending = 0;
+
+    loaded = ACCESS_ONCE(ssb->bs_loaded);
+    smp_rmb();
+    for (i = 0; i < ssb->bs_nshards; i++) {
+        if (ACCESS_ONCE(ssb->bs_shard_stub[i]) != -1UL)
+            continue;
+        name = ssb->bs_shards[i]->bs_shard_name;
+        ino = svfs_backing_store_lookup_nowait(ssb, SVFS_ROOT_INODE, name);
+        if (ino == -1UL) {
+            pending |= !loaded;
+            continue;
+        }
+        svfs_bse_read(ssb, ino, &snap);
+        if (!(snap.state & SVFS_BS_DIR)) {
+            svfs_warning(mdc, "shard %s is not mounted on a directory\n",
+                         name);
+            continue;
+        }
+        if (ACCESS_ONCE(svfs_bsn(ssb, ino)->nr_children))
+            svfs_warning(mdc, "the entries under /%s in the root table are "
+                         "hidden by its shard\n", name);
+        ssb->bs_shard_stub[i] = ino;
+    }
+    return pending;
+}
+
+/* the root table is loaded, the stubs still missing have no directory */
+static
+void __svfs_shard_settle_stubs(struct svfs_super_block *ssb)
+{
+    if (!__svfs_shard_find_stubs(ssb))
+        ssb->bs_stubs_pending = 0;
+}
+
+/*
+ * The directory @dir of the root table is used while some stubs are not
+ * found: it is one of them if it hangs on the root under a shard name.
+ * Its entry is in the table even if its segment is not indexed yet.
+ */
+void svfs_shard_resolve(struct svfs_super_block *ssb, unsigned long dir)
+{
+    struct backing_store_entry *bse, snap;
+
+    if (ACCESS_ONCE(ssb->bs_loaded)) {
+        smp_rmb();
+        __svfs_shard_settle_stubs(ssb);
+        return;
+    }
+    if (dir >= ssb->bs_size)
+        return;
+    bse = svfs_bse_get(ssb, dir);
+    if (IS_ERR(bse))
+        return;
+    rcu_read_lock();
+    svfs_bse_read(ssb, dir, &snap);
+    if (snap.parent_offset == SVFS_ROOT_INODE &&
+        (snap.state & (SVFS_BS_DIR | SVFS_BS_DELETING)) == SVFS_BS_DIR)
+        svfs_shard_link(ssb, svfs_bse_name(ssb, &snap), snap.name_len, dir);
+    rcu_read_unlock();
+}
+
+/* the stub of the shard @bs, waits for the root table if it is not found */
+unsigned long svfs_shard_stub(struct svfs_super_block *ssb,
+                              struct svfs_super_block *bs)
+{
+    unsigned long stub = ACCESS_ONCE(ssb->bs_shard_stub[bs->bs_shard_id - 1]);
+
+    if (stub == -1UL && ACCESS_ONCE(ssb->bs_stubs_pending)) {
+        svfs_backing_store_wait_loaded(ssb);
+        __svfs_shard_settle_stubs(ssb);
+        stub = ACCESS_ONCE(ssb->bs_shard_stub[bs->bs_shard_id - 1]);
+    }
+    return stub;
+}
+
+int svfs_shards_init(struct svfs_super_block *ssb)
+{
+    struct svfs_super_block *bs;
+    char *opt = ssb->bs_opt_shards, *name;
+    int i, err = 0;
+
+    for (i = 0; i < SVFS_MAX_SHARDS; i++)
+        ssb->bs_shard_stub[i] = -1UL;
+    if (!opt)
+        return 0;
+    while ((name = strsep(&opt, ":")) != NULL) {
+        if (!*name)
+            continue;
+        if (ssb->bs_nshards == SVFS_MAX_SHARDS || strchr(name, '/') ||
+            strlen(name) > NAME_MAX) {
+            svfs_err(mdc, "invalid shard '%s'\n", name);
+            err = -EINVAL;
+            goto out_close;
+        }
+        bs = __svfs_shard_open(ssb, name, ssb->bs_nshards + 1);
+        if (IS_ERR(bs)) {
+            err = PTR_ERR(bs);
+            goto out_close;
+        }
+        ssb->bs_shards[ssb->bs_nshards++] = bs;
+    }
+    ssb->bs_stubs_pending = __svfs_shard_find_stubs(ssb);
+    return 0;
+
+out_close:
+    svfs_shards_exit(ssb);
+    return err;
+}
+
+/* the flushers hold inode references, stop them before the eviction */
+void svfs_shards_stop(struct svfs_super_block *ssb)
+{
+    int i;
+
+    for (i = 0; i < ssb->bs_nshards; i++)
+        svfs_flusher_stop(ssb->bs_shards[i]);
+}
+
+void svfs_shards_exit(struct svfs_super_block *ssb)
+{
+    while (ssb->bs_nshards > 0)
+        __svfs_shard_close(ssb->bs_shards[--ssb->bs_nshards]);
+}
+
+void svfs_shards_kick(struct svfs_super_block *ssb)
+{
+    int i;
+
+    for (i = 0; i < ssb->bs_nshards; i++)
+        svfs_flusher_kick(ssb->bs_shards[i]);
+}
+
+int svfs_shards_commit(struct svfs_super_block *ssb, int wait)
+{
+    int i, err, ret = 0;
+
+    for (i = 0; i < ssb->bs_nshards; i++) {
+        err = svfs_journal_commit(ssb->bs_shards[i], wait);
+        if (err)
+            ret = err;
+    }
+    return ret;
+}
+
+/* a directory created in the root, it may be the stub of a shard */
+void svfs_shard_link(struct svfs_super_block *ssb, const char *name,
+                     int len, unsigned long ino)
+{
+    char *sname;
+    int i;
+
+    for (i = 0; i < ssb->bs_nshards; i++) {
+        sname = ssb->bs_shards[i]->bs_shard_name;
+        if (strlen(sname) == len && !memcmp(sname, name, len)) {
+            ssb->bs_shard_stub[i] = ino;
+            break;
+        }
+    }
+}
+
+/* a stub carries its shard, it can not be renamed or moved */
+int svfs_shard_is_stub(struct svfs_super_block *ssb, unsigned long ino)
+{
+    int i;
+
+    for (i = 0; i < ssb->bs_nshards; i++) {
+        if (ACCESS_ONCE(ssb->bs_shard_stub[i]) == ino)
+            return 1;
+    }
+    return 0;
+}
+
+void svfs_shard_unlink(struct svfs_super_block *ssb, unsigned long ino)
+{
+    int i;
+
+    for (i = 0; i < ssb->bs_nshards; i++) {
+        if (ssb->bs_shard_stub[i] == ino)
+            ssb->bs_shard_stub[i] = -1UL;
+    }
+}
@@ -0,0 +1,278 @@
+/**
+ * Copyright (c) 2009 Ma Can <ml.macana@gmail.com>
+ *                           <macan@ncic.ac.cn>
+ *
+ * Time-stamp: <2009-09-02 11:20:07 macan>
+ *
+ * snapshot.c: online copy-on-write snapshots of the backing store
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "svfs.h"
+#include "svfs_i.h"
+
+/*
+ * A snapshot freezes the table pages of the segments present at the
+ * freeze. The first writer of a frozen page copies it aside before the
+ * change (svfs_bse_cow), the streamer takes the copy, or the live page
+ * if nobody has touched it. Once a page is copied or streamed it is
+ * done and the writers go on untouched. The names do not move while a
+ * snapshot runs (the compaction takes bs_snap_mutex) and the chunks
+ * are only appended to, so the frozen image of the heap is just the
+ * bytes below the frozen length.
+ *
+ * The writers check bs_snap under the entry lock, i.e. with preemption
+ * off, so synchronize_sched() is enough to publish and retire it.
+ */
+static inline
+void *__svfs_snapshot_page(struct svfs_super_block *ssb, unsigned long pg)
+{
+    return (char *)ssb->bs_segs[pg / SVFS_BS_SEG_PAGES].bse +
+        ((pg % SVFS_BS_SEG_PAGES) << PAGE_CACHE_SHIFT);
+}
+
+/* the caller holds the entry lock */
+void svfs_snapshot_cow(struct svfs_super_block *ssb, unsigned long ino)
+{
+    struct svfs_bs_snapshot *snap = rcu_dereference(ssb->bs_snap);
+    unsigned long off, pg, last;
+    int seg = ino / SVFS_BS_SEG_ENTRIES;
+    void *copy;
+
+    if (!snap || seg >= snap->nsegs)
+        return;
+    off = (ino % SVFS_BS_SEG_ENTRIES) * sizeof(struct backing_store_entry);
+    pg = seg * SVFS_BS_SEG_PAGES + (off >> PAGE_CACHE_SHIFT);
+    last = seg * SVFS_BS_SEG_PAGES +
+        ((off + sizeof(struct backing_store_entry) - 1) >> PAGE_CACHE_SHIFT);
+    for (; pg <= last; pg++) {
+        if (test_bit(pg, snap->done))
+            continue;
+        spin_lock(&snap->lock);
+        if (!test_bit(pg, snap->done)) {
+            /* we must not sleep here, a failure breaks the snapshot */
+            copy = (void *)__get_free_page(GFP_ATOMIC);
+            if (copy) {
+                memcpy(copy, __svfs_snapshot_page(ssb, pg), PAGE_SIZE);
+                snap->copy[pg] = copy;
+                snap->copied++;
+            } else
+                snap->broken = 1;
+            __set_bit(pg, snap->done);
+        }
+        spin_unlock(&snap->lock);
+    }
+}
+
+static
+int __svfs_snapshot_write(struct file *filp, void *buf, size_t len,
+                          loff_t pos)
+{
+    mm_segment_t oldfs = get_fs();
+    ssize_t bw;
+
+    set_fs(KERNEL_DS);
+    bw = __svfs_backing_store_uwrite(filp, buf, len, &pos);
+    set_fs(oldfs);
+    if (bw != len)
+        return bw < 0 ? bw : -EIO;
+    return 0;
+}
+
+/* the header and the frozen pages, in the layout of the backing store */
+static
+int __svfs_snapshot_stream_table(struct svfs_super_block *ssb,
+                                 struct svfs_bs_snapshot *snap,
+                                 struct file *filp, char *buf)
+{
+    struct backing_store_header *hdr = (struct backing_store_header *)buf;
+    unsigned long pg;
+    int err;
+
+    memset(buf, 0, PAGE_SIZE);
+    hdr->magic = SVFS_BS_MAGIC;
+    hdr->version = SVFS_BS_VERSION;
+    hdr->entry_size = sizeof(struct backing_store_entry);
+    hdr->seg_size = SVFS_BS_SEG_SIZE;
+    hdr->nsegs = snap->nsegs;
+    hdr->features = snap->features;
+    err = __svfs_snapshot_write(filp, buf, SVFS_BS_HDR_SIZE, 0);
+    if (err)
+        return err;
+
+    for (pg = 0; pg < snap->npages; pg++) {
+        spin_lock(&snap->lock);
+        if (snap->copy[pg]) {
+            memcpy(buf, snap->copy[pg], PAGE_SIZE);
+            free_page((unsigned long)snap->copy[pg]);
+            snap->copy[pg] = NULL;
+        } else if (!ACCESS_ONCE(ssb->bs_segs[pg / SVFS_BS_SEG_PAGES].bse))
+            /* an empty segment the loader left unmapped */
+            memset(buf, 0, PAGE_SIZE);
+        else
+            memcpy(buf, __svfs_snapshot_page(ssb, pg), PAGE_SIZE);
+        __set_bit(pg, snap->done);
+        spin_unlock(&snap->lock);
+
+        err = __svfs_snapshot_write(filp, buf, PAGE_SIZE,
+                                    SVFS_BS_HDR_SIZE +
+                                    ((loff_t)pg << PAGE_CACHE_SHIFT));
+        if (err)
+            return err;
+        cond_resched();
+    }
+    return vfs_fsync(filp, filp->f_dentry, 1);
+}
+
+static
+int __svfs_snapshot_stream_heap(struct svfs_super_block *ssb,
+                                struct svfs_bs_snapshot *snap,
+                                struct file *filp)
+{
+    u32 start = 0;
+    int len, err;
+
+    while (start < snap->heap_len) {
+        len = min_t(u32, snap->heap_len,
+                    roundup(start + 1, SVFS_BS_HEAP_CHUNK)) - start;
+        /* the chunk may not be read in yet */
+        err = svfs_heap_load(ssb, start);
+        if (err)
+            return err;
+        err = __svfs_snapshot_write(filp, __svfs_heap(ssb, start), len,
+                                    start);
+        if (err)
+            return err;
+        start += len;
+    }
+    return vfs_fsync(filp, filp->f_dentry, 1);
+}
+
+static
+struct file *__svfs_snapshot_open(const char *path, const char *suffix)
+{
+    struct file *filp;
+    char *name;
+
+    name = __getname();
+    if (!name)
+        return ERR_PTR(-ENOMEM);
+    snprintf(name, PATH_MAX, "%s%s", path, suffix);
+    filp = filp_open(name, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                     S_IRUSR | S_IWUSR);
+    __putname(name);
+    return filp;
+}
+
+/*
+ * Write a consistent image of the backing store to @path and
+ * @path.heap, it mounts like any other backing store. The metadata
+ * operations go on meanwhile, they only pay for a page copy on the
+ * first change of a frozen page.
+ */
+int svfs_backing_store_snapshot(struct svfs_super_block *ssb,
+                                const char *path)
+{
+    struct svfs_bs_snapshot *snap;
+    struct file *tfilp, *hfilp;
+    unsigned long start = jiffies, pg;
+    char *buf;
+    int err = -ENOMEM;
+
+    mutex_lock(&ssb->bs_snap_mutex);
+    /* every segment is indexed once the loader is done */
+    svfs_backing_store_wait_loaded(ssb);
+    /* the last changes of the cached inodes go into the image */
+    svfs_backing_store_write_dirty(ssb);
+
+    snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap)
+        goto out_unlock;
+    spin_lock_init(&snap->lock);
+    snap->nsegs = ssb->bs_nsegs;
+    snap->npages = snap->nsegs * SVFS_BS_SEG_PAGES;
+    snap->features = ssb->bs_features;
+    snap->done = kzalloc(BITS_TO_LONGS(snap->npages) * sizeof(long),
+                         GFP_KERNEL);
+    if (!snap->done)
+        goto out_free;
+    snap->copy = vmalloc(snap->npages * sizeof(void *));
+    if (!snap->copy)
+        goto out_free_done;
+    memset(snap->copy, 0, snap->npages * sizeof(void *));
+    buf = (char *)__get_free_page(GFP_KERNEL);
+    if (!buf)
+        goto out_free_copy;
+
+    tfilp = __svfs_snapshot_open(path, "");
+    if (IS_ERR(tfilp)) {
+        err = PTR_ERR(tfilp);
+        goto out_free_buf;
+    }
+    hfilp = __svfs_snapshot_open(path, ".heap");
+    if (IS_ERR(hfilp)) {
+        err = PTR_ERR(hfilp);
+        goto out_close_table;
+    }
+
+    /* freeze: the writers in flight finish, the new ones see snap */
+    rcu_assign_pointer(ssb->bs_snap, snap);
+    synchronize_sched();
+    /* the frozen entries only refer to names below this */
+    snap->heap_len = ACCESS_ONCE(ssb->bs_heap_len);
+    smp_rmb();
+
+    err = __svfs_snapshot_stream_table(ssb, snap, tfilp, buf);
+    if (!err)
+        err = __svfs_snapshot_stream_heap(ssb, snap, hfilp);
+
+    rcu_assign_pointer(ssb->bs_snap, NULL);
+    synchronize_sched();
+    if (!err && snap->broken)
+        err = -ENOMEM;
+
+    ssb->bs_snap_ms = jiffies_to_msecs(jiffies - start);
+    ssb->bs_snap_copied = snap->copied;
+    ssb->bs_snap_err = err;
+    if (err)
+        svfs_err(mdc, "snapshot %s to %s failed %d\n", ssb->backing_store,
+                 path, err);
+    else
+        svfs_info(mdc, "snapshot %s to %s: %d segments, %lu pages copied "
+                  "on write, %u ms\n", ssb->backing_store, path,
+                  snap->nsegs, snap->copied, ssb->bs_snap_ms);
+
+    fput(hfilp);
+out_close_table:
+    fput(tfilp);
+out_free_buf:
+    free_page((unsigned long)buf);
+out_free_copy:
+    /* left over if the streaming failed */
+    for (pg = 0; pg < snap->npages; pg++) {
+        if (snap->copy[pg])
+            free_page((unsigned long)snap->copy[pg]);
+    }
+    vfree(snap->copy);
+out_free_done:
+    kfree(snap->done);
+out_free:
+    kfree(snap);
+out_unlock:
+    mutex_unlock(&ssb->bs_snap_mutex);
+    return err;
+}
@@ -0,0 +1,238 @@
+/**
+ * Copyright (c) 2009 Ma Can <ml.macana@gmail.com>
+ *                           <macan@ncic.ac.cn>
+ *
+ * Time-stamp: <2009-09-09 15:20:11 macan>
+ *
+ * svfs_crbench.c: measure how the file creates scale with the threads
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * Userspace create benchmark for a mounted SVFS. Each run starts 1, 2,
+ * 4, ... up to -j threads, each pinned to a CPU, and each thread
+ * creates -n empty files. The files go to a directory of the thread, or
+ * with -s to a single directory, where the parent entry is shared as
+ * well. The creates per second and the speedup over one thread are
+ * printed for each run.
+ *
+ * The create path takes the bse slot and the generation from the pool
+ * of its CPU (svfs_new_inode, see svfs_cpu_pool), so the rate should
+ * grow with the threads until the parent entries or the datastores are
+ * the limit. Run it on the same image before and after a change to the
+ * allocator, the numbers of one machine are only comparable to
+ * themselves.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+struct worker
+{
+    pthread_t thread;
+    int id, cpu;
+    char dir[PATH_MAX - 64];
+    unsigned long done;
+    int err;
+};
+
+static pthread_barrier_t start;
+static unsigned long nr_files = 10000;
+static int shared, keep;
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *worker(void *arg)
+{
+    struct worker *w = arg;
+    char path[PATH_MAX];
+    cpu_set_t set;
+    unsigned long i;
+    int fd;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    pthread_barrier_wait(&start);
+    for (i = 0; i < nr_files; i++) {
+        snprintf(path, sizeof(path), "%s/f%d.%lu", w->dir, w->id, i);
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            w->err = -errno;
+            break;
+        }
+        close(fd);
+        w->done++;
+    }
+    return NULL;
+}
+
+/* the files of a run go away before the next one */
+static void cleanup(struct worker *w, int jobs, const char *top)
+{
+    char path[PATH_MAX];
+    unsigned long i;
+    int j;
+
+    for (j = 0; j < jobs; j++) {
+        for (i = 0; i < w[j].done; i++) {
+            snprintf(path, sizeof(path), "%s/f%d.%lu", w[j].dir, w[j].id,
+                     i);
+            unlink(path);
+        }
+        if (!shared)
+            rmdir(w[j].dir);
+    }
+    rmdir(top);
+}
+
+/* one run with @jobs threads, returns the creates per second */
+static double run(const char *dir, int jobs, int ncpus)
+{
+    char top[PATH_MAX - 128];
+    struct worker *w;
+    unsigned long done = 0;
+    double t0, t1;
+    int i, nr, err = 0;
+
+    snprintf(top, sizeof(top), "%s/crbench.%d", dir, jobs);
+    if (mkdir(top, 0755)) {
+        fprintf(stderr, "mkdir %s: %s\n", top, strerror(errno));
+        return -1;
+    }
+    w = calloc(jobs, sizeof(*w));
+    if (!w)
+        return -1;
+    for (i = 0; i < jobs; i++) {
+        w[i].id = i;
+        w[i].cpu = i % ncpus;
+        if (shared) {
+            snprintf(w[i].dir, sizeof(w[i].dir), "%s", top);
+            continue;
+        }
+        snprintf(w[i].dir, sizeof(w[i].dir), "%s/j%d", top, i);
+        if (mkdir(w[i].dir, 0755)) {
+            fprintf(stderr, "mkdir %s: %s\n", w[i].dir, strerror(errno));
+            free(w);
+            return -1;
+        }
+    }
+
+    pthread_barrier_init(&start, NULL, jobs + 1);
+    for (nr = 0; nr < jobs; nr++) {
+        if (pthread_create(&w[nr].thread, NULL, worker, &w[nr]))
+            break;
+    }
+    if (nr < jobs) {
+        /* the barrier counts on all of them */
+        fprintf(stderr, "only %d of %d threads started\n", nr, jobs);
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_wait(&start);
+    t0 = now();
+    for (i = 0; i < jobs; i++) {
+        pthread_join(w[i].thread, NULL);
+        done += w[i].done;
+        if (w[i].err && !err)
+            err = w[i].err;
+    }
+    t1 = now();
+    pthread_barrier_destroy(&start);
+
+    if (err)
+        fprintf(stderr, "create failed: %s\n", strerror(-err));
+    if (!keep)
+        cleanup(w, jobs, top);
+    free(w);
+    return err ? -1 : done / (t1 - t0);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-j jobs] [-n files] [-s] [-k] dir\n\n"
+            "  -j jobs       the most threads, the runs double from one "
+            "(default: the\n"
+            "                online CPUs)\n"
+            "  -n files      files created by each thread (default %lu)\n"
+            "  -s            all the threads create in one directory\n"
+            "  -k            keep the files\n", prog, nr_files);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_jobs = ncpus, jobs, opt;
+    double rate, base = 0;
+
+    while ((opt = getopt(argc, argv, "j:n:sk")) != -1) {
+        switch (opt) {
+        case 'j':
+            max_jobs = atoi(optarg);
+            break;
+        case 'n':
+            nr_files = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            shared = 1;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || max_jobs <= 0 || !nr_files || ncpus <= 0 ||
+        strlen(argv[optind]) > PATH_MAX - 160)
+        usage(argv[0]);
+
+    printf("%d CPUs, %lu files per thread, %s directory\n", ncpus,
+           nr_files, shared ? "one shared" : "one per thread");
+    printf("%8s %12s %8s\n", "threads", "creates/s", "speedup");
+    for (jobs = 1; ; jobs *= 2) {
+        if (jobs > max_jobs)
+            jobs = max_jobs;
+        rate = run(argv[optind], jobs, ncpus);
+        if (rate < 0)
+            return EXIT_FAILURE;
+        if (!base)
+            base = rate;
+        printf("%8d %12.0f %7.2fx\n", jobs, rate, rate / base);
+        if (jobs == max_jobs)
+            break;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,948 @@
+/**
+ * Copyright (c) 2009 Ma Can <ml.macana@gmail.com>
+ *                           <macan@ncic.ac.cn>
+ *
+ * Time-stamp: <2009-09-07 10:12:45 macan>
+ *
+ * svfs_mkbs.c: build a backing store image from a tree or a file list
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * Userspace builder of the backing store files (<image> and
+ * <image>.heap), in the format of test/verif/backing_store.c. The
+ * entries are laid out breadth first, so the children of a directory
+ * sit in consecutive slots: the scanners of the mount build each child
+ * tree in ino order and readdir stays in one segment. Every entry is
+ * sealed, the image mounts with the checksums on.
+ *
+ * The regular files are classified by their size as the kernel does
+ * (SMALL, NORMAL, LARGE, see svfs_datastore_classify()) and point to
+ * the datastores given by -d: the small and normal ones round robin on
+ * the fast tier, the large ones on the capacity tier, any datastore if
+ * the tier has none. With -p their ref files (<datastore>/.ino_N) are created by -j
+ * threads, and with -c the data of an imported tree is copied in.
+ *
+ * The image must be built on the architecture of the kernel, the
+ * entries are in its native layout.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+typedef uint16_t u16;
+typedef uint32_t u32;
+
+/* keep in sync with include/svfs_i.h and include/svfs.h */
+#define SVFS_BS_MAGIC           0x53564253
+#define SVFS_BS_VERSION         2
+#define SVFS_BS_FEAT_CSUM       0x00000001
+#define SVFS_BS_VALID           0x00000004
+#define SVFS_BS_DIR             0x80000000
+#define SVFS_BS_FILE            0x40000000
+#define SVFS_BS_LINK            0x20000000
+#define SVFS_BS_SEG_SIZE        (256 * 1024)
+#define SVFS_BS_SEG_ENTRIES     (SVFS_BS_SEG_SIZE / sizeof(struct bs_entry))
+#define SVFS_BS_HEAP_CHUNK      (64 * 1024)
+#define SVFS_BS_HEAP_CHUNKS     4096
+#define SVFS_SHARD_SLOTS        (1UL << 24)
+#define SVFS_ROOT_INODE         0
+
+#define LLFS_TYPE_EXT4          0x01
+#define LLFS_TYPE_EXT3          0x02
+#define LLFS_TYPE_NFS           0x04
+#define LLFS_TYPE_NFS4          0x08
+
+#define SVFS_IF_SMALL           0x80000000
+#define SVFS_IF_LARGE           0x40000000
+#define SVFS_IF_NORMAL          0x10000000
+
+#define SVFS_TIER_FAST          0
+#define SVFS_TIER_CAPACITY      1
+#define SVFS_TIER_MAX           2
+
+struct bs_header
+{
+    u32 magic;
+    u32 version;
+    u32 entry_size;
+    u32 seg_size;
+    u32 nsegs;
+    u32 features;
+};
+
+/* struct backing_store_entry, with the kernel types spelled out */
+struct bs_entry
+{
+    u32 parent_offset;
+    u32 depth;
+    u32 state;
+    u32 disk_flags;
+    int64_t disksize;
+    u32 nlink;
+    u16 mode;                   /* umode_t */
+    u16 pad;
+    u32 uid;
+    u32 gid;
+    struct timespec atime, ctime, mtime;
+    u32 generation;
+    u32 llfs_type;
+    u32 llfs_fsid;
+    u32 name_off;
+    u32 link_off;
+    u16 name_len;
+    u16 link_len;
+    u32 csum;
+};
+
+#define MAX_DATASTORES 16
+
+struct datastore
+{
+    u32 type;
+    u32 fsid;
+    int tier;
+    char *path;
+};
+
+static struct bs_entry *table;
+static unsigned long nr_entries, max_entries;
+static char *heap;
+static u32 heap_len;
+static struct datastore ds[MAX_DATASTORES];
+static int nr_ds;
+static int ds_next[SVFS_TIER_MAX];
+static const char *tier_names[SVFS_TIER_MAX] = {"fast", "capacity"};
+/* the defaults of svfs_tier_small_max and svfs_tier_large_min */
+static unsigned long long tier_small_max = 256 << 10;
+static unsigned long long tier_large_min = 64 << 20;
+static u32 next_generation;
+static const char *tree_root;
+
+/* crc32c(~0, ...) of the kernel, i.e. without the final inversion */
+static u32 crc32c_table[256];
+
+static void crc32c_init(void)
+{
+    u32 i, j, c;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++)
+            c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+        crc32c_table[i] = c;
+    }
+}
+
+static u32 crc32c(u32 crc, const void *p, size_t len)
+{
+    const unsigned char *b = p;
+
+    while (len--)
+        crc = crc32c_table[(crc ^ *b++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+/* svfs_datastore_fsid() of mdc/datastore.c */
+static u32 datastore_fsid(const char *name)
+{
+    u32 h = 0, g;
+
+    while (*name) {
+        h = (h << 4) + *name++;
+        if ((g = (h & 0xf0000000)))
+            h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
+static int datastore_add(char *arg)
+{
+    static const struct {
+        const char *name;
+        u32 type;
+    } types[] = {
+        {"ext4", LLFS_TYPE_EXT4},
+        {"ext3", LLFS_TYPE_EXT3},
+        {"nfs", LLFS_TYPE_NFS},
+        {"nfs4", LLFS_TYPE_NFS4},
+    };
+    char *path = strchr(arg, ':'), *tier;
+    size_t i;
+
+    if (!path || nr_ds == MAX_DATASTORES)
+        return -EINVAL;
+    *path++ = '\0';
+    /* as svfs_datastore_adding(): the capacity tier if none is given */
+    ds[nr_ds].tier = SVFS_TIER_CAPACITY;
+    tier = strrchr(path, ':');
+    if (tier) {
+        for (i = 0; i < SVFS_TIER_MAX; i++) {
+            if (!strcmp(tier + 1, tier_names[i]))
+                break;
+        }
+        if (i == SVFS_TIER_MAX)
+            return -EINVAL;
+        *tier = '\0';
+        ds[nr_ds].tier = i;
+    }
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (!strcmp(arg, types[i].name))
+            break;
+    }
+    if (i == sizeof(types) / sizeof(types[0]))
+        return -EINVAL;
+    ds[nr_ds].type = types[i].type;
+    /* the path must be spelled as the datastore is added to the kernel */
+    ds[nr_ds].fsid = datastore_fsid(path);
+    ds[nr_ds].path = path;
+    nr_ds++;
+    return 0;
+}
+
+/* the thresholds are small_max:large_min, in bytes */
+static int tier_set(const char *arg)
+{
+    char *end;
+
+    tier_small_max = strtoull(arg, &end, 0);
+    if (*end != ':')
+        return -EINVAL;
+    tier_large_min = strtoull(end + 1, &end, 0);
+    if (*end || tier_large_min <= tier_small_max)
+        return -EINVAL;
+    return 0;
+}
+
+/* the size class of a regular file, svfs_datastore_classify() */
+static u32 file_class(unsigned long long size)
+{
+    if (size >= tier_large_min)
+        return SVFS_IF_LARGE;
+    if (size > tier_small_max)
+        return SVFS_IF_NORMAL;
+    return SVFS_IF_SMALL;
+}
+
+/* round robin on the tier of @class, on all the datastores if it is empty */
+static struct datastore *datastore_place(u32 class, unsigned long ino)
+{
+    int tier = class & SVFS_IF_LARGE ? SVFS_TIER_CAPACITY : SVFS_TIER_FAST;
+    int i, count = 0, n;
+
+    for (i = 0; i < nr_ds; i++)
+        count += ds[i].tier == tier;
+    if (!count)
+        return &ds[ino % nr_ds];
+    n = ds_next[tier]++ % count;
+    for (i = 0; i < nr_ds; i++) {
+        if (ds[i].tier == tier && n-- == 0)
+            break;
+    }
+    return &ds[i];
+}
+
+/* the datastore an entry points to */
+static struct datastore *datastore_of(const struct bs_entry *e)
+{
+    int i;
+
+    for (i = 0; i < nr_ds; i++) {
+        if (ds[i].type == e->llfs_type && ds[i].fsid == e->llfs_fsid)
+            return &ds[i];
+    }
+    return NULL;
+}
+
+/* svfs_heap_append(): a name never crosses a chunk */
+static int heap_append(const char *name, int len, u32 *off)
+{
+    u32 pos = heap_len;
+
+    if (len + 1 > SVFS_BS_HEAP_CHUNK)
+        return -ENAMETOOLONG;
+    if (pos % SVFS_BS_HEAP_CHUNK + len + 1 > SVFS_BS_HEAP_CHUNK)
+        pos = (pos / SVFS_BS_HEAP_CHUNK + 1) * SVFS_BS_HEAP_CHUNK;
+    if ((unsigned long)pos + len + 1 >
+        (unsigned long)SVFS_BS_HEAP_CHUNKS * SVFS_BS_HEAP_CHUNK)
+        return -ENOSPC;
+    memcpy(heap + pos, name, len);
+    heap[pos + len] = '\0';
+    heap_len = pos + len + 1;
+    *off = pos;
+    return 0;
+}
+
+static int table_grow(void)
+{
+    unsigned long max = max_entries ? max_entries * 2 : SVFS_BS_SEG_ENTRIES;
+    struct bs_entry *t;
+
+    if (max_entries >= SVFS_SHARD_SLOTS)
+        return -EFBIG;
+    if (max > SVFS_SHARD_SLOTS)
+        max = SVFS_SHARD_SLOTS;
+    t = realloc(table, max * sizeof(*t));
+    if (!t)
+        return -ENOMEM;
+    memset(t + max_entries, 0, (max - max_entries) * sizeof(*t));
+    table = t;
+    max_entries = max;
+    return 0;
+}
+
+/* the next slot, under @parent */
+static long entry_add(unsigned long parent, const char *name,
+                      const struct stat *st, const char *link)
+{
+    struct bs_entry *e, *p;
+    struct datastore *d;
+    unsigned long ino;
+    int err;
+
+    if (nr_entries == max_entries) {
+        err = table_grow();
+        if (err)
+            return err;
+    }
+    ino = nr_entries;
+    e = &table[ino];
+    p = &table[parent];
+    e->parent_offset = parent;
+    e->depth = ino == SVFS_ROOT_INODE ? 0 : p->depth + 1;
+    e->mode = st->st_mode;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    e->atime.tv_sec = st->st_atime;
+    e->ctime.tv_sec = st->st_ctime;
+    e->mtime.tv_sec = st->st_mtime;
+    e->generation = next_generation++;
+    e->state = SVFS_BS_VALID;
+    if (S_ISDIR(st->st_mode)) {
+        e->state |= SVFS_BS_DIR;
+        e->nlink = 2;
+        if (ino != SVFS_ROOT_INODE)
+            p->nlink++;
+    } else if (S_ISLNK(st->st_mode)) {
+        e->state |= SVFS_BS_LINK;
+        e->nlink = 1;
+        e->link_len = strlen(link);
+        if (!e->link_len || e->link_len != strlen(link))
+            return -ENAMETOOLONG;
+        err = heap_append(link, e->link_len, &e->link_off);
+        if (err)
+            return err;
+    } else if (S_ISREG(st->st_mode)) {
+        e->state |= SVFS_BS_FILE;
+        e->nlink = 1;
+        /* the list files are empty, small as the new files of ialloc */
+        e->disk_flags = file_class(st->st_size);
+        if (nr_ds) {
+            d = datastore_place(e->disk_flags, ino);
+            e->llfs_type = d->type;
+            e->llfs_fsid = d->fsid;
+        }
+    } else
+        return -EINVAL;
+    if (ino != SVFS_ROOT_INODE) {
+        e->name_len = strlen(name);
+        err = heap_append(name, e->name_len, &e->name_off);
+        if (err)
+            return err;
+    }
+    nr_entries++;
+    return ino;
+}
+
+/* the source path of @ino, tree_root/a/b/c */
+static int source_path(unsigned long ino, char *buf, size_t len)
+{
+    struct bs_entry *e;
+    size_t l = strlen(tree_root), pos = len - 1;
+
+    buf[pos] = '\0';
+    while (ino != SVFS_ROOT_INODE) {
+        e = &table[ino];
+        if (pos < l + e->name_len + 1)
+            return -ENAMETOOLONG;
+        pos -= e->name_len;
+        memcpy(buf + pos, heap + e->name_off, e->name_len);
+        buf[--pos] = '/';
+        ino = e->parent_offset;
+    }
+    memmove(buf + l, buf + pos, len - pos);
+    memcpy(buf, tree_root, l);
+    return 0;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* list directory @ino of the tree, breadth first by the slot order */
+static int tree_scan_dir(unsigned long ino, int keep_size)
+{
+    char path[PATH_MAX], sub[PATH_MAX + NAME_MAX + 2], link[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    char **names = NULL;
+    int nr = 0, max = 0, i, err = 0;
+    ssize_t ll;
+    long child;
+    DIR *d;
+
+    err = source_path(ino, path, sizeof(path));
+    if (err)
+        return err;
+    d = opendir(path);
+    if (!d)
+        return -errno;
+    while ((de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (nr == max) {
+            char **n;
+
+            max = max ? max * 2 : 64;
+            n = realloc(names, max * sizeof(char *));
+            if (!n) {
+                err = -ENOMEM;
+                goto out;
+            }
+            names = n;
+        }
+        names[nr] = strdup(de->d_name);
+        if (!names[nr]) {
+            err = -ENOMEM;
+            goto out;
+        }
+        nr++;
+    }
+    qsort(names, nr, sizeof(char *), name_cmp);
+
+    for (i = 0; i < nr; i++) {
+        snprintf(sub, sizeof(sub), "%s/%s", path, names[i]);
+        if (lstat(sub, &st)) {
+            fprintf(stderr, "skip %s: %s\n", sub, strerror(errno));
+            continue;
+        }
+        link[0] = '\0';
+        if (S_ISLNK(st.st_mode)) {
+            ll = readlink(sub, link, sizeof(link) - 1);
+            if (ll <= 0) {
+                fprintf(stderr, "skip %s: bad symlink\n", sub);
+                continue;
+            }
+            link[ll] = '\0';
+        } else if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            fprintf(stderr, "skip %s: not a file, a directory or a "
+                    "symlink\n", sub);
+            continue;
+        }
+        child = entry_add(ino, names[i], &st, link);
+        if (child < 0) {
+            err = child;
+            fprintf(stderr, "add %s: %s\n", sub, strerror(-err));
+            goto out;
+        }
+        if (S_ISREG(st.st_mode) && keep_size)
+            table[child].disksize = st.st_size;
+    }
+out:
+    for (i = 0; i < nr; i++)
+        free(names[i]);
+    free(names);
+    closedir(d);
+    return err;
+}
+
+static int tree_import(int keep_size)
+{
+    struct stat st;
+    unsigned long ino;
+    int err;
+
+    if (stat(tree_root, &st))
+        return -errno;
+    if (!S_ISDIR(st.st_mode))
+        return -ENOTDIR;
+    err = entry_add(SVFS_ROOT_INODE, NULL, &st, NULL);
+    if (err < 0)
+        return err;
+    /* the slot order is the breadth first order */
+    for (ino = 0; ino < nr_entries; ino++) {
+        if (!(table[ino].state & SVFS_BS_DIR))
+            continue;
+        err = tree_scan_dir(ino, keep_size);
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+/*
+ * The file list holds one path per line, relative to the root. A
+ * trailing '/' makes a directory, the missing parents are made too.
+ */
+struct lnode
+{
+    char *name;
+    struct lnode *parent, *child, *last, *next, *hnext;
+    unsigned long ino;
+    int is_dir;
+};
+
+#define LHASH_BITS 20
+static struct lnode *lhash[1 << LHASH_BITS];
+
+static unsigned int lnode_hash(struct lnode *parent, const char *name,
+                               int len)
+{
+    u32 h = crc32c((u32)(uintptr_t)parent, name, len);
+
+    return h & ((1 << LHASH_BITS) - 1);
+}
+
+static struct lnode *lnode_get(struct lnode *parent, const char *name,
+                               int len, int is_dir)
+{
+    unsigned int h = lnode_hash(parent, name, len);
+    struct lnode *n;
+
+    for (n = lhash[h]; n; n = n->hnext) {
+        if (n->parent == parent && !strncmp(n->name, name, len) &&
+            !n->name[len]) {
+            n->is_dir |= is_dir;
+            return n;
+        }
+    }
+    n = calloc(1, sizeof(*n));
+    if (!n)
+        return NULL;
+    n->name = strndup(name, len);
+    if (!n->name) {
+        free(n);
+        return NULL;
+    }
+    n->parent = parent;
+    n->is_dir = is_dir;
+    if (parent->last)
+        parent->last->next = n;
+    else
+        parent->child = n;
+    parent->last = n;
+    n->hnext = lhash[h];
+    lhash[h] = n;
+    return n;
+}
+
+static int list_import(const char *list)
+{
+    struct lnode root = {.ino = SVFS_ROOT_INODE, .is_dir = 1}, **order = NULL, *n, *c;
+    char *line = NULL, *p, *s;
+    size_t cap = 0, nr = 0, max = 0, i;
+    ssize_t l;
+    struct stat st;
+    FILE *f;
+    long ino;
+
+    f = strcmp(list, "-") ? fopen(list, "r") : stdin;
+    if (!f)
+        return -errno;
+    while ((l = getline(&line, &cap, f)) > 0) {
+        if (line[l - 1] == '\n')
+            line[--l] = '\0';
+        n = &root;
+        for (p = line; *p; p = s) {
+            while (*p == '/')
+                p++;
+            if (!*p)
+                break;
+            s = strchrnul(p, '/');
+            n = lnode_get(n, p, s - p, *s == '/');
+            if (!n)
+                return -ENOMEM;
+        }
+    }
+    free(line);
+    if (f != stdin)
+        fclose(f);
+
+    memset(&st, 0, sizeof(st));
+    st.st_atime = st.st_mtime = st.st_ctime = time(NULL);
+    st.st_uid = getuid();
+    st.st_gid = getgid();
+    /* walk breadth first, the slots follow the order array */
+    for (n = &root, i = 0; n; n = i < nr ? order[i++] : NULL) {
+        for (c = n->child; c; c = c->next) {
+            if (nr == max) {
+                struct lnode **o;
+
+                max = max ? max * 2 : 4096;
+                o = realloc(order, max * sizeof(*o));
+                if (!o)
+                    return -ENOMEM;
+                order = o;
+            }
+            order[nr++] = c;
+        }
+    }
+    st.st_mode = S_IFDIR | 0755;
+    ino = entry_add(SVFS_ROOT_INODE, NULL, &st, NULL);
+    for (i = 0; ino >= 0 && i < nr; i++) {
+        n = order[i];
+        st.st_mode = n->is_dir ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+        /* the parents come first */
+        ino = entry_add(n->parent->ino, n->name, &st, NULL);
+        n->ino = ino;
+    }
+    free(order);
+    return ino < 0 ? ino : 0;
+}
+
+struct ref_worker
+{
+    pthread_t thread;
+    int copy;
+    unsigned long done, errors;
+};
+
+static unsigned long ref_next;
+
+#define REF_BATCH 256
+
+#define REF_COPY_BUF (1 << 20)
+
+static int ref_copy(unsigned long ino, int fd, char *buf)
+{
+    char path[PATH_MAX];
+    ssize_t br, bw;
+    int sfd, err = 0;
+
+    err = source_path(ino, path, sizeof(path));
+    if (err)
+        return err;
+    sfd = open(path, O_RDONLY);
+    if (sfd < 0)
+        return -errno;
+    while ((br = read(sfd, buf, REF_COPY_BUF)) > 0) {
+        bw = write(fd, buf, br);
+        if (bw != br) {
+            err = bw < 0 ? -errno : -EIO;
+            break;
+        }
+    }
+    if (br < 0)
+        err = -errno;
+    close(sfd);
+    return err;
+}
+
+/* the ref path is <datastore>/.ino_N, see svfs_backing_store_get_path2() */
+static void *ref_worker(void *data)
+{
+    struct ref_worker *w = data;
+    char path[PATH_MAX], *buf = NULL;
+    unsigned long ino, end;
+    struct bs_entry *e;
+    int fd, err;
+
+    if (w->copy) {
+        buf = malloc(REF_COPY_BUF);
+        if (!buf) {
+            w->errors++;
+            return NULL;
+        }
+    }
+    for (;;) {
+        ino = __sync_fetch_and_add(&ref_next, REF_BATCH);
+        if (ino >= nr_entries)
+            break;
+        end = ino + REF_BATCH < nr_entries ? ino + REF_BATCH : nr_entries;
+        for (; ino < end; ino++) {
+            e = &table[ino];
+            if (!(e->state & SVFS_BS_FILE))
+                continue;
+            snprintf(path, sizeof(path), "%s/.ino_%lu",
+                     datastore_of(e)->path, ino);
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                fprintf(stderr, "create %s: %s\n", path, strerror(errno));
+                w->errors++;
+                continue;
+            }
+            err = buf ? ref_copy(ino, fd, buf) : 0;
+            if (close(fd) && !err)
+                err = -errno;
+            if (err) {
+                fprintf(stderr, "copy into %s: %s\n", path, strerror(-err));
+                w->errors++;
+                continue;
+            }
+            w->done++;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int ref_create(int jobs, int copy)
+{
+    struct ref_worker *w;
+    unsigned long done = 0, errors = 0;
+    int i, nr;
+
+    w = calloc(jobs, sizeof(*w));
+    if (!w)
+        return -ENOMEM;
+    for (nr = 0; nr < jobs; nr++) {
+        w[nr].copy = copy;
+        if (pthread_create(&w[nr].thread, NULL, ref_worker, &w[nr]))
+            break;
+    }
+    if (!nr) {
+        free(w);
+        return -EAGAIN;
+    }
+    for (i = 0; i < nr; i++) {
+        pthread_join(w[i].thread, NULL);
+        done += w[i].done;
+        errors += w[i].errors;
+    }
+    free(w);
+    printf("%lu ref files created by %d threads, %lu failed\n", done, nr,
+           errors);
+    return errors ? -EIO : 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len, off_t pos)
+{
+    ssize_t bw;
+
+    while (len) {
+        bw = pwrite(fd, buf, len, pos);
+        if (bw < 0)
+            return -errno;
+        buf = (const char *)buf + bw;
+        len -= bw;
+        pos += bw;
+    }
+    return 0;
+}
+
+static int image_write(const char *image, unsigned long extra, int force)
+{
+    struct bs_header hdr;
+    char *name, *page;
+    unsigned long nsegs, ino, seg;
+    long psize = sysconf(_SC_PAGESIZE);
+    int fd, flags = O_WRONLY | O_CREAT | (force ? O_TRUNC : O_EXCL);
+    int err;
+
+    nsegs = (nr_entries + extra + SVFS_BS_SEG_ENTRIES - 1) /
+        SVFS_BS_SEG_ENTRIES;
+    if (nsegs * SVFS_BS_SEG_ENTRIES > SVFS_SHARD_SLOTS)
+        return -EFBIG;
+    while (max_entries < nsegs * SVFS_BS_SEG_ENTRIES) {
+        err = table_grow();
+        if (err)
+            return err;
+    }
+    for (ino = 0; ino < nr_entries; ino++)
+        table[ino].csum = crc32c(~0, &table[ino],
+                                 offsetof(struct bs_entry, csum));
+
+    name = malloc(PATH_MAX);
+    page = calloc(1, psize);
+    if (!name || !page) {
+        err = -ENOMEM;
+        goto out;
+    }
+    /* a stale journal would be replayed over the new table */
+    snprintf(name, PATH_MAX, "%s.jnl", image);
+    if (unlink(name) && errno != ENOENT) {
+        err = -errno;
+        goto out;
+    }
+
+    fd = open(image, flags, 0700);
+    if (fd < 0) {
+        err = -errno;
+        goto out;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SVFS_BS_MAGIC;
+    hdr.version = SVFS_BS_VERSION;
+    hdr.entry_size = sizeof(struct bs_entry);
+    hdr.seg_size = SVFS_BS_SEG_SIZE;
+    hdr.nsegs = nsegs;
+    hdr.features = SVFS_BS_FEAT_CSUM;
+    memcpy(page, &hdr, sizeof(hdr));
+    err = write_all(fd, page, psize, 0);
+    /* the entries do not fill a segment, each one starts on its own */
+    for (seg = 0; !err && seg < nsegs; seg++)
+        err = write_all(fd, table + seg * SVFS_BS_SEG_ENTRIES,
+                        SVFS_BS_SEG_ENTRIES * sizeof(struct bs_entry),
+                        psize + (off_t)seg * SVFS_BS_SEG_SIZE);
+    if (!err && ftruncate(fd, psize + (off_t)nsegs * SVFS_BS_SEG_SIZE))
+        err = -errno;
+    if (!err && fsync(fd))
+        err = -errno;
+    close(fd);
+    if (err)
+        goto out;
+
+    snprintf(name, PATH_MAX, "%s.heap", image);
+    fd = open(name, flags, 0700);
+    if (fd < 0) {
+        err = -errno;
+        goto out;
+    }
+    err = write_all(fd, heap, heap_len, 0);
+    if (!err && fsync(fd))
+        err = -errno;
+    close(fd);
+    if (!err)
+        printf("%s: %lu entries in %lu segments, %u bytes of names\n",
+               image, nr_entries, nsegs, heap_len);
+out:
+    free(page);
+    free(name);
+    return err;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s (-t dir | -l list) [-d type:path[:tier]]... [-p] "
+            "[-c]\n"
+            "          [-T small:large] [-j jobs] [-n entries] [-f] image\n\n"
+            "  -t dir        import the tree under dir\n"
+            "  -l list       import the paths in list ('-' for stdin), "
+            "a trailing '/'\n"
+            "                makes a directory, the files are empty\n"
+            "  -d type:path[:tier]\n"
+            "                a datastore (ext3, ext4, nfs, nfs4) for the "
+            "regular files,\n"
+            "                spelled as it is added to the kernel, on the "
+            "fast or the\n"
+            "                capacity (default) tier\n"
+            "  -p            create the ref files on the datastores\n"
+            "  -c            with -t -p, copy the file data into the ref "
+            "files\n"
+            "  -T small:large\n"
+            "                the size classes of the files, as "
+            "svfs_tier_small_max and\n"
+            "                svfs_tier_large_min (default %llu:%llu)\n"
+            "  -j jobs       threads creating the ref files (default 8)\n"
+            "  -n entries    free entries to leave in the table\n"
+            "  -f            overwrite an existing image\n", prog,
+            tier_small_max, tier_large_min);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *list = NULL;
+    unsigned long extra = 0;
+    int jobs = 8, precreate = 0, copy = 0, keep_size = 0, force = 0;
+    int opt, err;
+
+    while ((opt = getopt(argc, argv, "t:l:d:pcT:j:n:f")) != -1) {
+        switch (opt) {
+        case 't':
+            tree_root = optarg;
+            break;
+        case 'l':
+            list = optarg;
+            break;
+        case 'd':
+            if (datastore_add(optarg))
+                usage(argv[0]);
+            break;
+        case 'p':
+            precreate = 1;
+            break;
+        case 'c':
+            /* the copied data is the file, the entry takes its size */
+            copy = keep_size = 1;
+            break;
+        case 'T':
+            if (tier_set(optarg))
+                usage(argv[0]);
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'n':
+            extra = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            force = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || !tree_root == !list || jobs <= 0 ||
+        (precreate && !nr_ds) || (copy && (!precreate || !tree_root)))
+        usage(argv[0]);
+    if (!nr_ds)
+        fprintf(stderr, "no datastore given, the regular files can not be "
+                "opened\n");
+
+    crc32c_init();
+    srandom(time(NULL) ^ getpid());
+    next_generation = random();
+    heap = malloc((size_t)SVFS_BS_HEAP_CHUNKS * SVFS_BS_HEAP_CHUNK);
+    if (!heap) {
+        fprintf(stderr, "no memory for the name heap\n");
+        return EXIT_FAILURE;
+    }
+
+    err = tree_root ? tree_import(keep_size) : list_import(list);
+    if (err) {
+        fprintf(stderr, "import failed: %s\n", strerror(-err));
+        return EXIT_FAILURE;
+    }
+    if (precreate) {
+        err = ref_create(jobs, copy);
+        if (err)
+            return EXIT_FAILURE;
+    }
+    err = image_write(argv[optind], extra, force);
+    if (err) {
+        fprintf(stderr, "write %s failed: %s\n", argv[optind],
+                strerror(-err));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}